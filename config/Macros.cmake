@@ -111,3 +111,24 @@ macro ( BundleQtPlugin PLUGIN PLUGINPATH )
 	get_target_property(_loc "${PLUGIN}" LOCATION)
 	install( FILES "${_loc}" DESTINATION "${CMAKE_INSTALL_PREFIX}/${CLIENTNAME}.app/Contents/PlugIns/${PLUGINPATH}" )
 endmacro()
+
+# Add the x86 SIMD compositing kernels to a list of sources.
+# Each kernel is compiled for its own instruction set. The best one
+# supported by the CPU is selected at runtime (see core/rasterop.cpp)
+macro ( rasterop_simd_sources SOURCELIST COREDIR )
+	if ( CMAKE_SYSTEM_PROCESSOR MATCHES "^(x86|x86_64|AMD64|amd64|i.86)$" )
+		add_definitions ( -DHAVE_X86_SIMD )
+		set ( ${SOURCELIST} ${${SOURCELIST}}
+			${COREDIR}/rasterop_sse2.cpp
+			${COREDIR}/rasterop_ssse3.cpp
+			${COREDIR}/rasterop_avx2.cpp
+		)
+		if ( MSVC )
+			set_source_files_properties ( ${COREDIR}/rasterop_avx2.cpp PROPERTIES COMPILE_FLAGS "/arch:AVX2" )
+		else ( )
+			set_source_files_properties ( ${COREDIR}/rasterop_sse2.cpp PROPERTIES COMPILE_FLAGS "-msse2" )
+			set_source_files_properties ( ${COREDIR}/rasterop_ssse3.cpp PROPERTIES COMPILE_FLAGS "-mssse3" )
+			set_source_files_properties ( ${COREDIR}/rasterop_avx2.cpp PROPERTIES COMPILE_FLAGS "-mavx2" )
+		endif ( )
+	endif ( )
+endmacro ( )
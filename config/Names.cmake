@@ -5,6 +5,8 @@ else ()
 endif ()
 
 set ( DPSHAREDLIB "drawpilenet" )
+set ( DPCORELIB "drawpilecore" )
+set ( DPCANVASLIB "drawpilecanvas" )
 
 set ( SRVNAME "${PROJECT_NAME}-srv" )
 set ( SRVLIB "lib${SRVNAME}" )
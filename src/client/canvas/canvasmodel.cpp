@@ -29,6 +29,7 @@
 
 #include "core/layerstack.h"
 #include "core/layer.h"
+#include "core/tile.h"
 #include "ora/orawriter.h"
 
 #include "../shared/net/meta.h"
@@ -39,6 +40,7 @@
 #include <QDebug>
 #include <QPainter>
 #include <QThread>
+#include <QTimer>
 #include <QApplication>
 
 namespace canvas {
@@ -60,6 +62,9 @@ CanvasModel::CanvasModel(int localUserId, QObject *parent)
 	m_cmdqueue = new CommandQueue(this);
 
 	m_layerstack = new paintcore::LayerStack(m_cmdqueue);
+	// Limit canvas view refreshes to (about) 60 frames per second
+	m_layerstack->setNotificationInterval(QSettings().value("settings/canvasrefreshinterval", 16).toInt());
+	m_layerstack->setSnapshotsEnabled(true);
 	m_statetracker = new StateTracker(m_layerstack, localUserId, m_cmdqueue);
 	m_aclfilter = new AclFilter(m_layerstack, m_cmdqueue);
 	m_aclfilter->reset(localUserId, m_cmdqueue);
@@ -89,6 +94,11 @@ CanvasModel::CanvasModel(int localUserId, QObject *parent)
 	connect(m_statetracker->annotations(), &AnnotationState::annotationChanged, m_annotations, &AnnotationModel::changeAnnotation);
 	connect(m_statetracker->annotations(), &AnnotationState::annotationDeleted, m_annotations, &AnnotationModel::deleteAnnotation);
 	connect(m_statetracker->annotations(), &AnnotationState::annotationsReset, m_annotations, &AnnotationModel::setAnnotations);
+
+	// Give pooled tile memory back to the system when we're not drawing
+	QTimer *tileMemoryTimer = new QTimer(this);
+	connect(tileMemoryTimer, &QTimer::timeout, []() { paintcore::TileData::releaseIdleMemory(); });
+	tileMemoryTimer->start(1000);
 }
 
 CanvasModel::~CanvasModel()
@@ -49,6 +49,10 @@ public:
 
 	bool isConcurrentWith(const AffectedArea &other) const;
 
+	Domain domain() const { return _domain; }
+	int layer() const { return _layer; }
+	QRect bounds() const { return _bounds; }
+
 private:
 	Domain _domain;
 	int _layer;
@@ -126,6 +130,12 @@ public:
 	 */
 	QList<protocol::MessagePtr> messages() const { return _messages; }
 
+	/**
+	 * @brief Get the areas affected by the messages in the local fork
+	 * @return
+	 */
+	QList<AffectedArea> areas() const { return _areas; }
+
 	/**
 	 * @brief Empty the local fork
 	 */
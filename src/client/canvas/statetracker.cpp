@@ -24,6 +24,7 @@
 
 #include "core/layerstack.h"
 #include "core/layer.h"
+#include "core/tile.h"
 #include "net/commands.h"
 
 #include "../shared/net/pen.h"
@@ -40,13 +41,14 @@
 namespace canvas {
 
 struct StateSavepoint::Data {
-	Data() : timestamp(0), streampointer(-1), canvas(0), _refcount(1) {}
+	Data() : timestamp(0), streampointer(-1), replaycost(0), canvas(0), _refcount(1) {}
 	Data(const Data &) = delete;
 	Data &operator=(const Data&) = delete;
 	~Data() { delete canvas; }
 
 	qint64 timestamp;
 	int streampointer;
+	qint64 replaycost; // time (ns) to replay from the previous savepoint to this one
 	paintcore::Savepoint *canvas;
 	QList<Annotation> annotations;
 	QHash<int, DrawingContext> ctxstate;
@@ -127,12 +129,20 @@ StateTracker::StateTracker(paintcore::LayerStack *image, int myId, QObject *pare
 		_image(image),
 		m_myId(myId),
 		m_msgstream_sizelimit(1024 * 1024 * 10),
+		m_replayCost(0),
+		m_savepointLatency(50 * 1000000),
+		m_savepointMemoryLimit(1024),
+		m_savepointMegabytes(0),
+		m_partialReplay(true),
 		m_fullhistory(true),
 		_showallmarkers(false),
 		_hasParticipated(false)
 {
 	m_annotations = new AnnotationState(this);
 
+	// History older than the undo window is stored in compact serialized form
+	m_msgstream.setMemoryLimit(1024 * 1024, true, protocol::MessageArena::HEAP);
+
 	// Timer for periodically resetting the local fork to keep cruft from accumulating.
 	// This is to make sure an out-of-sync fork gets cleaned up even if the user doesn't
 	// draw anything in a while.
@@ -155,6 +165,8 @@ void StateTracker::stop()
 void StateTracker::reset()
 {
 	_savepoints.clear();
+	m_replayCost = 0;
+	m_savepointMegabytes = 0;
 	m_msgstream.resetTo(m_msgstream.end());
 	m_fullhistory = true;
 	_hasParticipated = false;
@@ -190,7 +202,7 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 {
 	// Cleanup
 	if(m_msgstream_sizelimit>0 && m_msgstream.lengthInBytes() > m_msgstream_sizelimit) {
-		uint oldlen = m_msgstream.lengthInBytes();
+		const quint64 oldlen = m_msgstream.lengthInBytes();
 		qDebug() << "Message stream history size limit reached at" << oldlen / float(1024*1024) << "Mb. Clearing..";
 		m_msgstream.hardCleanup(0, _localfork.isEmpty() ? m_msgstream.end() : _localfork.offset());
 		qDebug() << "Released" << (oldlen-m_msgstream.lengthInBytes()) / float(1024*1024) << "Mb.";
@@ -200,7 +212,7 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 		// First, find the oldest undo point in the stream
 		int undopoint = m_msgstream.offset();
 		while(undopoint<m_msgstream.end()) {
-			if(m_msgstream.at(undopoint)->type() == protocol::MSG_UNDOPOINT)
+			if(m_msgstream.typeAt(undopoint) == protocol::MSG_UNDOPOINT)
 				break;
 			++undopoint;
 		}
@@ -258,7 +270,15 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 			qDebug("inconsistency at %d (local fork at %d). Rolling back to %d", m_msgstream.end(), _localfork.offset(), sp->streampointer);
 
 			paintcore::LayerStack::Locker lock(_image);
-			revertSavepointAndReplay(sp);
+
+			// Only the areas touched by the local fork and the received message need to be rolled back.
+			// (If the local fork was discarded as out of sync, we don't know what those areas are.)
+			const QVector<int> changed { m_msgstream.end() - 1 };
+			const QList<int> ctxids { localId(), msg->contextId() };
+			if(!_localfork.isEmpty() && revertTilesAndReplay(sp, changed, _localfork.areas(), ctxids))
+				_localfork.clear();
+			else
+				revertSavepointAndReplay(sp);
 		}
 
 	} else if(lfa==LocalFork::CONCURRENT) {
@@ -271,6 +291,9 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 
 void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
 {
+	QElapsedTimer timer;
+	timer.start();
+
 	switch(msg->type()) {
 		using namespace protocol;
 		case MSG_CANVAS_RESIZE:
@@ -325,6 +348,10 @@ void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
 			qWarning() << "Unhandled drawing command" << msg->type();
 			return;
 	}
+
+	// Undo points are not counted, since handling them may include making a savepoint
+	if(msg->type() != protocol::MSG_UNDOPOINT)
+		m_replayCost += timer.nsecsElapsed();
 }
 
 /**
@@ -488,12 +515,16 @@ void StateTracker::handlePenMove(const protocol::PenMove &cmd)
 		return;
 	}
 	
+	// Lines are drawn all at once, so the dabs can be composited in one batch
+	paintcore::PointVector lines;
+	lines.reserve(cmd.points().size());
+
 	foreach(const protocol::PenPoint &pp, cmd.points()) {
 		paintcore::Point p(pp.x / 4.0, pp.y / 4.0, pp.p/qreal(0xffff));
 		const int r = ctx.tool.brush.fsize(p.pressure())/2 + 1;
 
 		if(ctx.pendown) {
-			layer->drawLine(cmd.contextId(), ctx.tool.brush, ctx.lastpoint, p, ctx.stroke);
+			lines.append(p);
 			ctx.boundingRect |= QRect(p.x() - r, p.y() - r, r*2, r*2);
 
 		} else {
@@ -501,8 +532,13 @@ void StateTracker::handlePenMove(const protocol::PenMove &cmd)
 			ctx.stroke = paintcore::StrokeState(ctx.tool.brush);
 			ctx.boundingRect = QRect(p.x() - r, p.y() - r, r*2, r*2);
 			layer->dab(cmd.contextId(), ctx.tool.brush, p, ctx.stroke);
+			ctx.lastpoint = p;
 		}
-		ctx.lastpoint = p;
+	}
+
+	if(!lines.isEmpty()) {
+		layer->drawLines(cmd.contextId(), ctx.tool.brush, ctx.lastpoint, lines, ctx.stroke);
+		ctx.lastpoint = lines.last();
 	}
 
 	if(_showallmarkers || cmd.contextId() != localId())
@@ -520,6 +556,7 @@ void StateTracker::handlePenUp(const protocol::PenUp &cmd)
 
 	// This ends an indirect stroke. In incremental mode, this does nothing.
 	layer->mergeSublayer(cmd.contextId());
+	_image->endEditing();
 
 	ctx.pendown = false;
 	emit userMarkerHide(cmd.contextId());
@@ -561,13 +598,13 @@ void StateTracker::handleUndoPoint(const protocol::UndoPoint &cmd, bool replay,
 	if(!replay) {
 		int i = pos - 1; // skip the one just added
 		while(m_msgstream.isValidIndex(i)) {
-			protocol::MessagePtr msg = m_msgstream.at(i);
-			if(msg->contextId() == cmd.contextId()) {
+			if(m_msgstream.contextIdAt(i) == cmd.contextId()) {
 				// optimization: we can stop searching after finding the first GONE command
-				if(msg->type() != protocol::MSG_UNDO && msg->undoState() == protocol::GONE)
+				const protocol::MessageUndoState state = m_msgstream.undoStateAt(i);
+				if(m_msgstream.typeAt(i) != protocol::MSG_UNDO && state == protocol::GONE)
 					break;
-				else if(msg->undoState() == protocol::UNDONE)
-					msg->setUndoState(protocol::GONE);
+				else if(state == protocol::UNDONE)
+					m_msgstream.setUndoStateAt(i, protocol::GONE);
 			}
 			--i;
 		}
@@ -576,7 +613,7 @@ void StateTracker::handleUndoPoint(const protocol::UndoPoint &cmd, bool replay,
 		i = pos - 1;
 		int upcount = 0;
 		while(m_msgstream.isValidIndex(i)) {
-			if(m_msgstream.at(i)->type() == protocol::MSG_UNDOPOINT) {
+			if(m_msgstream.typeAt(i) == protocol::MSG_UNDOPOINT) {
 				++upcount;
 				if(upcount>protocol::UNDO_HISTORY_LIMIT)
 					break;
@@ -638,9 +675,8 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
 		// Search for undoable actions from the end of the
 		// command stream towards the beginning
 		while(actions>0 && m_msgstream.isValidIndex(--pos)) {
-			protocol::MessagePtr msg = m_msgstream.at(pos);
-			if(msg->type() == protocol::MSG_UNDOPOINT && msg->contextId() == ctxid) {
-				if(msg->undoState() == protocol::DONE)
+			if(m_msgstream.typeAt(pos) == protocol::MSG_UNDOPOINT && m_msgstream.contextIdAt(pos) == ctxid) {
+				if(m_msgstream.undoStateAt(pos) == protocol::DONE)
 					--actions;
 			}
 		}
@@ -648,9 +684,8 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
 		// Find the start of the undo sequence
 		int redostart = pos;
 		while(m_msgstream.isValidIndex(--pos)) {
-			protocol::MessagePtr msg = m_msgstream.at(pos);
-			if(msg->type() == protocol::MSG_UNDOPOINT && msg->contextId() == ctxid) {
-				if(msg->undoState() != protocol::DONE)
+			if(m_msgstream.typeAt(pos) == protocol::MSG_UNDOPOINT && m_msgstream.contextIdAt(pos) == ctxid) {
+				if(m_msgstream.undoStateAt(pos) != protocol::DONE)
 					redostart = pos;
 				else
 					break;
@@ -686,32 +721,40 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
 	}
 
 	// Step 3. (Un)mark all actions by the user as undone
+	QVector<int> changed;
 	if(undo) {
 		for(int i=pos;i<m_msgstream.end();++i) {
-			protocol::MessagePtr msg = m_msgstream.at(i);
-			if(msg->contextId() == ctxid)
-				msg->setUndoState(protocol::MessageUndoState(protocol::UNDONE | msg->undoState()));
+			if(m_msgstream.contextIdAt(i) == ctxid) {
+				const protocol::MessageUndoState state = m_msgstream.undoStateAt(i);
+				if(state == protocol::DONE)
+					changed.append(i);
+				m_msgstream.setUndoStateAt(i, protocol::MessageUndoState(protocol::UNDONE | state));
+			}
 		}
 	} else {
 		int i=pos;
 		++actions;
 		while(i<m_msgstream.end()) {
-			protocol::MessagePtr msg = m_msgstream.at(i);
-			if(msg->contextId() == ctxid) {
-				if(msg->type() == protocol::MSG_UNDOPOINT && msg->undoState() != protocol::GONE)
+			if(m_msgstream.contextIdAt(i) == ctxid) {
+				const protocol::MessageUndoState state = m_msgstream.undoStateAt(i);
+				if(m_msgstream.typeAt(i) == protocol::MSG_UNDOPOINT && state != protocol::GONE)
 					if(--actions==0)
 						break;
 
 				// GONE messages cannot be redone
-				if(msg->undoState() == protocol::UNDONE)
-					msg->setUndoState(protocol::DONE);
+				if(state == protocol::UNDONE) {
+					m_msgstream.setUndoStateAt(i, protocol::DONE);
+					changed.append(i);
+				}
 			}
 			++i;
 		}
 	}
 
-	// Step 4. Revert to savepoint and replay with undone commands removed
-	revertSavepointAndReplay(savepoint);
+	// Step 4. Revert to savepoint and replay with undone commands removed.
+	// If possible, only the tiles affected by the (un)done commands are reverted.
+	if(!_localfork.isEmpty() || !revertTilesAndReplay(savepoint, changed, QList<AffectedArea>(), QList<int>() << ctxid))
+		revertSavepointAndReplay(savepoint);
 }
 
 StateSavepoint StateTracker::createSavepoint(int pos)
@@ -719,6 +762,7 @@ StateSavepoint StateTracker::createSavepoint(int pos)
 	StateSavepoint savepoint;
 	savepoint->timestamp = QDateTime::currentMSecsSinceEpoch();
 	savepoint->streampointer = pos<0 ? m_msgstream.end() : pos;
+	savepoint->replaycost = m_replayCost;
 	savepoint->canvas = _image->makeSavepoint();
 	savepoint->annotations = m_annotations->getAnnotations();
 	savepoint->ctxstate = _contexts;
@@ -738,16 +782,61 @@ void StateTracker::makeSavepoint(int pos)
 	if(!_localfork.isEmpty())
 		return;
 
-	// Check if sufficient time and actions has elapsed from previous savepoint
-	if(!_savepoints.isEmpty()) {
-		const StateSavepoint sp = _savepoints.last();
-		quint64 now = QDateTime::currentMSecsSinceEpoch();
-		if(now - sp->timestamp < 1000 && m_msgstream.end() - sp->streampointer < 100)
-			return;
-	}
+	// A new savepoint is needed only if replaying the commands since the
+	// previous one would take longer than the target undo latency
+	if(!_savepoints.isEmpty() && m_replayCost < m_savepointLatency)
+		return;
 
 	// Looks like a good spot for a savepoint
 	_savepoints.append(createSavepoint(pos));
+	m_replayCost = 0;
+
+	// The estimate counts whole chunks of changed tiles, so it grows faster than
+	// the real usage. The exact measurement is made only when the estimate exceeds
+	// the budget, and the estimate is then reset to the measured value.
+	m_savepointMegabytes += _savepoints.last()->canvas->changedMegabytes();
+	if(m_savepointMemoryLimit>0 && m_savepointMegabytes > m_savepointMemoryLimit)
+		thinSavepoints();
+}
+
+/**
+ * @brief Remove savepoints until tile memory usage is within the budget
+ *
+ * A removed savepoint's replay segment is merged with the next one, so the
+ * savepoint whose removal results in the shortest segment is removed first.
+ * The oldest savepoint is needed to undo back to the oldest undo point and the
+ * newest is needed for rolling back the local fork, so they are always kept.
+ */
+void StateTracker::thinSavepoints()
+{
+	QList<const paintcore::Savepoint*> canvases;
+	canvases.reserve(_savepoints.size());
+	for(const StateSavepoint &sp : _savepoints)
+		canvases << sp->canvas;
+
+	// The tiles are collected once. Removed savepoints are subtracted from the measurement.
+	paintcore::SavepointMemoryUsage usage(_image, canvases);
+
+	while(_savepoints.size() > 2) {
+		if(usage.megabytes() <= m_savepointMemoryLimit)
+			break;
+
+		int best = 1;
+		qint64 bestCost = _savepoints.at(1)->replaycost + _savepoints.at(2)->replaycost;
+		for(int i=2;i<_savepoints.size()-1;++i) {
+			const qint64 cost = _savepoints.at(i)->replaycost + _savepoints.at(i+1)->replaycost;
+			if(cost < bestCost) {
+				best = i;
+				bestCost = cost;
+			}
+		}
+
+		_savepoints[best+1]->replaycost = bestCost;
+		_savepoints.removeAt(best);
+		usage.remove(best);
+	}
+
+	m_savepointMegabytes = usage.megabytes();
 }
 
 
@@ -757,6 +846,8 @@ void StateTracker::resetToSavepoint(const StateSavepoint savepoint)
 
 	m_msgstream.resetTo(savepoint->streampointer);
 	_savepoints.clear();
+	m_replayCost = 0;
+	m_savepointMegabytes = 0;
 
 	_image->restoreSavepoint(savepoint->canvas);
 	m_annotations->setAnnotations(savepoint->annotations);
@@ -779,10 +870,13 @@ void StateTracker::revertSavepointAndReplay(const StateSavepoint savepoint)
 	while(_savepoints.last() != savepoint)
 		_savepoints.removeLast();
 
+	// Replay cost is remeasured
+	m_replayCost = 0;
+
 	// Replay all not-undo actions (and local fork)
 	int pos = savepoint->streampointer + 1;
 	while(pos < m_msgstream.end()) {
-		if(m_msgstream.at(pos)->undoState() == protocol::DONE) {
+		if(m_msgstream.undoStateAt(pos) == protocol::DONE) {
 			handleCommand(m_msgstream.at(pos), true, pos);
 		}
 		++pos;
@@ -796,6 +890,343 @@ void StateTracker::revertSavepointAndReplay(const StateSavepoint savepoint)
 	emit retconned();
 }
 
+namespace {
+
+// Drawing context state needed to plan a partial replay
+struct PlanContext {
+	PlanContext() : pendown(false), stroke(-1) { }
+
+	ToolContext tool;
+	QPoint lastpoint;
+	bool pendown;
+	int stroke; // index of the stroke in progress (-1 if not started in the replayed section)
+};
+
+// A pen stroke in the replayed section of the history
+struct PlanStroke {
+	PlanStroke() : replay(false), closed(false), smudge(false) { }
+
+	bool replay;
+	bool closed;
+	bool smudge;
+};
+
+// The pixels affected by a command in the replayed section of the history
+struct PlanArea {
+	PlanArea() : layer(-1), stroke(-1), replay(false) { }
+
+	int layer; // layer stack index (-1 if no pixels are affected)
+	QRect rect;
+	int stroke; // the stroke this command belongs to (-1 if none)
+	bool replay;
+};
+
+// Select the tiles under the rectangle
+void selectTiles(QBitArray &tiles, const QRect &rect, const QSize &canvas)
+{
+	const QRect r = rect & QRect(QPoint(), canvas);
+	if(r.isEmpty())
+		return;
+
+	const int xtiles = paintcore::Tile::roundTiles(canvas.width());
+	for(int ty=r.top()/paintcore::Tile::SIZE;ty<=r.bottom()/paintcore::Tile::SIZE;++ty)
+		tiles.fill(true, ty*xtiles + r.left()/paintcore::Tile::SIZE, ty*xtiles + r.right()/paintcore::Tile::SIZE + 1);
+}
+
+// Check if any of the tiles under the rectangle is selected
+bool isTileSelected(const QBitArray &tiles, const QRect &rect, const QSize &canvas)
+{
+	const QRect r = rect & QRect(QPoint(), canvas);
+	if(r.isEmpty())
+		return false;
+
+	const int xtiles = paintcore::Tile::roundTiles(canvas.width());
+	for(int ty=r.top()/paintcore::Tile::SIZE;ty<=r.bottom()/paintcore::Tile::SIZE;++ty) {
+		for(int tx=r.left()/paintcore::Tile::SIZE;tx<=r.right()/paintcore::Tile::SIZE;++tx) {
+			if(tiles.testBit(ty*xtiles + tx))
+				return true;
+		}
+	}
+	return false;
+}
+
+}
+
+/**
+ * @brief Revert and replay only the affected tiles
+ *
+ * This is used for undo/redo and local fork rollbacks. The tiles touched by the
+ * changed commands (and the extra areas) are restored from the savepoint, and only
+ * the commands that touch those tiles are replayed. Strokes are replayed as a whole.
+ * Replayed commands may draw outside the restored tiles too, so the other tiles
+ * are put back afterwards. The newer savepoints are kept: their copies of the
+ * restored tiles are updated as the replay passes them.
+ *
+ * This only works when the commands after the savepoint change pixels locally:
+ * if there are layer changes, smudging brushes or other complications,
+ * nothing is done and the caller should fall back to revertSavepointAndReplay.
+ *
+ * @param savepoint the savepoint preceding the changed commands
+ * @param changed indices of the commands whose effect on the canvas has changed (e.g. undone commands)
+ * @param areas other changed areas (e.g. those of the local fork)
+ * @param ctxids the users whose drawing contexts are affected by the change
+ * @return false if a partial replay could not be done
+ */
+bool StateTracker::revertTilesAndReplay(const StateSavepoint &savepoint, const QVector<int> &changed, const QList<AffectedArea> &areas, const QList<int> &ctxids)
+{
+	Q_ASSERT(_savepoints.contains(savepoint));
+
+	if(!m_partialReplay || !_image->hasSameLayers(savepoint->canvas))
+		return false;
+
+	// Indirect strokes in progress are not handled
+	for(int i=0;i<_image->layerCount();++i) {
+		for(const paintcore::Layer *sl : _image->getLayerByIndex(i)->sublayers()) {
+			if(sl->id() >= 0 && !sl->isHidden())
+				return false;
+		}
+	}
+
+	QHash<int, PlanContext> contexts;
+	for(auto c=savepoint->ctxstate.constBegin();c!=savepoint->ctxstate.constEnd();++c) {
+		if(c.value().pendown && !c.value().tool.brush.incremental())
+			return false;
+
+		PlanContext &ctx = contexts[c.key()];
+		ctx.tool = c.value().tool;
+		ctx.pendown = c.value().pendown;
+		ctx.lastpoint = c.value().lastpoint.toPoint();
+	}
+
+	const int first = savepoint->streampointer + 1;
+	const int end = m_msgstream.end();
+	const QSize canvas = _image->size();
+
+	QVector<bool> isChanged(end - first, false);
+	for(int i : changed) {
+		if(i >= first)
+			isChanged[i-first] = true;
+		else if(m_msgstream.typeAt(i) != protocol::MSG_UNDOPOINT)
+			return false;
+	}
+
+	QVector<QBitArray> tiles(_image->layerCount(), QBitArray(paintcore::Tile::roundTiles(canvas.width()) * paintcore::Tile::roundTiles(canvas.height())));
+
+	for(const AffectedArea &a : areas) {
+		switch(a.domain()) {
+		case AffectedArea::USERATTRS:
+			break;
+		case AffectedArea::PIXELS: {
+			const int layer = _image->indexOf(a.layer());
+			if(layer>=0)
+				selectTiles(tiles[layer], a.bounds(), canvas);
+			break;
+		}
+		default:
+			return false;
+		}
+	}
+
+	// Find out which pixels were affected by each command and
+	// select the tiles the changed commands affected
+	QVector<PlanArea> cmdareas(end - first);
+	QVector<PlanStroke> strokes;
+
+	for(int i=first;i<end;++i) {
+		const protocol::MessagePtr msg = m_msgstream.at(i);
+		const bool changedCmd = isChanged.at(i-first);
+		if(msg->undoState() != protocol::DONE && !changedCmd)
+			continue;
+
+		PlanArea &area = cmdareas[i-first];
+
+		switch(msg->type()) {
+		using namespace protocol;
+		case MSG_TOOLCHANGE:
+			contexts[msg->contextId()].tool.updateFromToolchange(msg.cast<ToolChange>());
+			break;
+		case MSG_PEN_MOVE: {
+			PlanContext &ctx = contexts[msg->contextId()];
+			if(ctx.stroke<0) {
+				ctx.stroke = strokes.size();
+				strokes.append(PlanStroke());
+				strokes.last().smudge = ctx.tool.brush.smudge1() > 0 || ctx.tool.brush.smudge2() > 0;
+			}
+
+			const PenMove &m = msg.cast<PenMove>();
+			QRect bounds = ctx.pendown ? QRect(ctx.lastpoint, QSize(1,1)) : QRect();
+			for(const PenPoint &pp : m.points())
+				bounds |= QRect(pp.x/4, pp.y/4, 1, 1);
+
+			ctx.pendown = true;
+			ctx.lastpoint = QPoint(m.points().last().x/4, m.points().last().y/4);
+
+			const int r = qMax(ctx.tool.brush.size1(), ctx.tool.brush.size2()) / 2 + 2;
+			area.layer = _image->indexOf(ctx.tool.layer_id);
+			area.rect = bounds.adjusted(-r, -r, r, r);
+			area.stroke = ctx.stroke;
+			break;
+		}
+		case MSG_PEN_UP: {
+			PlanContext &ctx = contexts[msg->contextId()];
+			if(ctx.stroke>=0)
+				strokes[ctx.stroke].closed = true;
+			area.stroke = ctx.stroke;
+			ctx.stroke = -1;
+			ctx.pendown = false;
+			break;
+		}
+		case MSG_PUTIMAGE: {
+			const PutImage &m = msg.cast<PutImage>();
+			area.layer = _image->indexOf(m.layer());
+			area.rect = QRect(m.x(), m.y(), m.width(), m.height());
+			break;
+		}
+		case MSG_FILLRECT: {
+			const FillRect &m = msg.cast<FillRect>();
+			area.layer = _image->indexOf(m.layer());
+			area.rect = QRect(m.x(), m.y(), m.width(), m.height());
+			break;
+		}
+		case MSG_UNDOPOINT:
+			break;
+		case MSG_UNDO:
+			// An undo command's effect is not known before executing it
+			if(changedCmd)
+				return false;
+			break;
+		case MSG_ANNOTATION_CREATE:
+		case MSG_ANNOTATION_RESHAPE:
+		case MSG_ANNOTATION_EDIT:
+		case MSG_ANNOTATION_DELETE:
+			// Annotations are not part of the canvas savepoint
+			if(changedCmd)
+				return false;
+			break;
+		default:
+			// Layer changes and other non-local commands need a full replay
+			return false;
+		}
+
+		if(changedCmd && area.layer>=0)
+			selectTiles(tiles[area.layer], area.rect, canvas);
+	}
+
+	// The affected users' strokes in progress are always replayed, so their
+	// drawing contexts end up in the right state
+	for(int ctxid : ctxids) {
+		const int stroke = contexts.value(ctxid).stroke;
+		if(stroke>=0)
+			strokes[stroke].replay = true;
+	}
+
+	// Find the commands that touch the selected tiles
+	for(int i=first;i<end;++i) {
+		PlanArea &area = cmdareas[i-first];
+		if(area.layer<0 || m_msgstream.undoStateAt(i) != protocol::DONE)
+			continue;
+
+		if(isTileSelected(tiles.at(area.layer), area.rect, canvas)) {
+			if(area.stroke>=0)
+				strokes[area.stroke].replay = true;
+			else
+				area.replay = true;
+		}
+	}
+
+	// Smudging picks up colors from outside the selected tiles
+	for(const PlanStroke &stroke : strokes) {
+		if(stroke.replay && stroke.smudge)
+			return false;
+	}
+
+	// Plan complete. Now revert the selected tiles and replay
+	const QHash<int, DrawingContext> currentContexts = _contexts;
+
+	// Replaying old commands does not add to the cost of the current segment
+	const qint64 replayCost = m_replayCost;
+	paintcore::Savepoint *current = _image->makeSavepoint(false);
+
+	_image->restoreSavepointTiles(savepoint->canvas, tiles);
+	_contexts = savepoint->ctxstate;
+
+	// The newer savepoints are kept, but their copies of the selected
+	// tiles are replaced as the replay passes them
+	int nextSavepoint = _savepoints.indexOf(savepoint) + 1;
+
+	for(int i=first;i<end;++i) {
+		while(nextSavepoint < _savepoints.size() && _savepoints.at(nextSavepoint)->streampointer < i)
+			patchSavepoint(nextSavepoint++, tiles, ctxids);
+
+		const protocol::MessagePtr msg = m_msgstream.at(i);
+		if(msg->undoState() != protocol::DONE)
+			continue;
+
+		const PlanArea &area = cmdareas.at(i-first);
+		bool replay;
+		switch(msg->type()) {
+		case protocol::MSG_TOOLCHANGE:
+		case protocol::MSG_PEN_UP:
+			// These are needed to keep the drawing contexts up to date
+			replay = true;
+			break;
+		case protocol::MSG_PEN_MOVE:
+			replay = area.stroke>=0 && strokes.at(area.stroke).replay;
+			break;
+		default:
+			replay = area.replay;
+		}
+
+		if(replay)
+			handleCommand(msg, true, i);
+	}
+
+	while(nextSavepoint < _savepoints.size())
+		patchSavepoint(nextSavepoint++, tiles, ctxids);
+
+	m_replayCost = replayCost;
+
+	// Put back the tiles that were not supposed to change
+	_image->restoreSavepointTiles(current, tiles, true);
+	delete current;
+
+	// Other users' drawing contexts are not affected by the change, but
+	// the replay may have skipped some of their commands
+	for(auto c=currentContexts.constBegin();c!=currentContexts.constEnd();++c) {
+		if(!ctxids.contains(c.key()))
+			_contexts[c.key()] = c.value();
+	}
+
+	emit retconned();
+	return true;
+}
+
+/**
+ * @brief Update a savepoint newer than the one a partial replay started from
+ *
+ * The selected tiles are taken from the canvas, which must be in the state
+ * the savepoint was made in (as far as the selected tiles are concerned.)
+ * The drawing contexts of the affected users are taken from the current state.
+ */
+void StateTracker::patchSavepoint(int index, const QVector<QBitArray> &tiles, const QList<int> &ctxids)
+{
+	const StateSavepoint &old = _savepoints.at(index);
+
+	StateSavepoint sp;
+	sp->timestamp = old->timestamp;
+	sp->streampointer = old->streampointer;
+	sp->replaycost = old->replaycost;
+	sp->canvas = _image->patchSavepoint(old->canvas, tiles);
+	sp->annotations = old->annotations;
+	sp->ctxstate = old->ctxstate;
+	for(int ctxid : ctxids) {
+		if(_contexts.contains(ctxid))
+			sp->ctxstate[ctxid] = _contexts.value(ctxid);
+	}
+
+	_savepoints[index] = sp;
+}
+
 void StateSavepoint::toDatastream(QDataStream &out) const
 {
 	Q_ASSERT(_data);
@@ -21,6 +21,8 @@
 
 #include <QObject>
 #include <QHash>
+#include <QVector>
+#include <QBitArray>
 
 #include "retcon.h"
 #include "core/brush.h"
@@ -170,6 +172,37 @@ public:
 	 */
 	void setMaxHistorySize(uint limit) { m_msgstream_sizelimit = limit; }
 
+	/**
+	 * @brief Set the target worst case undo latency
+	 *
+	 * A new savepoint is made when replaying the commands since the
+	 * previous one would take longer than this.
+	 *
+	 * @param msecs target latency in milliseconds
+	 */
+	void setSavepointTargetLatency(int msecs) { m_savepointLatency = qint64(msecs) * 1000000; }
+
+	/**
+	 * @brief Set the memory budget for savepoints
+	 *
+	 * When the tile memory held only by savepoints (not shared with the
+	 * current canvas) exceeds the budget, savepoints are thinned out,
+	 * starting from the ones that are the cheapest to replay over.
+	 *
+	 * @param megabytes memory budget (0 for unlimited)
+	 */
+	void setSavepointMemoryLimit(int megabytes) { m_savepointMemoryLimit = megabytes; }
+
+	/**
+	 * @brief Enable or disable partial replays
+	 *
+	 * When enabled (the default,) undo/redo reverts and replays only the tiles
+	 * affected by the change, if possible. The result should be the same either way.
+	 *
+	 * @param enable
+	 */
+	void setPartialReplay(bool enable) { m_partialReplay = enable; }
+
 	/**
 	 * @brief Set if all user markers (own included) should be shown
 	 * @param showall
@@ -269,6 +302,9 @@ private:
 	void handleUndo(protocol::Undo &cmd);
 	void makeSavepoint(int pos);
 	void revertSavepointAndReplay(const StateSavepoint savepoint);
+	bool revertTilesAndReplay(const StateSavepoint &savepoint, const QVector<int> &changed, const QList<AffectedArea> &areas, const QList<int> &ctxids);
+	void patchSavepoint(int index, const QVector<QBitArray> &tiles, const QList<int> &ctxids);
+	void thinSavepoints();
 
 	QHash<int, DrawingContext> _contexts;
 
@@ -285,6 +321,12 @@ private:
 	QTimer *_localforkCleanupTimer;
 
 	uint m_msgstream_sizelimit;
+
+	qint64 m_replayCost; // time (ns) to replay the commands since the latest savepoint
+	qint64 m_savepointLatency;
+	int m_savepointMemoryLimit;
+	float m_savepointMegabytes; // estimated tile memory held only by savepoints (an overestimate)
+	bool m_partialReplay;
 	bool m_fullhistory;
 	bool _showallmarkers;
 	bool _hasParticipated;
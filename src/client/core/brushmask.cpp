@@ -20,6 +20,7 @@
 #include "brushmask.h"
 
 #include <QCache>
+#include <QMutex>
 
 #include <cmath>
 
@@ -33,6 +34,46 @@ typedef QVector<float> LUT;
 static const int LUT_RADIUS = 128;
 static QCache<int, LUT> LUT_CACHE;
 
+//! Exact inputs of a brush stamp
+//! Two dabs with equal keys produce identical stamps, so using a cached
+//! stamp gives the same result as generating a new one.
+struct StampKey {
+	qreal size;      // diameter
+	qreal hardness;
+	qreal opacity;
+	float xfrac;     // subpixel offset (or -1 if subpixel rendering is not used)
+	float yfrac;
+
+	StampKey(const Brush &brush, qreal pressure)
+		: size(brush.fsize(pressure)),
+		  hardness(brush.hardness(pressure)),
+		  opacity(brush.opacity(pressure)),
+		  xfrac(-1), yfrac(-1)
+	{
+	}
+
+	bool operator==(const StampKey &o) const {
+		return size == o.size && hardness == o.hardness && opacity == o.opacity &&
+			xfrac == o.xfrac && yfrac == o.yfrac;
+	}
+};
+
+inline uint qHash(const StampKey &key)
+{
+	return ::qHash(key.size) ^ (::qHash(key.hardness) << 1) ^ (::qHash(key.opacity) << 2) ^
+		(::qHash(key.xfrac) << 3) ^ (::qHash(key.yfrac) << 4);
+}
+
+// Recently used brush stamps. The stamp position is relative to the dab
+// position, with the subpixel offset already applied.
+// Stamps are mostly generated in the canvas thread, but some (such as
+// color picker samples) are made in the main thread too, so the
+// cache (and the LUT cache) are protected by a mutex.
+static const int STAMP_CACHE_SIZE = 4 * 1024 * 1024; // max. total mask size in bytes
+static QCache<StampKey, BrushStamp> STAMP_CACHE(STAMP_CACHE_SIZE);
+static QMutex STAMP_CACHE_MUTEX;
+static BrushStampStats STAMP_STATS = { 0, 0 };
+
 // Generate a lookup table for Gimp style exponential brush shape
 // The value at r² (where r is distance from brush center, scaled to LUT_RADIUS) is
 // the opaqueness of the pixel.
@@ -61,10 +102,10 @@ LUT cachedGimpStyleBrushLUT(float hardness)
 	return *LUT_CACHE[h];
 }
 
-BrushStamp makeMask(const Brush &brush, float pressure)
+BrushStamp makeMask(const StampKey &params)
 {
-	const float r = brush.fsize(pressure) / 2.0f;
-	const float opacity = brush.opacity(pressure) * 255;
+	const float r = params.size / 2.0f;
+	const float opacity = params.opacity * 255;
 
 	// generate mask
 	QVector<uchar> data;
@@ -80,7 +121,7 @@ BrushStamp makeMask(const Brush &brush, float pressure)
 		data[4] = opacity;
 
 	} else {
-		const LUT lut = cachedGimpStyleBrushLUT(brush.hardness(pressure));
+		const LUT lut = cachedGimpStyleBrushLUT(params.hardness);
 		const float lut_scale = square((LUT_RADIUS-1) / r);
 
 		float offset;
@@ -120,11 +161,11 @@ BrushStamp makeMask(const Brush &brush, float pressure)
 	return BrushStamp(stampOffset, stampOffset, BrushMask(diameter, data));
 }
 
-BrushStamp makeHighresMask(const Brush &brush, float pressure)
+BrushStamp makeHighresMask(const StampKey &params)
 {
 	// we calculate a double sized brush and downsample
-	const float r = brush.fsize(pressure);
-	const float opacity = brush.opacity(pressure) * (255 / 4); // opacity of each subsample
+	const float r = params.size;
+	const float opacity = params.opacity * (255 / 4); // opacity of each subsample
 
 	int diameter = ceil(r) + 2; // abstract brush is double size, but target diameter is normal
 	float offset = (ceil(r) - r) / -2;
@@ -137,7 +178,7 @@ BrushStamp makeHighresMask(const Brush &brush, float pressure)
 	}
 	const int stampOffset = -diameter/2;
 
-	const LUT lut = cachedGimpStyleBrushLUT(brush.hardness(pressure));
+	const LUT lut = cachedGimpStyleBrushLUT(params.hardness);
 	const float lut_scale = square((LUT_RADIUS-1) / r);
 
 	QVector<uchar> data(square(diameter));
@@ -226,46 +267,76 @@ BrushMask offsetMask(const BrushMask &mask, float xfrac, float yfrac)
 
 BrushStamp makeGimpStyleBrushStamp(const Brush &brush, const Point &point)
 {
-	BrushStamp s;
+	StampKey key(brush, point.pressure());
+	qreal left, top;
 
 	if(brush.subpixel()) {
-		// optimization: don't bother with a high resolution mask for large brushes
-		float radius = brush.fsize(point.pressure());
-
-		if(radius < 8)
-			s = makeHighresMask(brush, point.pressure());
-		else
-			s = makeMask(brush, point.pressure());
-
 		const float fx = floor(point.x());
 		const float fy = floor(point.y());
-		s.left += fx;
-		s.top += fy;
+		left = fx;
+		top = fy;
 
 		float xfrac = point.x()-fx;
 		float yfrac = point.y()-fy;
 
 		if(xfrac<0.5) {
 			xfrac += 0.5;
-			s.left--;
+			left--;
 		} else
 			xfrac -= 0.5;
 
 		if(yfrac<0.5) {
 			yfrac += 0.5;
-			s.top--;
+			top--;
 		} else
 			yfrac -= 0.5;
 
-		s.mask = offsetMask(s.mask, xfrac, yfrac);
+		key.xfrac = xfrac;
+		key.yfrac = yfrac;
 
 	} else {
-		s = makeMask(brush, point.pressure());
-		s.left += point.x();
-		s.top += point.y();
+		left = point.x();
+		top = point.y();
+	}
+
+	BrushStamp s;
+	{
+		QMutexLocker lock(&STAMP_CACHE_MUTEX);
+
+		const BrushStamp *cached = STAMP_CACHE.object(key);
+		++STAMP_STATS.stamps;
+		if(cached) {
+			s = *cached;
+			++STAMP_STATS.cacheHits;
+
+		} else {
+			if(key.xfrac>=0) {
+				// optimization: don't bother with a high resolution mask for large brushes
+				if(key.size < 8)
+					s = makeHighresMask(key);
+				else
+					s = makeMask(key);
+
+				s.mask = offsetMask(s.mask, key.xfrac, key.yfrac);
+
+			} else {
+				s = makeMask(key);
+			}
+
+			STAMP_CACHE.insert(key, new BrushStamp(s), square(s.mask.diameter()));
+		}
 	}
 
+	s.left += left;
+	s.top += top;
+
 	return s;
 }
 
+BrushStampStats brushStampStats()
+{
+	QMutexLocker lock(&STAMP_CACHE_MUTEX);
+	return STAMP_STATS;
+}
+
 }
@@ -65,6 +65,19 @@ struct BrushStamp {
 
 BrushStamp makeGimpStyleBrushStamp(const Brush &brush, const Point &point);
 
+//! Brush stamp generation statistics
+struct BrushStampStats {
+	quint64 stamps;    // total number of stamps made
+	quint64 cacheHits; // number of stamps found in the cache
+};
+
+/**
+ * @brief Get the number of brush stamps made so far
+ *
+ * This is used for benchmarking.
+ */
+BrushStampStats brushStampStats();
+
 }
 
 #endif
@@ -24,6 +24,7 @@
 #include <QStack>
 #include <QPainter>
 #include <QVarLengthArray>
+#include <QBitArray>
 
 namespace paintcore {
 
@@ -35,6 +36,7 @@ public:
 		source(image),
 		scratch(0, 0, QString(), Qt::transparent, image->size()),
 		fill(0, 0, QString(), Qt::transparent, image->size()),
+		fetched(Tile::roundTiles(image->width()) * Tile::roundTiles(image->height())),
 		layer(sourceLayer),
 		merge(merge),
 		fillColor(color.rgba()),
@@ -44,18 +46,19 @@ public:
 	Tile &scratchTile(int x, int y)
 	{
 		Tile &t = scratch.rtile(x, y);
-		if(t.isNull()) {
+
+		// A transparent tile is a null tile, so a separate flag is
+		// needed to tell whether the tile has been fetched already
+		const int i = y * Tile::roundTiles(scratch.width()) + x;
+		if(!fetched.testBit(i)) {
 			if(merge) {
 				t = source->getFlatTile(x, y);
 			} else {
 				const Layer *sl = source->getLayer(layer);
 				Q_ASSERT(sl);
-				const Tile &st = sl->tile(x, y);
-				if(st.isNull())
-					t = Tile(Qt::transparent);
-				else
-					t = st;
+				t = sl->tile(x, y);
 			}
+			fetched.setBit(i);
 		}
 
 		return t;
@@ -78,7 +81,7 @@ public:
 
 		const Tile &t = scratchTile(tx, ty);
 
-		return t.data()[y*Tile::SIZE + x];
+		return t.pixel(x, y);
 	}
 
 	void setPixel(int x, int y) {
@@ -182,6 +185,9 @@ private:
 	// The fill layer, containing just the filled pixels
 	Layer fill;
 
+	// Scratch tiles that have been fetched from the source
+	QBitArray fetched;
+
 	// Target layer
 	int layer;
 
@@ -21,6 +21,7 @@
 #include <QtConcurrent>
 #include <QDataStream>
 #include <cmath>
+#include <algorithm>
 
 #include "layerstack.h"
 #include "layer.h"
@@ -120,16 +121,21 @@ Layer::Layer(LayerStack *owner, int id, const QSize &size)
 }
 
 Layer::Layer(const Layer &layer)
+	: Layer(layer, false)
+{
+}
+
+Layer::Layer(const Layer &layer, bool ephemeral)
 	: m_owner(layer.m_owner), m_info(layer.m_info),
 	  m_width(layer.m_width), m_height(layer.m_height),
 	  m_xtiles(layer.m_xtiles), m_ytiles(layer.m_ytiles),
 	  m_tiles(layer.m_tiles)
 {
-	// Hidden and ephemeral layers are not copied, since hiding a sublayer is
+	// Hidden and ephemeral layers are not normally copied, since hiding a sublayer is
 	// effectively the same as deleting it and ephemeral layers are not considered
 	// part of the true layer content.
 	for(const Layer *sl : layer.sublayers()) {
-		if(sl->id() >= 0 && !sl->isHidden())
+		if((ephemeral || sl->id() >= 0) && !sl->isHidden())
 			m_sublayers.append(new Layer(*sl));
 	}
 }
@@ -154,7 +160,7 @@ void Layer::resize(int top, int right, int bottom, int left)
 
 	int xtiles = Tile::roundTiles(width);
 	int ytiles = Tile::roundTiles(height);
-	QVector<Tile> tiles(xtiles * ytiles);
+	TileVector tiles(xtiles * ytiles);
 
 	// if there is no old content, resizing is simple
 	bool hascontent = false;
@@ -509,7 +515,7 @@ void Layer::putImage(int x, int y, QImage image, BlendMode::Mode mode)
 	}
 	
 	if(m_owner && isVisible()) {
-		m_owner->markDirty(QRect(x, y, image.width(), image.height()));
+		m_owner->markDirty(this, QRect(x, y, image.width(), image.height()));
 		m_owner->notifyAreaChanged();
 	}
 }
@@ -547,6 +553,11 @@ void Layer::fillRect(const QRect &rectangle, const QColor &color, BlendMode::Mod
 		else
 			canIncrOpacity = findBlendMode(blendmode).flags.testFlag(BlendMode::IncrOpacity);
 
+		// Replacing with any color or painting an opaque color
+		// results in a tile filled with just that color
+		const bool fillsWithColor = blendmode==BlendMode::MODE_REPLACE ||
+			(blendmode==BlendMode::MODE_NORMAL && color.alpha()==255);
+
 		for(int ty=ty0;ty<=ty1;++ty) {
 			for(int tx=tx0;tx<=tx1;++tx) {
 				int left = qMax(tx * size, rect.x()) - tx*size;
@@ -556,20 +567,27 @@ void Layer::fillRect(const QRect &rectangle, const QColor &color, BlendMode::Mod
 
 				Tile &t = m_tiles[ty*m_xtiles+tx];
 
-				if(!t.isNull() || canIncrOpacity)
+				if(w==size && h==size && fillsWithColor) {
+					// The whole tile will have the same color: no need to composite
+					t = Tile(color);
+
+				} else if(!t.isNull() || canIncrOpacity)
 					t.composite(blendmode, mask, color, left, top, w, h, 0);
 			}
 		}
 	}
 
 	if(m_owner && isVisible()) {
-		m_owner->markDirty(rectangle);
+		m_owner->markDirty(this, rectangle);
 		m_owner->notifyAreaChanged();
 	}
 }
 
 void Layer::dab(int contextId, const Brush &brush, const Point &point, StrokeState &state)
 {
+	if(m_owner)
+		m_owner->setEditedLayer(this);
+
 	Brush effective_brush = brush;
 	Layer *l = this;
 
@@ -606,6 +624,27 @@ void Layer::dab(int contextId, const Brush &brush, const Point &point, StrokeSta
  */
 void Layer::drawLine(int contextId, const Brush& brush, const Point& from, const Point& to, StrokeState &state)
 {
+	drawLines(contextId, brush, from, PointVector() << to, state);
+}
+
+/**
+ * Draw a series of connected lines.
+ *
+ * Unless the brush smudges (in which case each dab depends on the
+ * result of the previous one,) the dabs of all the lines are generated first
+ * and then composited tile by tile. The dabs are applied to each tile
+ * in the same order they were generated in, so the result is identical
+ * to compositing them one at a time.
+ *
+ * @param context drawing context id (needed for indirect drawing)
+ * @param from the starting point of the first line
+ * @param to the end points of each line
+ */
+void Layer::drawLines(int contextId, const Brush& brush, const Point& from, const PointVector& to, StrokeState &state)
+{
+	if(m_owner)
+		m_owner->setEditedLayer(this);
+
 	Brush effective_brush = brush;
 	Layer *l = this;
 
@@ -623,10 +662,20 @@ void Layer::drawLine(int contextId, const Brush& brush, const Point& from, const
 		effective_brush.setBlendingMode(BlendMode::MODE_NORMAL);
 	}
 
-	if(effective_brush.subpixel())
-		l->drawSoftLine(effective_brush, from, to, state);
-	else
-		l->drawHardLine(effective_brush, from, to, state);
+	const bool batch = effective_brush.smudge1() <= 0 && effective_brush.smudge2() <= 0;
+	QVector<BrushStamp> dabs;
+
+	Point prev = from;
+	for(const Point &p : to) {
+		if(effective_brush.subpixel())
+			l->drawSoftLine(effective_brush, prev, p, state, batch ? &dabs : nullptr);
+		else
+			l->drawHardLine(effective_brush, prev, p, state, batch ? &dabs : nullptr);
+		prev = p;
+	}
+
+	if(!dabs.isEmpty())
+		l->compositeDabs(effective_brush.blendingMode(), effective_brush.color(), dabs);
 
 	if(m_owner)
 		m_owner->notifyAreaChanged();
@@ -637,9 +686,10 @@ void Layer::drawLine(int contextId, const Brush& brush, const Point& from, const
  * @param brush brush to draw the line with
  * @param from starting point
  * @param to ending point
- * @param distance distance from previous dab.
+ * @param state stroke state
+ * @param dabs if not null, dabs are collected here rather than drawn immediately
  */
-void Layer::drawSoftLine(const Brush& brush, const Point& from, const Point& to, StrokeState &state)
+void Layer::drawSoftLine(const Brush& brush, const Point& from, const Point& to, StrokeState &state, QVector<BrushStamp> *dabs)
 {
 	qreal dx = to.x() - from.x();
 	qreal dy = to.y() - from.y();
@@ -661,7 +711,7 @@ void Layer::drawSoftLine(const Brush& brush, const Point& from, const Point& to,
 
 	while(i<=dist) {
 		const qreal spacing = qMax(1.0, brush.spacingDist(p.pressure()));
-		directDab(brush, p, state);
+		batchDab(brush, p, state, dabs);
 		p.rx() += dx * spacing;
 		p.ry() += dy * spacing;
 		p.setPressure(qBound(0.0, p.pressure() + dp * spacing, 1.0));
@@ -675,7 +725,7 @@ void Layer::drawSoftLine(const Brush& brush, const Point& from, const Point& to,
  * precision.
  * The last point is not drawn, so successive lines can be drawn blotches.
  */
-void Layer::drawHardLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state) {
+void Layer::drawHardLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state, QVector<BrushStamp> *dabs) {
 	const qreal dp = (to.pressure()-from.pressure()) / hypot(to.x()-from.x(), to.y()-from.y());
 
 	int x0 = qFloor(from.x());
@@ -716,7 +766,7 @@ void Layer::drawHardLine(const Brush &brush, const Point& from, const Point& to,
 			x0 += stepx;
 			fraction += dy;
 			if(++distance >= spacing) {
-				directDab(brush, Point(x0, y0, p), state);
+				batchDab(brush, Point(x0, y0, p), state, dabs);
 				distance = 0;
 			}
 			p += dp;
@@ -732,7 +782,7 @@ void Layer::drawHardLine(const Brush &brush, const Point& from, const Point& to,
 			y0 += stepy;
 			fraction += dx;
 			if(++distance >= spacing) {
-				directDab(brush, Point(x0, y0, p), state);
+				batchDab(brush, Point(x0, y0, p), state, dabs);
 				distance = 0;
 			}
 			p += dp;
@@ -780,6 +830,12 @@ void Layer::directDab(const Brush &brush, const Point& point, StrokeState &state
 	const uchar *values = bs.mask.data();
 	QColor color = smudge > 0 ? state.smudgeColor : brush.color();
 
+	if(dia > Tile::SIZE * 2) {
+		// Big dabs touch many tiles, which can be composited in parallel
+		compositeDabs(brush.blendingMode(), color, QVector<BrushStamp>() << bs);
+		return;
+	}
+
 	// A single dab can (and often does) span multiple tiles.
 	int y = top<0?0:top;
 	int yb = top<0?-top:0; // y in relation to brush origin
@@ -813,8 +869,128 @@ void Layer::directDab(const Brush &brush, const Point& point, StrokeState &state
 	}
 
 	if(m_owner && isVisible())
-		m_owner->markDirty(QRect(left, top, right-left, bottom-top));
+		m_owner->markDirty(this, QRect(left, top, right-left, bottom-top));
+
+}
+
+/**
+ * @brief Draw a dab immediately or add it to a list to be composited later
+ */
+void Layer::batchDab(const Brush &brush, const Point& point, StrokeState &state, QVector<BrushStamp> *dabs)
+{
+	if(!dabs) {
+		directDab(brush, point, state);
+		return;
+	}
+
+	const BrushStamp bs = makeGimpStyleBrushStamp(brush, point);
+	const int dia = bs.mask.diameter();
+	if(bs.left+dia<=0 || bs.top+dia<=0 || bs.left>=m_width || bs.top>=m_height)
+		return;
+
+	// Not smudging, but keep the stroke state the same as directDab would
+	++state.smudgeDistance;
+
+	dabs->append(bs);
+}
+
+/**
+ * @brief Composite a list of dabs onto the layer
+ *
+ * The dabs are binned by tile and each tile is composited with all
+ * of its dabs in one go. Dabs are applied in list order within each tile.
+ *
+ * When there is enough work, the tiles are composited in parallel. Since
+ * each tile is handled by a single thread, in the same order as in the
+ * serial case, the result does not depend on the number of threads.
+ *
+ * @param mode blending mode
+ * @param color brush color
+ * @param dabs the dabs to composite
+ */
+void Layer::compositeDabs(BlendMode::Mode mode, const QColor &color, const QVector<BrushStamp> &dabs)
+{
+	// List of (tile index, dab index) pairs packed into one integer.
+	// Sorting these gives us the dabs grouped by tile, in their original order.
+	QVector<quint64> bins;
+	bins.reserve(dabs.size() * 4);
+
+	int pixels = 0;
+	for(int d=0;d<dabs.size();++d) {
+		const BrushStamp &bs = dabs.at(d);
+		const int dia = bs.mask.diameter();
+		const int tx0 = qMax(0, bs.left) / Tile::SIZE;
+		const int tx1 = (qMin(bs.left + dia, m_width) - 1) / Tile::SIZE;
+		const int ty0 = qMax(0, bs.top) / Tile::SIZE;
+		const int ty1 = (qMin(bs.top + dia, m_height) - 1) / Tile::SIZE;
+
+		for(int ty=ty0;ty<=ty1;++ty)
+			for(int tx=tx0;tx<=tx1;++tx)
+				bins.append(quint64(ty * m_xtiles + tx) << 32 | quint64(d));
+
+		pixels += dia * dia;
+	}
+
+	std::sort(bins.begin(), bins.end());
+
+	// Group the list by tile
+	struct TileDabs {
+		int tile;
+		int first, last; // range in the bin list
+	};
+	QVector<TileDabs> tiles;
+	for(int b=0;b<bins.size();) {
+		const int i = bins.at(b) >> 32;
+		const int first = b;
+		while(++b<bins.size() && int(bins.at(b) >> 32) == i) { }
+		tiles.append(TileDabs { i, first, b });
+	}
+
+	auto compositeTile = [this, mode, &color, &dabs, &bins](const TileDabs &td) {
+		const int tileLeft = (td.tile % m_xtiles) * Tile::SIZE;
+		const int tileTop = (td.tile / m_xtiles) * Tile::SIZE;
+		const int tileRight = qMin(tileLeft + Tile::SIZE, m_width);
+		const int tileBottom = qMin(tileTop + Tile::SIZE, m_height);
+		Tile &tile = m_tiles[td.tile];
+
+		for(int b=td.first;b<td.last;++b) {
+			const BrushStamp &bs = dabs.at(int(bins.at(b) & 0xffffffff));
+			const int dia = bs.mask.diameter();
+			const int left = qMax(bs.left, tileLeft);
+			const int top = qMax(bs.top, tileTop);
+			const int w = qMin(bs.left + dia, tileRight) - left;
+			const int h = qMin(bs.top + dia, tileBottom) - top;
+
+			tile.composite(
+				mode,
+				bs.mask.data() + (top - bs.top) * dia + (left - bs.left),
+				color,
+				left - tileLeft, top - tileTop,
+				w, h,
+				dia - w
+				);
+		}
+	};
+
+	// Thresholds below which the threading overhead is not worth it
+	static const int PARALLEL_MIN_TILES = 4;
+	static const int PARALLEL_MIN_PIXELS = 128 * 128;
+
+	if(tiles.size() >= PARALLEL_MIN_TILES && pixels >= PARALLEL_MIN_PIXELS) {
+		// Shared tile chunks must be detached before concurrent modification
+		for(const TileDabs &td : tiles)
+			m_tiles.detach(td.tile);
 
+		QtConcurrent::blockingMap(tiles, compositeTile);
+	} else {
+		for(const TileDabs &td : tiles)
+			compositeTile(td);
+	}
+
+	if(m_owner && isVisible()) {
+		for(const TileDabs &td : tiles)
+			m_owner->markDirty(this, td.tile);
+	}
 }
 
 /**
@@ -903,7 +1079,7 @@ void Layer::merge(const Layer *layer, bool sublayers)
 
 		if(isnull && sublayers) {
 			for(Layer *sl : m_sublayers) {
-				if(sl->m_tiles[i].isNull()) {
+				if(sl->m_tiles.at(i).isNull()) {
 					isnull = false;
 					break;
 				}
@@ -914,9 +1090,10 @@ void Layer::merge(const Layer *layer, bool sublayers)
 			mergeidx.append(i);
 	}
 
-	// Detach tile vector explicitly to make sure concurrent modifications
+	// Detach the tiles explicitly to make sure concurrent modifications
 	// are all done to the same vector
-	m_tiles.detach();
+	for(int idx : mergeidx)
+		m_tiles.detach(idx);
 
 	// Merge tiles
 	QtConcurrent::blockingMap(mergeidx, [this, layer, sublayers](int idx) {
@@ -925,7 +1102,7 @@ void Layer::merge(const Layer *layer, bool sublayers)
 
 			for(Layer *sl : layer->m_sublayers) {
 				if(sl->isVisible()) {
-					t.merge(sl->m_tiles[idx], sl->opacity(), sl->blendmode());
+					t.merge(sl->m_tiles.at(idx), sl->opacity(), sl->blendmode());
 				}
 			}
 			m_tiles[idx].merge(t, layer->opacity(), layer->blendmode());
@@ -940,17 +1117,30 @@ void Layer::merge(const Layer *layer, bool sublayers)
 }
 
 /**
- * Free all tiles that are completely transparent
+ * Free all tiles that are completely transparent and
+ * the pixel buffers of tiles filled with a single color
  */
 void Layer::optimize()
 {
-	// Optimize tile memory usage
-	for(int i=0;i<m_tiles.size();++i) {
-		if(!m_tiles[i].isNull() && m_tiles[i].isBlank())
-			m_tiles[i] = Tile();
-	}
+	// Optimize tile memory usage. Only the tiles modified since the
+	// last time need to be checked.
+	m_tiles.optimize();
+
+	removeHiddenSublayers();
+}
+
+Layer *Layer::savepointCopy()
+{
+	removeHiddenSublayers();
+
+	// The copy remembers which tiles were modified, so it can be optimized later
+	Layer *copy = new Layer(*this);
+	m_tiles.clearModified();
+	return copy;
+}
 
-	// Delete unused sublayers
+void Layer::removeHiddenSublayers()
+{
 	QMutableListIterator<Layer*> li(m_sublayers);
 	while(li.hasNext()) {
 		Layer *sl = li.next();
@@ -1061,7 +1251,7 @@ void Layer::markOpaqueDirty(bool forceVisible)
 
 	for(int i=0;i<m_tiles.size();++i) {
 		if(!m_tiles.at(i).isNull())
-			m_owner->markDirty(i);
+			m_owner->markDirty(this, i);
 	}
 	m_owner->notifyAreaChanged();
 }
@@ -20,6 +20,8 @@
 #define LAYER_H
 
 #include "tile.h"
+#include "tilevector.h"
+#include "point.h"
 
 #include <QColor>
 #include <QVector>
@@ -34,7 +36,6 @@ namespace paintcore {
 
 class Brush;
 struct BrushStamp;
-class Point;
 class LayerStack;
 struct StrokeState;
 
@@ -73,6 +74,13 @@ class Layer {
 		//! Construct a copy of this layer
 		Layer(const Layer &layer);
 
+		/**
+		 * @brief Construct a copy of this layer
+		 * @param layer the layer to copy
+		 * @param ephemeral if true, ephemeral sublayers (e.g. local previews) are copied too
+		 */
+		Layer(const Layer &layer, bool ephemeral);
+
 		~Layer();
 
 		//! Get the layer width in pixels
@@ -156,6 +164,9 @@ class Layer {
 		//! Draw a line using either drawHardLine or drawSoftLine
 		void drawLine(int contextId, const Brush& brush, const Point& from, const Point& to, StrokeState &state);
 
+		//! Draw a series of connected lines, compositing all the dabs at once
+		void drawLines(int contextId, const Brush& brush, const Point& from, const PointVector& to, StrokeState &state);
+
 		//! Merge a sublayer with this layer
 		void mergeSublayer(int id);
 
@@ -168,6 +179,15 @@ class Layer {
 		//! Optimize layer memory usage
 		void optimize();
 
+		/**
+		 * @brief Make a copy of this layer for a savepoint
+		 *
+		 * This is a cheap alternative to calling optimize() and copying the layer.
+		 * Tile contents are not examined: the tiles modified since the last call
+		 * are left for the caller to optimize in the returned copy.
+		 */
+		Layer *savepointCopy();
+
 		//! Get a tile
 		const Tile &tile(int x, int y) const {
 			Q_ASSERT(x>=0 && x<m_xtiles);
@@ -185,6 +205,12 @@ class Layer {
 		//! Get a tile
 		const Tile &tile(int index) const { Q_ASSERT(index>=0 && index<m_xtiles*m_ytiles); return m_tiles[index]; }
 
+		//! Get an editable reference to a tile
+		Tile &rtile(int index) { Q_ASSERT(index>=0 && index<m_xtiles*m_ytiles); return m_tiles[index]; }
+
+		//! Get all the tiles
+		const TileVector &tiles() const { return m_tiles; }
+
 		//! Get the sublayers
 		const QList<Layer*> &sublayers() const { return m_sublayers; }
 
@@ -222,12 +248,17 @@ class Layer {
 
 		Layer padImageToTileBoundary(int leftpad, int toppad, const QImage &original, BlendMode::Mode mode) const;
 
+		//! Delete unused sublayers
+		void removeHiddenSublayers();
+
 		//! Get a sublayer
 		Layer *getSubLayer(int id, BlendMode::Mode blendmode, uchar opacity);
 
 		void directDab(const Brush &brush, const Point& point, StrokeState &state);
-		void drawHardLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state);
-		void drawSoftLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state);
+		void batchDab(const Brush &brush, const Point& point, StrokeState &state, QVector<BrushStamp> *dabs);
+		void compositeDabs(BlendMode::Mode mode, const QColor &color, const QVector<BrushStamp> &dabs);
+		void drawHardLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state, QVector<BrushStamp> *dabs);
+		void drawSoftLine(const Brush &brush, const Point& from, const Point& to, StrokeState &state, QVector<BrushStamp> *dabs);
 
 		QColor getDabColor(const BrushStamp &stamp) const;
 
@@ -238,7 +269,7 @@ class Layer {
 		int m_height;
 		int m_xtiles;
 		int m_ytiles;
-		QVector<Tile> m_tiles;
+		TileVector m_tiles;
 
 		QList<Layer*> m_sublayers;
 };
@@ -21,7 +21,11 @@
 #include <QPainter>
 #include <QMimeData>
 #include <QtConcurrent>
+#include <QFutureWatcher>
 #include <QDataStream>
+#include <QTimer>
+#include <QThread>
+#include <QSet>
 
 #include "layer.h"
 #include "layerstack.h"
@@ -31,10 +35,37 @@
 namespace paintcore {
 
 LayerStack::LayerStack(QObject *parent)
-	: QObject(parent), _width(0), _height(0), _viewmode(NORMAL), _viewlayeridx(0),
+	: QObject(parent), _width(0), _height(0), _xtiles(0), _ytiles(0), _viewmode(NORMAL), _viewlayeridx(0),
 	  _onionskinsBelow(4), _onionskinsAbove(4), _onionskinTint(true), _viewBackgroundLayer(true),
-	  m_locked(false)
+	  m_locked(false), m_notifyInterval(0), m_snapshotsEnabled(false), m_snapshotSerial(0), m_editedLayer(nullptr),
+	  m_flatcache(new FlatCache)
 {
+	m_notifyTimer = new QTimer(this);
+	m_notifyTimer->setSingleShot(true);
+	connect(m_notifyTimer, &QTimer::timeout, this, &LayerStack::flushAreaChanged);
+}
+
+/**
+ * The snapshot shares tile data with the original layer stack.
+ * Snapshots are never modified, so they do not need a notification timer.
+ * The edited layer and the flat tile cache are carried over, so the
+ * snapshot is rendered using the cached composites too.
+ */
+LayerStack::LayerStack(const LayerStack &stack)
+	: QObject(), _width(stack._width), _height(stack._height), _xtiles(stack._xtiles), _ytiles(stack._ytiles),
+	  _viewmode(stack._viewmode), _viewlayeridx(stack._viewlayeridx),
+	  _onionskinsBelow(stack._onionskinsBelow), _onionskinsAbove(stack._onionskinsAbove),
+	  _onionskinTint(stack._onionskinTint), _viewBackgroundLayer(stack._viewBackgroundLayer),
+	  m_locked(false), m_notifyInterval(0), m_notifyTimer(nullptr), m_snapshotsEnabled(false),
+	  m_changedTiles(stack.m_changedTiles), m_snapshotSerial(stack.m_snapshotSerial), m_editedLayer(nullptr),
+	  m_flatcache(stack.m_flatcache), m_tileGenerations(stack.m_tileGenerations)
+{
+	m_layers.reserve(stack.m_layers.size());
+	for(const Layer *l : stack.m_layers) {
+		m_layers.append(new Layer(*l, true));
+		if(l == stack.m_editedLayer)
+			m_editedLayer = m_layers.last();
+	}
 }
 
 LayerStack::~LayerStack()
@@ -53,6 +84,8 @@ void LayerStack::reset()
 	for(Layer *l : m_layers)
 		delete l;
 	m_layers.clear();
+	m_editedLayer = nullptr;
+	clearFlatCache();
 	emit resized(0, 0, oldsize);
 	emit layersChanged(QList<LayerInfo>());
 }
@@ -69,12 +102,27 @@ void LayerStack::unlock()
 {
 	Q_ASSERT(m_locked);
 	m_locked = false;
-	QRect dr = m_dirtyrect;
-	m_dirtyrect = QRect();
+	QRect dr;
+	bool schedule = false;
+	if(!m_dirtyrect.isEmpty()) {
+		// Snapshots are published and notifications throttled only in the layer
+		// stack's own thread (where the commands are executed.) Other threads
+		// leave it to the notification timer.
+		if(QThread::currentThread() == thread() && notificationDelay()==0) {
+			dr = m_dirtyrect;
+			m_dirtyrect = QRect();
+			m_lastNotify.start();
+			publishSnapshot();
+		} else {
+			schedule = true;
+		}
+	}
 	m_mutex.unlock();
 
 	if(!dr.isEmpty())
 		emit areaChanged(dr);
+	else if(schedule)
+		scheduleNotification();
 }
 
 void LayerStack::resize(int top, int right, int bottom, int left)
@@ -95,6 +143,9 @@ void LayerStack::resize(int top, int right, int bottom, int left)
 	_xtiles = Tile::roundTiles(_width);
 	_ytiles = Tile::roundTiles(_height);
 	_dirtytiles = QBitArray(_xtiles*_ytiles, true);
+	m_changedTiles = QBitArray(_xtiles*_ytiles, true);
+	m_tileGenerations = QVector<quint32>(_xtiles*_ytiles, 0);
+	clearFlatCache();
 
 	for(Layer *l : m_layers)
 		l->resize(top, right, bottom, left);
@@ -180,8 +231,13 @@ bool LayerStack::deleteLayer(int id)
 	for(int i=0;i<m_layers.size();++i) {
 		if(m_layers.at(i)->id() == id) {
 			m_layers.at(i)->markOpaqueDirty();
+			if(m_layers.at(i) == m_editedLayer)
+				m_editedLayer = nullptr;
 			delete m_layers.takeAt(i);
 
+			// The layer may have been merged into the one below it
+			clearFlatCache();
+
 			emit layerDeleted(i);
 
 			return true;
@@ -277,8 +333,6 @@ int LayerStack::indexOf(int id) const
 	return -1;
 }
 
-namespace {
-
 struct UpdateTile {
 	UpdateTile() : x(-1), y(-1) {}
 	UpdateTile(int x_, int y_) : x(x_), y(y_) {}
@@ -287,18 +341,137 @@ struct UpdateTile {
 	quint32 data[Tile::LENGTH];
 };
 
+namespace {
+
+// TODO: don't draw the checkerboard here: use a QML item instead to draw the background
+void fillBackground(quint32 *data)
+{
+	Tile::fillChecker(data, QColor(128,128,128), Qt::white);
+}
+
+// Upper limit for the number of tiles with cached composites
+static const int MAX_FLAT_CACHE = 1024;
+
+// Paint flattened tiles onto the target and delete them
+void paintUpdates(QList<UpdateTile*> &updates, QPaintDevice *target)
+{
+	QPainter painter(target);
+	painter.setCompositionMode(QPainter::CompositionMode_Source);
+	while(!updates.isEmpty()) {
+		UpdateTile *ut = updates.takeLast();
+		painter.drawImage(
+			ut->x*Tile::SIZE,
+			ut->y*Tile::SIZE,
+			QImage(reinterpret_cast<const uchar*>(ut->data),
+				Tile::SIZE, Tile::SIZE,
+				QImage::Format_ARGB32
+			)
+		);
+		delete ut;
+	}
+}
+
+// Do the two layers have the same rendering related properties?
+bool sameProperties(const Layer *l0, const Layer *l1)
+{
+	return l0->id() == l1->id() &&
+		l0->opacity() == l1->opacity() &&
+		l0->isHidden() == l1->isHidden() &&
+		l0->blendmode() == l1->blendmode();
+}
+
 }
 
+/**
+ * Cached composites of a single tile, used while one layer is being drawn on.
+ *
+ * The "below" tile is the background with all the layers beneath the edited
+ * layer composited on it. Since layers are composited in order, using it
+ * gives exactly the same result as compositing those layers again.
+ *
+ * Layers above the edited one are not cached: compositing them onto a
+ * premerged tile would round differently than compositing them one by one,
+ * so the result would not be identical to flattenTile. They are composited
+ * individually, but blank tiles are skipped, so layers with no content at
+ * the tile cost next to nothing.
+ *
+ * The cache does not hold references to the layers' tiles. Instead, the entry
+ * is discarded when the tile's generation number changes (i.e. when a layer
+ * below the edited one is modified) or when the properties of those layers change.
+ */
+struct LayerStack::FlatTileCache {
+	struct LayerState {
+		int id;
+		int opacity;
+		BlendMode::Mode blend;
+		quint32 tint;
+		bool visible;
+
+		bool operator==(const LayerState &o) const {
+			return id == o.id && opacity == o.opacity &&
+				blend == o.blend && tint == o.tint && visible == o.visible;
+		}
+	};
+	typedef QVector<LayerState> LayerStates;
+
+	FlatTileCache() : generation(0), hasBelow(false) { }
+
+	/**
+	 * @brief Get the current states of a range of layers
+	 * @return false if the layers cannot be cached (because of visible sublayers)
+	 */
+	static bool currentStates(const LayerStack *ls, int from, int to, LayerStates &states)
+	{
+		states.clear();
+		states.reserve(to - from);
+		for(int i=from;i<to;++i) {
+			const Layer *l = ls->m_layers.at(i);
+			const bool visible = ls->isVisible(i);
+			if(visible) {
+				for(const Layer *sl : l->sublayers()) {
+					if(sl->isVisible())
+						return false;
+				}
+			}
+			states.append(LayerState {
+				l->id(),
+				ls->layerOpacity(i),
+				l->blendmode(),
+				ls->layerTint(i),
+				visible
+			});
+		}
+		return true;
+	}
+
+	Tile below;
+	LayerStates belowStates;
+	quint32 generation;
+	bool hasBelow;
+};
+
+/**
+ * The tile cache of a layer stack. It is shared with the stack's snapshots,
+ * which may be rendered in another thread, so access is serialized
+ * with a mutex.
+ */
+struct LayerStack::FlatCache {
+	QMutex mutex;
+	QHash<int, FlatTileCache*> tiles;
+
+	~FlatCache() { qDeleteAll(tiles); }
+};
+
 /**
  * The dirty flag for each painted tile will be cleared.
  *
  * @param rect area of the image to limit repainting to (rounded upwards to tile boundaries)
  * @param target device to paint onto
  */
-void LayerStack::paintChangedTiles(const QRect& rect, QPaintDevice *target, bool clean)
+int LayerStack::paintChangedTiles(const QRect& rect, QPaintDevice *target, bool clean)
 {
 	if(_width<=0 || _height<=0)
-		return;
+		return 0;
 
 	// Affected tile range
 	const int tx0 = qBound(0, rect.left() / Tile::SIZE, _xtiles-1);
@@ -323,35 +496,156 @@ void LayerStack::paintChangedTiles(const QRect& rect, QPaintDevice *target, bool
 		}
 	}
 
+	const int count = updates.size();
+
 	if(!updates.isEmpty()) {
-		// Flatten tiles
+		flattenUpdates(updates);
+		paintUpdates(updates, target);
+	}
+
+	return count;
+}
+
+QRect LayerStack::paintDifference(const LayerStack *previous, QPaintDevice *target) const
+{
+	if(_width<=0 || _height<=0)
+		return QRect();
+
+	// If the layers or view settings have changed, everything must be repainted.
+	// Otherwise, only the tiles whose content has changed are repainted.
+	// An identity comparison is enough here, since tiles are copy-on-write.
+	const bool all = !previous || !sameLayout(previous);
+
+	// If the previous snapshot is the one published just before this one,
+	// only the tiles marked dirty in between need to be compared.
+	const bool onlyChanged = !all && previous->m_snapshotSerial + 1 == m_snapshotSerial
+		&& m_changedTiles.size() == _xtiles*_ytiles;
+
+	QList<UpdateTile*> updates;
+	QRect area;
+
+	for(int ty=0;ty<_ytiles;++ty) {
+		for(int tx=0;tx<_xtiles;++tx) {
+			const int i = ty*_xtiles + tx;
+			if(onlyChanged && !m_changedTiles.testBit(i))
+				continue;
+
+			bool changed = all;
+			for(int l=0;!changed && l<m_layers.size();++l) {
+				const Layer *l0 = m_layers.at(l);
+				const Layer *l1 = previous->m_layers.at(l);
+				if(l0->tile(i) != l1->tile(i)) {
+					changed = true;
+					break;
+				}
+				for(int sl=0;sl<l0->sublayers().size();++sl) {
+					if(l0->sublayers().at(sl)->tile(i) != l1->sublayers().at(sl)->tile(i)) {
+						changed = true;
+						break;
+					}
+				}
+			}
+
+			if(changed) {
+				updates.append(new UpdateTile(tx, ty));
+				area |= QRect(tx*Tile::SIZE, ty*Tile::SIZE, Tile::SIZE, Tile::SIZE);
+			}
+		}
+	}
+
+	if(!updates.isEmpty()) {
+		flattenUpdates(updates);
+		paintUpdates(updates, target);
+	}
+
+	return area & QRect(0, 0, _width, _height);
+}
+
+/**
+ * If a layer is being drawn on, the cached composites of the layers below
+ * it are used (and updated.)
+ */
+void LayerStack::flattenUpdates(QList<UpdateTile*> &updates) const
+{
+	const int editedIdx = m_editedLayer ? m_layers.indexOf(const_cast<Layer*>(m_editedLayer)) : -1;
+
+	if(editedIdx<0) {
 		QtConcurrent::blockingMap(updates, [this](UpdateTile *t) {
-			// TODO: don't draw the checkerboard here: use a QML item instead to draw the background
-			Tile::fillChecker(t->data, QColor(128,128,128), Qt::white);
+			fillBackground(t->data);
 			flattenTile(t->data, t->x, t->y);
 		});
+		return;
+	}
+
+	QMutexLocker lock(&m_flatcache->mutex);
+	QHash<int, FlatTileCache*> &cache = m_flatcache->tiles;
+
+	if(cache.size() + updates.size() > MAX_FLAT_CACHE) {
+		qDeleteAll(cache);
+		cache.clear();
+	}
+
+	// Cache entries are created here, since the hash table must
+	// not be modified concurrently
+	typedef QPair<UpdateTile*, FlatTileCache*> CachedUpdate;
+	QVector<CachedUpdate> cachedUpdates;
+	cachedUpdates.reserve(updates.size());
+	for(UpdateTile *t : updates) {
+		FlatTileCache *c = nullptr;
+		if(updates.size() <= MAX_FLAT_CACHE) {
+			FlatTileCache *&entry = cache[t->y*_xtiles + t->x];
+			if(!entry)
+				entry = new FlatTileCache;
+			c = entry;
+		}
+		cachedUpdates.append(CachedUpdate(t, c));
+	}
+
+	QtConcurrent::blockingMap(cachedUpdates, [this, editedIdx](CachedUpdate &u) {
+		UpdateTile *t = u.first;
+		if(u.second) {
+			flattenCachedTile(t->data, t->x, t->y, editedIdx, u.second);
+		} else {
+			fillBackground(t->data);
+			flattenTile(t->data, t->x, t->y);
+		}
+	});
+}
 
-		// Paint flattened tiles
-		QPainter painter(target);
-		painter.setCompositionMode(QPainter::CompositionMode_Source);
-		while(!updates.isEmpty()) {
-			UpdateTile *ut = updates.takeLast();
-			painter.drawImage(
-				ut->x*Tile::SIZE,
-				ut->y*Tile::SIZE,
-				QImage(reinterpret_cast<const uchar*>(ut->data),
-					Tile::SIZE, Tile::SIZE,
-					QImage::Format_ARGB32
-				)
-			);
-			delete ut;
+/**
+ * @brief Check if the other layer stack has the same size, layers and view settings
+ *
+ * If the layout is the same, the stacks can be compared tile by tile.
+ */
+bool LayerStack::sameLayout(const LayerStack *other) const
+{
+	if(
+		_width != other->_width || _height != other->_height ||
+		_viewmode != other->_viewmode || _viewlayeridx != other->_viewlayeridx ||
+		_onionskinsBelow != other->_onionskinsBelow || _onionskinsAbove != other->_onionskinsAbove ||
+		_onionskinTint != other->_onionskinTint || _viewBackgroundLayer != other->_viewBackgroundLayer ||
+		m_layers.size() != other->m_layers.size()
+	)
+		return false;
+
+	for(int i=0;i<m_layers.size();++i) {
+		const Layer *l0 = m_layers.at(i);
+		const Layer *l1 = other->m_layers.at(i);
+		if(!sameProperties(l0, l1) || l0->sublayers().size() != l1->sublayers().size())
+			return false;
+
+		for(int j=0;j<l0->sublayers().size();++j) {
+			if(!sameProperties(l0->sublayers().at(j), l1->sublayers().at(j)))
+				return false;
 		}
 	}
+
+	return true;
 }
 
 Tile LayerStack::getFlatTile(int x, int y) const
 {
-	Tile t(Qt::transparent);
+	Tile t;
 	flattenTile(t.data(), x, y);
 	return t;
 }
@@ -420,47 +714,172 @@ QImage LayerStack::flatLayerImage(int layerIdx, bool useBgLayer, const QColor &b
 // Flatten a single tile
 void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
 {
-	// Composite visible layers
-	int layeridx = 0;
-	for(const Layer *l : m_layers) {
-		if(isVisible(layeridx)) {
-			const Tile &tile = l->tile(xindex, yindex);
-			const quint32 tint = layerTint(layeridx);
+	// Composite visible layers, starting from the topmost one that
+	// completely hides everything beneath it
+	for(int layeridx=firstVisibleLayerAt(xindex, yindex);layeridx<m_layers.size();++layeridx) {
+		if(isVisible(layeridx))
+			compositeLayer(data, layeridx, xindex, yindex);
+	}
+}
 
-			if(l->sublayers().count() || tint!=0) {
-				// Sublayers (or tint) present, composite them first
-				quint32 ldata[Tile::SIZE*Tile::SIZE];
-				tile.copyTo(ldata);
+/**
+ * Flatten a tile using (and updating) the cached composite of the
+ * layers below the edited layer. The result is identical to flattenTile.
+ */
+void LayerStack::flattenCachedTile(quint32 *data, int xindex, int yindex, int editedIdx, FlatTileCache *cache) const
+{
+	const int first = firstVisibleLayerAt(xindex, yindex);
+	if(first > editedIdx) {
+		// The edited layer is completely hidden here
+		fillBackground(data);
+		flattenTile(data, xindex, yindex);
+		return;
+	}
 
-				for(const Layer *sl : l->sublayers()) {
-					if(sl->isVisible()) {
-						const Tile &subtile = sl->tile(xindex, yindex);
-						if(!subtile.isNull()) {
-							compositePixels(sl->blendmode(), ldata, subtile.data(),
-									Tile::SIZE*Tile::SIZE, sl->opacity());
-						}
-					}
-				}
+	FlatTileCache::LayerStates states;
+	const quint32 generation = m_tileGenerations.at(yindex*_xtiles + xindex);
+
+	// Background and the layers below the edited layer
+	if(FlatTileCache::currentStates(this, first, editedIdx, states)) {
+		if(!cache->hasBelow || cache->generation != generation || cache->belowStates != states) {
+			quint32 *below = cache->below.data();
+			fillBackground(below);
+			for(int i=first;i<editedIdx;++i) {
+				if(isVisible(i))
+					compositeLayer(below, i, xindex, yindex);
+			}
+			cache->belowStates = states;
+			cache->generation = generation;
+			cache->hasBelow = true;
+		}
+		cache->below.copyTo(data);
 
-				if(tint)
-					tintPixels(ldata, sizeof ldata / sizeof *ldata, tint);
+	} else {
+		cache->hasBelow = false;
+		cache->below = Tile();
+		fillBackground(data);
+		for(int i=first;i<editedIdx;++i) {
+			if(isVisible(i))
+				compositeLayer(data, i, xindex, yindex);
+		}
+	}
 
-				// Composite merged tile
-				compositePixels(l->blendmode(), data, ldata,
-						Tile::SIZE*Tile::SIZE, layerOpacity(layeridx));
+	// The edited layer and the layers above it
+	for(int i=editedIdx;i<m_layers.size();++i) {
+		if(isVisible(i))
+			compositeLayer(data, i, xindex, yindex);
+	}
+}
 
-			} else if(!tile.isNull()) {
-				// No sublayers or tint, just this tile as it is
-				compositePixels(l->blendmode(), data, tile.data(),
-						Tile::SIZE*Tile::SIZE, layerOpacity(layeridx));
+// Composite a single layer (and its sublayers) onto a tile
+void LayerStack::compositeLayer(quint32 *data, int layeridx, int xindex, int yindex) const
+{
+	const Layer *l = m_layers.at(layeridx);
+	const Tile &tile = l->tile(xindex, yindex);
+	const quint32 tint = layerTint(layeridx);
+
+	if(l->sublayers().count() || tint!=0) {
+		// Sublayers (or tint) present, composite them first
+		quint32 ldata[Tile::SIZE*Tile::SIZE];
+		tile.copyTo(ldata);
+
+		for(const Layer *sl : l->sublayers()) {
+			if(sl->isVisible()) {
+				sl->tile(xindex, yindex).compositeTo(ldata, sl->opacity(), sl->blendmode());
 			}
 		}
 
-		++layeridx;
+		if(tint)
+			tintPixels(ldata, sizeof ldata / sizeof *ldata, tint);
+
+		// Composite merged tile
+		compositePixels(l->blendmode(), data, ldata,
+				Tile::SIZE*Tile::SIZE, layerOpacity(layeridx));
+
+	} else {
+		// No sublayers or tint, just this tile as it is.
+		// (Null tiles are skipped and uniform tiles use a fast path)
+		tile.compositeTo(data, layerOpacity(layeridx), l->blendmode());
 	}
 }
 
+void LayerStack::endEditing()
+{
+	m_mutex.lock();
+	m_editedLayer = nullptr;
+	clearFlatCache();
+	m_mutex.unlock();
+}
+
+/**
+ * Snapshots still being rendered keep the old cache until they are deleted.
+ */
+void LayerStack::clearFlatCache()
+{
+	m_flatcache = QSharedPointer<FlatCache>(new FlatCache);
+}
+
+/**
+ * Changes to these layers do not affect the cached composites
+ * of the layers below the edited layer.
+ *
+ * @return true if the layer is the edited layer, one of its sublayers or a layer above it
+ */
+bool LayerStack::isEditedOrAbove(const Layer *layer) const
+{
+	if(!m_editedLayer || !layer)
+		return false;
+
+	if(layer == m_editedLayer)
+		return true;
+
+	for(const Layer *sl : m_editedLayer->sublayers()) {
+		if(sl == layer)
+			return true;
+	}
+
+	for(int i=m_layers.size()-1;i>=0 && m_layers.at(i) != m_editedLayer;--i) {
+		if(m_layers.at(i) == layer)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * A layer hides the layers beneath it (and the background) if its tile
+ * is fully opaque and it is composited using normal mode at full opacity.
+ * Sublayers must not be able to make any of the pixels transparent.
+ *
+ * @return index of the bottom-most layer that needs to be composited
+ */
+int LayerStack::firstVisibleLayerAt(int xindex, int yindex) const
+{
+	for(int idx=m_layers.size()-1;idx>0;--idx) {
+		const Layer *l = m_layers.at(idx);
+		if(!isVisible(idx) || l->blendmode() != BlendMode::MODE_NORMAL || layerOpacity(idx) < 255)
+			continue;
+
+		bool sublayersKeepOpacity = true;
+		for(const Layer *sl : l->sublayers()) {
+			if(sl->isVisible() && findBlendMode(sl->blendmode()).flags.testFlag(BlendMode::DecrOpacity)) {
+				sublayersKeepOpacity = false;
+				break;
+			}
+		}
+
+		if(sublayersKeepOpacity && l->tile(xindex, yindex).isOpaque())
+			return idx;
+	}
+	return 0;
+}
+
 void LayerStack::markDirty(const QRect &area)
+{
+	markDirty(nullptr, area);
+}
+
+void LayerStack::markDirty(const Layer *layer, const QRect &area)
 {
 	if(m_layers.isEmpty() || _width<=0 || _height<=0)
 		return;
@@ -468,9 +887,15 @@ void LayerStack::markDirty(const QRect &area)
 	const int tx1 = qBound(tx0, area.right() / Tile::SIZE, _xtiles-1) + 1;
 	int ty0 = qBound(0, area.top() / Tile::SIZE, _ytiles-1);
 	const int ty1 = qBound(ty0, area.bottom() / Tile::SIZE, _ytiles-1);
+	const bool belowEdited = !isEditedOrAbove(layer);
 	
 	for(;ty0<=ty1;++ty0) {
 		_dirtytiles.fill(true, ty0*_xtiles + tx0, ty0*_xtiles + tx1);
+		m_changedTiles.fill(true, ty0*_xtiles + tx0, ty0*_xtiles + tx1);
+		if(belowEdited) {
+			for(int i=ty0*_xtiles + tx0;i<ty0*_xtiles + tx1;++i)
+				++m_tileGenerations[i];
+		}
 	}
 	m_dirtyrect |= area;
 }
@@ -480,6 +905,8 @@ void LayerStack::markDirty()
 	if(m_layers.isEmpty() || _width<=0 || _height<=0)
 		return;
 	_dirtytiles.fill(true);
+	m_changedTiles.fill(true);
+	clearFlatCache();
 
 	m_dirtyrect = QRect(0, 0, _width, _height);
 	notifyAreaChanged();
@@ -490,16 +917,22 @@ void LayerStack::markDirty(int x, int y)
 	Q_ASSERT(x>=0 && x < _xtiles);
 	Q_ASSERT(y>=0 && y < _ytiles);
 
-	_dirtytiles.setBit(y*_xtiles + x);
-
-	m_dirtyrect |= QRect(x*Tile::SIZE, y*Tile::SIZE, Tile::SIZE, Tile::SIZE);
+	markDirty(nullptr, y*_xtiles + x);
 }
 
 void LayerStack::markDirty(int index)
+{
+	markDirty(nullptr, index);
+}
+
+void LayerStack::markDirty(const Layer *layer, int index)
 {
 	Q_ASSERT(index>=0 && index < _dirtytiles.size());
 
 	_dirtytiles.setBit(index);
+	m_changedTiles.setBit(index);
+	if(!isEditedOrAbove(layer))
+		++m_tileGenerations[index];
 
 	const int y = index / _xtiles;
 	const int x = index % _xtiles;
@@ -510,11 +943,91 @@ void LayerStack::markDirty(int index)
 void LayerStack::notifyAreaChanged()
 {
 	if(!m_locked && !m_dirtyrect.isEmpty()) {
+		if(QThread::currentThread() != thread() || notificationDelay()>0) {
+			scheduleNotification();
+			return;
+		}
+		m_lastNotify.start();
+		if(m_snapshotsEnabled) {
+			m_mutex.lock();
+			publishSnapshot();
+			m_mutex.unlock();
+		}
 		emit areaChanged(m_dirtyrect);
 		m_dirtyrect = QRect();
 	}
 }
 
+/**
+ * @brief Get the time remaining until areaChanged may be emitted again
+ *
+ * The throttling state is only accessed in the layer stack's own thread.
+ * @return delay in milliseconds (0 if the notification can be sent right away)
+ */
+int LayerStack::notificationDelay() const
+{
+	Q_ASSERT(QThread::currentThread() == thread());
+	if(m_notifyInterval<=0 || !m_lastNotify.isValid())
+		return 0;
+
+	const qint64 elapsed = m_lastNotify.elapsed();
+	return elapsed >= m_notifyInterval ? 0 : m_notifyInterval - elapsed;
+}
+
+void LayerStack::scheduleNotification()
+{
+	// The stack may be unlocked in another thread, so the delay is
+	// calculated and the timer started in the layer stack's own thread
+	if(m_notifyScheduled.testAndSetOrdered(0, 1))
+		QMetaObject::invokeMethod(this, "startNotificationTimer", Qt::QueuedConnection);
+}
+
+void LayerStack::startNotificationTimer()
+{
+	m_notifyTimer->start(notificationDelay());
+}
+
+void LayerStack::flushAreaChanged()
+{
+	m_mutex.lock();
+	m_notifyScheduled = 0;
+	const QRect dr = m_dirtyrect;
+	m_dirtyrect = QRect();
+	m_lastNotify.start();
+	if(!dr.isEmpty())
+		publishSnapshot();
+	m_mutex.unlock();
+
+	if(!dr.isEmpty())
+		emit areaChanged(dr);
+}
+
+/**
+ * Must be called with the layer stack locked, in the layer stack's own thread.
+ */
+void LayerStack::publishSnapshot()
+{
+	if(!m_snapshotsEnabled)
+		return;
+	Q_ASSERT(QThread::currentThread() == thread());
+
+	++m_snapshotSerial;
+	QSharedPointer<const LayerStack> snapshot(new LayerStack(*this));
+	m_changedTiles.fill(false);
+
+	// The previous snapshot (if no longer used by anyone) is deleted
+	// only after the lock has been released
+	m_snapshotMutex.lock();
+	m_snapshot.swap(snapshot);
+	m_snapshotMutex.unlock();
+}
+
+QSharedPointer<const LayerStack> LayerStack::snapshot() const
+{
+	QMutexLocker lock(&m_snapshotMutex);
+	return m_snapshot;
+}
+
 void LayerStack::notifyLayerInfoChange(const Layer *layer)
 {
 	Q_ASSERT(layer);
@@ -620,28 +1133,123 @@ bool LayerStack::isVisible(int idx) const
 	return true;
 }
 
+//! A tile optimized in a savepoint
+struct OptimizedTile {
+	int layer;
+	int index;
+	Tile before;
+	Tile after;
+};
+
+/**
+ * @brief Tiles optimized in a savepoint in a background thread
+ *
+ * The original tiles are still shared with the layer stack. They are replaced
+ * with the optimized versions if the layer stack has not changed them in the meantime.
+ * The references to the original tiles are needed only for this comparison,
+ * so the result is adopted (and released) as soon as the optimization finishes.
+ */
+struct OptimizedTiles {
+	OptimizedTiles(const QSize &s) : size(s) { }
+
+	QSize size;
+	QVector<OptimizedTile> tiles;
+};
+
+namespace {
+
+void optimizeSavepointLayers(const QList<Layer*> &layers, QSharedPointer<OptimizedTiles> result)
+{
+	for(Layer *l : layers) {
+		const TileVector before = l->tiles();
+		l->optimize();
+		const TileVector &after = l->tiles();
+
+		for(int c=0;c<after.chunkCount();++c) {
+			if(after.isSameChunk(before, c))
+				continue;
+
+			const int end = qMin(after.size(), (c+1) * TileVector::CHUNK);
+			for(int i=c*TileVector::CHUNK;i<end;++i) {
+				if(after.at(i) != before.at(i))
+					result->tiles.append(OptimizedTile { l->id(), i, before.at(i), after.at(i) });
+			}
+		}
+	}
+}
+
+}
+
 Savepoint::~Savepoint()
 {
+	optimizer.waitForFinished();
 	while(!layers.isEmpty())
 		delete layers.takeLast();
 }
 
-Savepoint *LayerStack::makeSavepoint()
+float Savepoint::changedMegabytes() const
+{
+	return changedTiles * Tile::BYTES / float(1024*1024);
+}
+
+Savepoint *LayerStack::makeSavepoint(bool optimize)
 {
 	Savepoint *sp = new Savepoint;
 	for(Layer *l : m_layers) {
-		l->optimize();
-		sp->layers.append(new Layer(*l));
+		if(optimize) {
+			sp->changedTiles += l->tiles().modifiedTiles();
+			sp->layers.append(l->savepointCopy());
+		} else {
+			sp->layers.append(new Layer(*l));
+		}
 	}
 
 	sp->width = _width;
 	sp->height = _height;
 
+	if(optimize && !sp->layers.isEmpty()) {
+		// The savepoint's copies of the layers are not accessed by anyone else
+		// until the optimization is finished
+		// The result is adopted in this thread when the optimization finishes
+		Q_ASSERT(QThread::currentThread() == thread());
+		QSharedPointer<OptimizedTiles> result(new OptimizedTiles(size()));
+		sp->optimizer = QtConcurrent::run(optimizeSavepointLayers, sp->layers, result);
+
+		QFutureWatcher<void> *watcher = new QFutureWatcher<void>(this);
+		connect(watcher, &QFutureWatcher<void>::finished, this, [this, watcher, result]() {
+			adoptOptimizedTiles(*result);
+			watcher->deleteLater();
+		});
+		watcher->setFuture(sp->optimizer);
+	}
+
 	return sp;
 }
 
+/**
+ * Replace tiles with the versions optimized in the background, if they have
+ * not been changed since. The replacement tiles have the same content, so nothing
+ * needs to be repainted.
+ */
+void LayerStack::adoptOptimizedTiles(OptimizedTiles &result)
+{
+	m_mutex.lock();
+	if(result.size == size()) {
+		for(const OptimizedTile &t : result.tiles) {
+			Layer *l = getLayer(t.layer);
+			if(l && l->tile(t.index) == t.before)
+				l->rtile(t.index) = t.after;
+		}
+	}
+	m_mutex.unlock();
+
+	result.tiles.clear();
+}
+
 void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 {
+	savepoint->optimizer.waitForFinished();
+
 	const QSize oldsize(_width, _height);
 	if(_width != savepoint->width || _height != savepoint->height) {
 		// Restore canvas size if it was different in the savepoint
@@ -650,6 +1258,9 @@ void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 		_xtiles = Tile::roundTiles(_width);
 		_ytiles = Tile::roundTiles(_height);
 		_dirtytiles = QBitArray(_xtiles*_ytiles, true);
+		m_changedTiles = QBitArray(_xtiles*_ytiles, true);
+		m_tileGenerations = QVector<quint32>(_xtiles*_ytiles, 0);
+		clearFlatCache();
 		emit resized(0, 0, oldsize);
 	} else {
 		// Mark changed tiles as changed. Usually savepoints are quite close together
@@ -658,6 +1269,7 @@ void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 			// Layers added or deleted, just refresh everything
 			// (force refresh even if layer stack is empty)
 			_dirtytiles.fill(true);
+			m_changedTiles.fill(true);
 			m_dirtyrect = QRect(0, 0, _width, _height);
 
 		} else {
@@ -670,18 +1282,28 @@ void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 					markDirty();
 					break;
 				}
-				for(int i=0;i<_xtiles*_ytiles;++i) {
-					// Note: An identity comparison works here, because the tiles
-					// utilize copy-on-write semantics. Unchanged tiles will share
-					// data pointers between savepoints.
-					if(l0->tile(i) != l1->tile(i))
-						markDirty(i);
+				// Note: An identity comparison works here, because the tiles
+				// utilize copy-on-write semantics. Unchanged tiles will share
+				// data pointers between savepoints. Whole chunks of unchanged
+				// tiles are usually shared too, so they can be skipped.
+				const TileVector &t0 = l0->tiles();
+				const TileVector &t1 = l1->tiles();
+				for(int c=0;c<t0.chunkCount();++c) {
+					if(t0.isSameChunk(t1, c))
+						continue;
+
+					const int end = qMin(t0.size(), (c+1) * TileVector::CHUNK);
+					for(int i=c*TileVector::CHUNK;i<end;++i) {
+						if(t0.at(i) != t1.at(i))
+							markDirty(i);
+					}
 				}
 			}
 		}
 	}
 
 	// Restore layers
+	m_editedLayer = nullptr;
 	while(!m_layers.isEmpty())
 		delete m_layers.takeLast();
 	for(const Layer *l : savepoint->layers)
@@ -691,6 +1313,131 @@ void LayerStack::restoreSavepoint(const Savepoint *savepoint)
 	emit layersChanged(layerInfos());
 }
 
+bool LayerStack::hasSameLayers(const Savepoint *savepoint) const
+{
+	savepoint->optimizer.waitForFinished();
+
+	if(savepoint->width != _width || savepoint->height != _height || savepoint->layers.size() != m_layers.size())
+		return false;
+
+	for(int i=0;i<m_layers.size();++i) {
+		const LayerInfo &l0 = m_layers.at(i)->info();
+		const LayerInfo &l1 = savepoint->layers.at(i)->info();
+		if(l0.id != l1.id || l0.opacity != l1.opacity || l0.hidden != l1.hidden || l0.blend != l1.blend)
+			return false;
+	}
+
+	return true;
+}
+
+void LayerStack::restoreSavepointTiles(const Savepoint *savepoint, const QVector<QBitArray> &tiles, bool invert)
+{
+	savepoint->optimizer.waitForFinished();
+	Q_ASSERT(hasSameLayers(savepoint));
+	Q_ASSERT(tiles.size() == m_layers.size());
+
+	for(int l=0;l<m_layers.size();++l) {
+		Layer *layer = m_layers.at(l);
+		const TileVector &t1 = savepoint->layers.at(l)->tiles();
+		const QBitArray &selection = tiles.at(l);
+
+		for(int c=0;c<t1.chunkCount();++c) {
+			// Shared chunks have no changes to restore
+			if(layer->tiles().isSameChunk(t1, c))
+				continue;
+
+			const int end = qMin(t1.size(), (c+1) * TileVector::CHUNK);
+			for(int i=c*TileVector::CHUNK;i<end;++i) {
+				if(selection.testBit(i) != invert && layer->tile(i) != t1.at(i)) {
+					layer->rtile(i) = t1.at(i);
+					markDirty(i);
+				}
+			}
+		}
+	}
+
+	notifyAreaChanged();
+}
+
+Savepoint *LayerStack::patchSavepoint(const Savepoint *savepoint, const QVector<QBitArray> &tiles) const
+{
+	savepoint->optimizer.waitForFinished();
+	Q_ASSERT(hasSameLayers(savepoint));
+	Q_ASSERT(tiles.size() == m_layers.size());
+
+	Savepoint *sp = new Savepoint;
+	sp->width = savepoint->width;
+	sp->height = savepoint->height;
+
+	for(int l=0;l<m_layers.size();++l) {
+		Layer *layer = new Layer(*savepoint->layers.at(l));
+		const Layer *current = m_layers.at(l);
+		const QBitArray &selection = tiles.at(l);
+
+		for(int i=0;i<selection.size();++i) {
+			if(selection.testBit(i) && layer->tile(i) != current->tile(i))
+				layer->rtile(i) = current->tile(i);
+		}
+		sp->layers.append(layer);
+	}
+
+	return sp;
+}
+
+namespace {
+
+void collectTileData(const Layer *layer, QSet<const void*> &data)
+{
+	const TileVector &tiles = layer->tiles();
+	for(int i=0;i<tiles.size();++i) {
+		const void *d = tiles.at(i).dataId();
+		if(d)
+			data.insert(d);
+	}
+
+	for(const Layer *sl : layer->sublayers())
+		collectTileData(sl, data);
+}
+
+}
+
+SavepointMemoryUsage::SavepointMemoryUsage(const LayerStack *stack, const QList<const Savepoint*> &savepoints)
+{
+	QSet<const void*> current;
+	for(const Layer *l : stack->m_layers)
+		collectTileData(l, current);
+
+	m_tiles.reserve(savepoints.size());
+	for(const Savepoint *sp : savepoints) {
+		sp->optimizer.waitForFinished();
+
+		QSet<const void*> tiles;
+		for(const Layer *l : sp->layers)
+			collectTileData(l, tiles);
+		tiles.subtract(current);
+
+		for(const void *t : tiles)
+			++m_refs[t];
+		m_tiles.append(tiles);
+	}
+}
+
+float SavepointMemoryUsage::megabytes() const
+{
+	return m_refs.size() * Tile::BYTES / float(1024*1024);
+}
+
+void SavepointMemoryUsage::remove(int index)
+{
+	for(const void *t : m_tiles.at(index)) {
+		auto ref = m_refs.find(t);
+		Q_ASSERT(ref != m_refs.end());
+		if(--ref.value() == 0)
+			m_refs.erase(ref);
+	}
+	m_tiles.removeAt(index);
+}
+
 QList<LayerInfo> LayerStack::layerInfos() const
 {
 	QList<LayerInfo> infos;
@@ -702,6 +1449,8 @@ QList<LayerInfo> LayerStack::layerInfos() const
 
 void Savepoint::toDatastream(QDataStream &out) const
 {
+	optimizer.waitForFinished();
+
 	// Write size
 	out << quint32(width) << quint32(height);
 
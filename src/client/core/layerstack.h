@@ -23,11 +23,19 @@
 
 #include <QObject>
 #include <QList>
+#include <QVector>
 #include <QImage>
 #include <QBitArray>
 #include <QMutex>
+#include <QHash>
+#include <QSet>
+#include <QSharedPointer>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <QFuture>
 
 class QDataStream;
+class QTimer;
 
 namespace paintcore {
 
@@ -35,6 +43,8 @@ class Layer;
 class Tile;
 class Savepoint;
 struct LayerInfo;
+struct UpdateTile;
+struct OptimizedTiles;
 
 /**
  * \brief A stack of layers.
@@ -112,8 +122,25 @@ public:
 	//! Get the width and height of the layer stack
 	QSize size() const { return QSize(_width, _height); }
 
-	//! Paint all changed tiles in the given area
-	void paintChangedTiles(const QRect& rect, QPaintDevice *target, bool clean=true);
+	/**
+	 * @brief Paint all changed tiles in the given area
+	 * @return number of tiles repainted
+	 */
+	int paintChangedTiles(const QRect& rect, QPaintDevice *target, bool clean=true);
+
+	/**
+	 * @brief Paint the tiles that differ from those of a previous snapshot
+	 *
+	 * This is used to render snapshots: the snapshot is compared with the
+	 * one painted previously and the tiles whose content has changed
+	 * are repainted. If the previous snapshot is the one published right
+	 * before this one, only the tiles marked dirty in between are compared.
+	 *
+	 * @param previous the previously painted snapshot (null to repaint everything)
+	 * @param target device to paint onto
+	 * @return the repainted area
+	 */
+	QRect paintDifference(const LayerStack *previous, QPaintDevice *target) const;
 
 	//! Get the merged color value at the point
 	QColor colorAt(int x, int y, int dia=0) const;
@@ -139,18 +166,111 @@ public:
 	//! Mark the tile at the given index as dirty
 	void markDirty(int index);
 
+	//! Mark the tiles under the area dirty after the given layer was changed
+	void markDirty(const Layer *layer, const QRect &area);
+
+	//! Mark the tile at the given index dirty after the given layer was changed
+	void markDirty(const Layer *layer, int index);
+
 	//! Emit areaChanged if anything has been marked as dirty
 	void notifyAreaChanged();
 
+	/**
+	 * @brief Set the minimum interval between areaChanged notifications
+	 *
+	 * Changes made within the interval are collected and emitted together
+	 * when it has elapsed. This limits the refresh rate of the views to
+	 * (roughly) the display frame rate.
+	 *
+	 * @param msecs interval in milliseconds (0 to emit immediately)
+	 */
+	void setNotificationInterval(int msecs) { m_notifyInterval = msecs; }
+
+	/**
+	 * @brief Enable snapshot publishing
+	 *
+	 * When enabled, a read-only copy of the layer stack is made
+	 * whenever areaChanged is emitted. The copy shares its tile data with the
+	 * layer stack, so it can be rendered in another thread while the
+	 * layer stack is being modified.
+	 *
+	 * Snapshots are made only in the layer stack's own thread, between commands.
+	 */
+	void setSnapshotsEnabled(bool enable) { m_snapshotsEnabled = enable; }
+
+	/**
+	 * @brief Get the latest published snapshot
+	 *
+	 * This does not require the layer stack to be locked.
+	 * @return snapshot or a null pointer if none has been published yet
+	 */
+	QSharedPointer<const LayerStack> snapshot() const;
+
 	//! Emit a layer info change notification
 	void notifyLayerInfoChange(const Layer *layer);
 
-	//! Create a new savepoint
-	Savepoint *makeSavepoint();
+	/**
+	 * @brief Set the layer currently being drawn on
+	 *
+	 * While a layer is being edited, the composites of the layers below it
+	 * are cached. The cache is used by paintChangedTiles and by the snapshots'
+	 * paintDifference.
+	 */
+	void setEditedLayer(const Layer *layer) { m_editedLayer = layer; }
+
+	/**
+	 * @brief Stop caching composites for the edited layer
+	 *
+	 * This should be called when a stroke ends.
+	 */
+	void endEditing();
+
+	/**
+	 * @brief Create a new savepoint
+	 *
+	 * Creating the savepoint only copies the tile directories of the layers.
+	 * If optimization is enabled, the tiles modified since the previous savepoint are
+	 * optimized in a background thread. The optimized tiles are picked up by the layer
+	 * stack when the next savepoint is made.
+	 *
+	 * @param optimize optimize the savepoint's tiles (disable for short-lived savepoints)
+	 */
+	Savepoint *makeSavepoint(bool optimize=true);
 
 	//! Restore layer stack to a previous savepoint
 	void restoreSavepoint(const Savepoint *savepoint);
 
+	/**
+	 * @brief Check if the savepoint has the same canvas size and layers as the stack
+	 *
+	 * Only the layer IDs and attributes are compared, not the content.
+	 */
+	bool hasSameLayers(const Savepoint *savepoint) const;
+
+	/**
+	 * @brief Restore a subset of the tiles from a savepoint
+	 *
+	 * The savepoint must have the same layers as the stack (see hasSameLayers).
+	 * Changed tiles are marked as dirty.
+	 *
+	 * @param savepoint the savepoint to restore from
+	 * @param tiles tile selection for each layer (in layer stack order)
+	 * @param invert if true, the tiles that are not selected are restored
+	 */
+	void restoreSavepointTiles(const Savepoint *savepoint, const QVector<QBitArray> &tiles, bool invert=false);
+
+	/**
+	 * @brief Make a copy of a savepoint with a subset of the tiles taken from the stack
+	 *
+	 * This is used to update savepoints after a partial replay.
+	 * The savepoint must have the same layers as the stack (see hasSameLayers).
+	 *
+	 * @param savepoint the savepoint to copy
+	 * @param tiles tile selection for each layer (in layer stack order)
+	 * @return new savepoint
+	 */
+	Savepoint *patchSavepoint(const Savepoint *savepoint, const QVector<QBitArray> &tiles) const;
+
 	//! Set layer view mode
 	void setViewMode(ViewMode mode);
 
@@ -201,8 +321,30 @@ signals:
 	//! All (or at least a lot of) layers have just changed
 	void layersChanged(const QList<LayerInfo> &layers);
 
+private slots:
+	void flushAreaChanged();
+	void startNotificationTimer();
+
 private:
+	struct FlatTileCache;
+	struct FlatCache;
+
+	//! Construct a snapshot (a read-only copy) of the given layer stack
+	LayerStack(const LayerStack &stack);
+
+	void publishSnapshot();
+	void adoptOptimizedTiles(OptimizedTiles &result);
+	bool sameLayout(const LayerStack *other) const;
+	int notificationDelay() const;
+	void scheduleNotification();
+
+	void flattenUpdates(QList<UpdateTile*> &updates) const;
 	void flattenTile(quint32 *data, int xindex, int yindex) const;
+	void flattenCachedTile(quint32 *data, int xindex, int yindex, int editedIdx, FlatTileCache *cache) const;
+	bool isEditedOrAbove(const Layer *layer) const;
+	void compositeLayer(quint32 *data, int layeridx, int xindex, int yindex) const;
+	int firstVisibleLayerAt(int xindex, int yindex) const;
+	void clearFlatCache();
 
 	bool isVisible(int idx) const;
 	int layerOpacity(int idx) const;
@@ -210,6 +352,8 @@ private:
 
 	QList<LayerInfo> layerInfos() const;
 
+	friend class SavepointMemoryUsage;
+
 	int _width, _height;
 	int _xtiles, _ytiles;
 	QList<Layer*> m_layers;
@@ -225,21 +369,80 @@ private:
 
 	QMutex m_mutex;
 	bool m_locked;
+
+	int m_notifyInterval;
+	QElapsedTimer m_lastNotify; // accessed in the layer stack's own thread only
+	QTimer *m_notifyTimer;
+	QAtomicInt m_notifyScheduled;
+
+	bool m_snapshotsEnabled;
+	QSharedPointer<const LayerStack> m_snapshot;
+	mutable QMutex m_snapshotMutex;
+
+	// Tiles marked dirty since the previous snapshot. In a snapshot, these
+	// are the tiles that may differ from the snapshot published before it.
+	QBitArray m_changedTiles;
+	quint64 m_snapshotSerial;
+
+	// The layer being drawn on and the cached composites of the layers below it.
+	// The cache is shared with the snapshots. A tile's generation number is
+	// incremented whenever it changes in a layer below the edited one.
+	const Layer *m_editedLayer;
+	QSharedPointer<FlatCache> m_flatcache;
+	QVector<quint32> m_tileGenerations;
 };
 
 /// Layer stack savepoint for undo use
 class Savepoint {
 	friend class LayerStack;
+	friend class SavepointMemoryUsage;
 public:
 	~Savepoint();
 
 	void toDatastream(QDataStream &out) const;
 	static Savepoint *fromDatastream(QDataStream &in, LayerStack *owner);
 
+	/**
+	 * @brief Get the size of the tiles that may have changed since the previous savepoint
+	 *
+	 * This is counted in whole tile chunks, so it is an overestimate of the
+	 * memory the savepoint adds to the previous ones. It can be used to
+	 * decide when a SavepointMemoryUsage measurement is needed.
+	 */
+	float changedMegabytes() const;
+
 private:
-	Savepoint() {}
+	Savepoint() : changedTiles(0) {}
 	QList<Layer*> layers;
 	int width, height;
+	int changedTiles;
+
+	// Background optimization of the layers. Must be finished before the layers are accessed.
+	mutable QFuture<void> optimizer;
+};
+
+/**
+ * @brief Tile memory held only by a set of savepoints
+ *
+ * Tiles that are also used by the layer stack itself are not counted,
+ * and tiles shared between savepoints are counted once.
+ *
+ * The tiles are collected once when the measurement is made. After that,
+ * savepoints can be removed from the set without a new measurement.
+ */
+class SavepointMemoryUsage {
+public:
+	SavepointMemoryUsage(const LayerStack *stack, const QList<const Savepoint*> &savepoints);
+
+	//! Get the memory usage in megabytes
+	float megabytes() const;
+
+	//! Remove the savepoint at the given index (in the measured list) from the set
+	void remove(int index);
+
+private:
+	QList<QSet<const void*>> m_tiles; // tiles of each savepoint not used by the layer stack
+	QHash<const void*, int> m_refs;   // number of savepoints using each tile
 };
 
 }
@@ -18,9 +18,18 @@
 */
 
 #include "rasterop.h"
+#include "rasterop_simd.h"
 
 #include <QRgb>
 
+#ifdef HAVE_X86_SIMD
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
 namespace paintcore {
 
 // This is borrowed from Pigment of koffice libs:
@@ -484,7 +493,7 @@ void doPixelComposite(quint32 *destination, const quint32 *source, uchar alpha,
 	}
 }
 
-void compositeMask(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask,
+void compositeMaskScalar(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask,
 		int w, int h, int maskskip, int baseskip)
 {
 	switch(mode) {
@@ -505,7 +514,7 @@ void compositeMask(BlendMode::Mode mode, quint32 *base, quint32 color, const uch
 	}
 }
 
-void compositePixels(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+void compositePixelsScalar(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity)
 {
 	switch(mode) {
 	case BlendMode::MODE_ERASE: doPixelErase(base, over, opacity, len); break;
@@ -525,4 +534,150 @@ void compositePixels(BlendMode::Mode mode, quint32 *base, const quint32 *over, i
 	}
 }
 
+namespace {
+
+typedef void (*CompositeMaskFunc)(BlendMode::Mode, quint32*, quint32, const uchar*, int, int, int, int);
+typedef void (*CompositePixelsFunc)(BlendMode::Mode, quint32*, const quint32*, int, uchar);
+
+struct Kernels {
+	SimdLevel level;
+	CompositeMaskFunc mask;
+	CompositePixelsFunc pixels;
+};
+
+#ifdef HAVE_X86_SIMD
+void cpuid(int leaf, int subleaf, unsigned int regs[4])
+{
+#ifdef _MSC_VER
+	int r[4];
+	__cpuidex(r, leaf, subleaf);
+	for(int i=0;i<4;++i)
+		regs[i] = r[i];
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Check if the OS saves the YMM registers on context switch
+bool osSupportsAvx()
+{
+#ifdef _MSC_VER
+	return (_xgetbv(0) & 0x06) == 0x06;
+#else
+	unsigned int eax, edx;
+	__asm__ ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return (eax & 0x06) == 0x06;
+#endif
+}
+#endif
+
+Kernels kernelsFor(SimdLevel level)
+{
+	switch(level) {
+#ifdef HAVE_X86_SIMD
+	case SIMD_SSE2: return Kernels { SIMD_SSE2, compositeMaskSSE2, compositePixelsSSE2 };
+	case SIMD_SSSE3: return Kernels { SIMD_SSSE3, compositeMaskSSSE3, compositePixelsSSSE3 };
+	case SIMD_AVX2: return Kernels { SIMD_AVX2, compositeMaskAVX2, compositePixelsAVX2 };
+#endif
+	default: return Kernels { SIMD_NONE, compositeMaskScalar, compositePixelsScalar };
+	}
+}
+
+// Brush dabs and tile flattening go through these.
+// Selected on first use, so the CPU is not probed during static initialization.
+Kernels &kernels()
+{
+	static Kernels k = kernelsFor(detectSimdLevel());
+	return k;
+}
+
+}
+
+SimdLevel detectSimdLevel()
+{
+#ifdef HAVE_X86_SIMD
+	unsigned int regs[4];
+	cpuid(0, 0, regs);
+	const unsigned int maxLeaf = regs[0];
+
+	cpuid(1, 0, regs);
+	const bool sse2 = regs[3] & (1<<26);
+	const bool ssse3 = regs[2] & (1<<9);
+	const bool avx = (regs[2] & (1<<28)) && (regs[2] & (1<<27)) && osSupportsAvx();
+
+	bool avx2 = false;
+	if(avx && maxLeaf >= 7) {
+		cpuid(7, 0, regs);
+		avx2 = regs[1] & (1<<5);
+	}
+
+	if(avx2)
+		return SIMD_AVX2;
+	if(ssse3)
+		return SIMD_SSSE3;
+	if(sse2)
+		return SIMD_SSE2;
+#endif
+	return SIMD_NONE;
+}
+
+SimdLevel simdLevel()
+{
+	return kernels().level;
+}
+
+bool setSimdLevel(SimdLevel level)
+{
+	if(level > detectSimdLevel())
+		return false;
+
+	kernels() = kernelsFor(level);
+	return true;
+}
+
+const char *simdLevelName(SimdLevel level)
+{
+	switch(level) {
+	case SIMD_NONE: return "none";
+	case SIMD_SSE2: return "SSE2";
+	case SIMD_SSSE3: return "SSSE3";
+	case SIMD_AVX2: return "AVX2";
+	}
+	return "?";
+}
+
+void compositeMask(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask,
+		int w, int h, int maskskip, int baseskip)
+{
+	kernels().mask(mode, base, color, mask, w, h, maskskip, baseskip);
+}
+
+void compositePixels(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+{
+	kernels().pixels(mode, base, over, len, opacity);
+}
+
+void compositeColor(BlendMode::Mode mode, quint32 *base, quint32 color, int len, uchar opacity)
+{
+	// Normal mode with a fully opaque color simply replaces the pixels
+	if(mode == BlendMode::MODE_NORMAL && UINT8_MULT(qAlpha(color), opacity) == 255) {
+		while(len--)
+			*(base++) = color;
+		return;
+	}
+
+	// Otherwise, composite a short span of the color repeatedly
+	const int SPAN = 64;
+	quint32 span[SPAN];
+	for(int i=0;i<SPAN;++i)
+		span[i] = color;
+
+	while(len>0) {
+		const int n = qMin(len, SPAN);
+		kernels().pixels(mode, base, span, n, opacity);
+		base += n;
+		len -= n;
+	}
+}
+
 }
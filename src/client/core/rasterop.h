@@ -26,6 +26,46 @@
 
 namespace paintcore {
 
+/**
+ * Instruction sets the compositing kernels can be built for.
+ *
+ * The best level supported by the CPU is selected automatically at startup.
+ * All levels produce bit-identical results, so clients using different
+ * kernels stay in sync.
+ */
+enum SimdLevel {
+	SIMD_NONE,  // portable scalar code
+	SIMD_SSE2,
+	SIMD_SSSE3,
+	SIMD_AVX2
+};
+
+/**
+ * @brief Get the highest SIMD level supported by both this build and the CPU
+ */
+SimdLevel detectSimdLevel();
+
+/**
+ * @brief Get the SIMD level of the compositing kernels currently in use
+ */
+SimdLevel simdLevel();
+
+/**
+ * @brief Select the compositing kernels to use
+ *
+ * This must not be called while compositing is in progress in another thread.
+ * It is intended for testing and benchmarking.
+ *
+ * @param level requested level
+ * @return false if the level is not supported (the selection is not changed)
+ */
+bool setSimdLevel(SimdLevel level);
+
+/**
+ * @brief Get a human readable name of a SIMD level
+ */
+const char *simdLevelName(SimdLevel level);
+
 /**
  * Composite a color using a mask onto an image.
  * @param mode composition mode
@@ -49,6 +89,20 @@ void compositeMask(BlendMode::Mode mode, quint32 *base, quint32 color, const uch
  */
 void compositePixels(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity);
 
+/**
+ * Composite a solid color onto an image.
+ *
+ * This gives the same result as compositePixels with a buffer
+ * filled with the color.
+ *
+ * @param mode composition mode
+ * @param base pixels onto which the color is composited
+ * @param color ARGB color value
+ * @param len number of pixels to blend
+ * @param opacity blend opacity (0..255)
+ */
+void compositeColor(BlendMode::Mode mode, quint32 *base, quint32 color, int len, uchar opacity);
+
 /**
  * Get a weighted average of the pixel data using the mask as the weights
  *
@@ -0,0 +1,110 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// AVX2 compositing kernels (8 pixels per iteration)
+// Note: AVX2 unpack and pack instructions work within 128 bit lanes.
+// The "low" half holds pixels 0, 1, 4 and 5 and the "high" half pixels
+// 2, 3, 6 and 7. Packing the halves back together restores the order.
+// This file is compiled with -mavx2
+
+#ifdef HAVE_X86_SIMD
+
+#include <immintrin.h>
+
+#include "rasterop_simd_kernels.h"
+
+namespace paintcore {
+namespace {
+
+struct AVX2 {
+	typedef __m256i V;
+	typedef __m256 F;
+	enum { N = 8 };
+
+	static V load(const quint32 *p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+	static void store(quint32 *p, V v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+
+	static V zero() { return _mm256_setzero_si256(); }
+	static V set1(short v) { return _mm256_set1_epi16(v); }
+	static V set64(qint64 v) { return _mm256_set1_epi64x(v); }
+
+	static V unpackLo(V v) { return _mm256_unpacklo_epi8(v, _mm256_setzero_si256()); }
+	static V unpackHi(V v) { return _mm256_unpackhi_epi8(v, _mm256_setzero_si256()); }
+	static V pack(V lo, V hi) { return _mm256_packus_epi16(lo, hi); }
+
+	static void loadMask(const uchar *mask, V &lo, V &hi) {
+		qint64 m;
+		memcpy(&m, mask, sizeof(m));
+		const V v = _mm256_set1_epi64x(m);
+		lo = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+			0,-1,0,-1,0,-1,0,-1, 1,-1,1,-1,1,-1,1,-1,
+			4,-1,4,-1,4,-1,4,-1, 5,-1,5,-1,5,-1,5,-1
+		));
+		hi = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+			2,-1,2,-1,2,-1,2,-1, 3,-1,3,-1,3,-1,3,-1,
+			6,-1,6,-1,6,-1,6,-1, 7,-1,7,-1,7,-1,7,-1
+		));
+	}
+
+	static V alpha(V v) {
+		return _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+			6,7,6,7,6,7,6,7, 14,15,14,15,14,15,14,15,
+			6,7,6,7,6,7,6,7, 14,15,14,15,14,15,14,15
+		));
+	}
+
+	static V add(V a, V b) { return _mm256_add_epi16(a, b); }
+	static V sub(V a, V b) { return _mm256_sub_epi16(a, b); }
+	static V mul(V a, V b) { return _mm256_mullo_epi16(a, b); }
+	static V srl8(V v) { return _mm256_srli_epi16(v, 8); }
+	static V sll8(V v) { return _mm256_slli_epi16(v, 8); }
+	static V srl1(V v) { return _mm256_srli_epi16(v, 1); }
+	static V and_(V a, V b) { return _mm256_and_si256(a, b); }
+	static V or_(V a, V b) { return _mm256_or_si256(a, b); }
+	static V andnot(V a, V b) { return _mm256_andnot_si256(a, b); }
+	static V cmpeq(V a, V b) { return _mm256_cmpeq_epi16(a, b); }
+	static V min(V a, V b) { return _mm256_min_epi16(a, b); }
+	static V max(V a, V b) { return _mm256_max_epi16(a, b); }
+
+	static F floatLo(V v) { return _mm256_cvtepi32_ps(_mm256_unpacklo_epi16(v, _mm256_setzero_si256())); }
+	static F floatHi(V v) { return _mm256_cvtepi32_ps(_mm256_unpackhi_epi16(v, _mm256_setzero_si256())); }
+	static V fromFloat(F lo, F hi) { return _mm256_packs_epi32(_mm256_cvttps_epi32(lo), _mm256_cvttps_epi32(hi)); }
+	static F fset1(float v) { return _mm256_set1_ps(v); }
+	static F fadd(F a, F b) { return _mm256_add_ps(a, b); }
+	static F fmul(F a, F b) { return _mm256_mul_ps(a, b); }
+	static F fdiv(F a, F b) { return _mm256_div_ps(a, b); }
+	static F fmin(F a, F b) { return _mm256_min_ps(a, b); }
+};
+
+}
+
+void compositeMaskAVX2(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask,
+		int w, int h, int maskskip, int baseskip)
+{
+	compositeMaskSimd<AVX2>(mode, base, color, mask, w, h, maskskip, baseskip);
+}
+
+void compositePixelsAVX2(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+{
+	compositePixelsSimd<AVX2>(mode, base, over, len, opacity);
+}
+
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_RASTEROP_SIMD_H
+#define PAINTCORE_RASTEROP_SIMD_H
+
+#include "blendmodes.h"
+
+// Internal header: the instruction set specific compositing kernels.
+// Use compositeMask and compositePixels from rasterop.h instead.
+
+namespace paintcore {
+
+// The reference implementation. The SIMD kernels must produce bit-identical results.
+void compositeMaskScalar(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+void compositePixelsScalar(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity);
+
+#ifdef HAVE_X86_SIMD
+void compositeMaskSSE2(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+void compositePixelsSSE2(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity);
+
+void compositeMaskSSSE3(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+void compositePixelsSSSE3(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity);
+
+void compositeMaskAVX2(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip);
+void compositePixelsAVX2(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity);
+#endif
+
+}
+
+#endif
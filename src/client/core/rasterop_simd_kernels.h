@@ -0,0 +1,444 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Instruction set independent SIMD compositing kernels.
+//
+// This file is included by rasterop_sse2.cpp, rasterop_ssse3.cpp and
+// rasterop_avx2.cpp after they have defined an instruction set traits class.
+// Each of those files is compiled with different compiler flags, so everything
+// here lives in an anonymous namespace to keep the linker from merging
+// functions compiled for different instruction sets.
+//
+// Pixels are unpacked into 16 bit lanes, four lanes (B, G, R, A) per pixel.
+// Per-pixel values (mask, alpha) are broadcast to all four lanes of their pixel.
+//
+// The kernels replicate the scalar code in rasterop.cpp exactly, including
+// its rounding and the wraparound when a result is stored in an uchar.
+// Divisions are done in single precision floating point: all the numerators
+// and denominators are small enough integers that the truncated quotient is exact.
+
+#include "rasterop_simd.h"
+
+#include <cstring>
+
+namespace paintcore {
+namespace {
+
+template<class T> struct Simd {
+	typedef typename T::V V;
+	typedef typename T::F F;
+
+	static V alphaLanes() { return T::set64(0xffff000000000000LL); }
+	static V colorLanes() { return T::set64(0x0000ffffffffffffLL); }
+
+	//! Unpack a single pixel into a vector of repeated B, G, R, A lanes
+	static V splat(quint32 pixel) {
+		return T::set64(
+			qint64(pixel & 0xff) |
+			qint64((pixel >> 8) & 0xff) << 16 |
+			qint64((pixel >> 16) & 0xff) << 32 |
+			qint64((pixel >> 24) & 0xff) << 48
+		);
+	}
+
+	static V select(V cond, V a, V b) { return T::or_(T::and_(cond, a), T::andnot(cond, b)); }
+
+	//! Take the color lanes from c and the alpha lane from a
+	static V withAlpha(V c, V a) { return T::or_(T::and_(c, colorLanes()), T::and_(a, alphaLanes())); }
+
+	//! UINT8_MULT
+	static V mult(V a, V b) {
+		const V c = T::add(T::mul(a, b), T::set1(0x80));
+		return T::srl8(T::add(T::srl8(c), c));
+	}
+
+	//! UINT8_BLEND
+	static V blend(V a, V b, V alpha) {
+		// The intermediate values may wrap around, but the end result always fits in 16 bits
+		const V c = T::add(T::add(T::mul(T::sub(a, b), alpha), T::sub(T::sll8(b), b)), T::set1(0x80));
+		return T::srl8(T::add(T::srl8(c), c));
+	}
+
+	//! UINT8_DIVIDE (a*255 + b/2) / b (b must not be zero)
+	static V divide(V a, V b) {
+		const F n255 = T::fset1(255.0f);
+		const F lo = T::fdiv(T::fadd(T::fmul(T::floatLo(a), n255), T::floatLo(T::srl1(b))), T::floatLo(b));
+		const F hi = T::fdiv(T::fadd(T::fmul(T::floatHi(a), n255), T::floatHi(T::srl1(b))), T::floatHi(b));
+		return T::fromFloat(lo, hi);
+	}
+
+	//! min(255, n / d) where n and d are unsigned 16 bit values and d is not zero
+	static V divideSaturated(V n, V d) {
+		const F n255 = T::fset1(255.0f);
+		const F lo = T::fmin(T::fdiv(T::floatLo(n), T::floatLo(d)), n255);
+		const F hi = T::fmin(T::fdiv(T::floatHi(n), T::floatHi(d)), n255);
+		return T::fromFloat(lo, hi);
+	}
+
+	//! Replace zero lanes with ones, to avoid divisions by zero in lanes whose results are discarded anyway
+	static V nonzero(V v) { return T::or_(v, T::and_(T::cmpeq(v, T::zero()), T::set1(1))); }
+
+	static V byteMask() { return T::set1(0xff); }
+};
+
+// Blending operations (see the scalar blend_* functions)
+struct OpBlend {
+	template<class T> static typename T::V apply(typename T::V base, typename T::V blend) {
+		Q_UNUSED(base);
+		return blend;
+	}
+};
+
+struct OpMultiply {
+	template<class T> static typename T::V apply(typename T::V base, typename T::V blend) {
+		return Simd<T>::mult(base, blend);
+	}
+};
+
+struct OpDivide {
+	template<class T> static typename T::V apply(typename T::V base, typename T::V blend) {
+		return Simd<T>::divideSaturated(
+			T::add(T::sll8(base), T::srl1(blend)),
+			T::add(blend, T::set1(1))
+		);
+	}
+};
+
+struct OpDarken {
+	template<class T> static typename T::V apply(typename T::V base, typename T::V blend) {
+		return T::min(base, blend);
+	}
+};
+
+struct OpLighten {
+	template<class T> static typename T::V apply(typename T::V base, typename T::V blend) {
+		return T::max(base, blend);
+	}
+};
+
+struct OpDodge {
+	template<class T> static typename T::V apply(typename T::V base, typename T::V blend) {
+		return Simd<T>::divideSaturated(T::sll8(base), T::sub(T::set1(256), blend));
+	}
+};
+
+struct OpBurn {
+	template<class T> static typename T::V apply(typename T::V base, typename T::V blend) {
+		const typename T::V v255 = T::set1(255);
+		return T::sub(v255, Simd<T>::divideSaturated(
+			T::sll8(T::sub(v255, base)),
+			T::add(blend, T::set1(1))
+		));
+	}
+};
+
+struct OpAdd {
+	template<class T> static typename T::V apply(typename T::V base, typename T::V blend) {
+		return T::min(T::add(base, blend), T::set1(255));
+	}
+};
+
+struct OpSubtract {
+	template<class T> static typename T::V apply(typename T::V base, typename T::V blend) {
+		return T::max(T::sub(base, blend), T::zero());
+	}
+};
+
+template<int N> bool isZero(const uchar *mask)
+{
+	static const uchar zeros[N] = {0};
+	return memcmp(mask, zeros, N) == 0;
+}
+
+//// Mask compositing kernels ////
+
+// doAlphaMaskBlend
+template<class T> struct MaskNormal {
+	typedef typename T::V V;
+	typedef Simd<T> S;
+	V src;
+	enum { SkipTransparent = 1 };
+
+	explicit MaskNormal(quint32 color) : src(T::and_(S::splat(color), S::colorLanes())) { }
+
+	V operator()(V d, V m) const {
+		const V v255 = T::set1(255);
+		const V da = T::alpha(d);
+		const V a2 = S::mult(da, T::sub(v255, m));
+		const V aout = T::add(m, a2);
+
+		V g = T::and_(S::divide(T::add(S::mult(m, src), S::mult(a2, d)), S::nonzero(aout)), S::byteMask());
+		g = S::withAlpha(g, aout);
+
+		const V solid = T::or_(src, T::and_(m, S::alphaLanes()));
+		const V r = S::select(T::or_(T::cmpeq(m, v255), T::cmpeq(da, T::zero())), solid, g);
+		return S::select(T::cmpeq(m, T::zero()), d, r);
+	}
+};
+
+// doAlphaMaskUnder
+template<class T> struct MaskBehind {
+	typedef typename T::V V;
+	typedef Simd<T> S;
+	V src;
+	enum { SkipTransparent = 1 };
+
+	explicit MaskBehind(quint32 color) : src(T::and_(S::splat(color), S::colorLanes())) { }
+
+	V operator()(V d, V m) const {
+		const V v255 = T::set1(255);
+		const V da = T::alpha(d);
+		const V a = S::mult(T::sub(v255, da), m);
+		const V aout = T::add(a, da);
+
+		V g = T::and_(S::divide(T::add(S::mult(a, src), S::mult(da, d)), S::nonzero(aout)), S::byteMask());
+		g = S::withAlpha(g, aout);
+
+		const V solid = T::or_(src, T::and_(m, S::alphaLanes()));
+		const V r = S::select(T::cmpeq(da, T::zero()), solid, g);
+		return S::select(T::or_(T::cmpeq(m, T::zero()), T::cmpeq(da, v255)), d, r);
+	}
+};
+
+// doMaskErase
+template<class T> struct MaskErase {
+	typedef typename T::V V;
+	enum { SkipTransparent = 1 };
+
+	explicit MaskErase(quint32) { }
+
+	V operator()(V d, V m) const {
+		return Simd<T>::withAlpha(d, T::max(T::sub(d, m), T::zero()));
+	}
+};
+
+// doMaskCopy
+template<class T> struct MaskCopy {
+	typedef typename T::V V;
+	V src;
+
+	// Transparent parts of the mask erase the destination
+	enum { SkipTransparent = 0 };
+
+	explicit MaskCopy(quint32 color) : src(Simd<T>::splat(color)) { }
+
+	V operator()(V d, V m) const {
+		Q_UNUSED(d);
+		return Simd<T>::mult(src, m);
+	}
+};
+
+// doMaskComposite
+template<class T, class Op> struct MaskComposite {
+	typedef typename T::V V;
+	typedef Simd<T> S;
+	V src;
+	enum { SkipTransparent = 1 };
+
+	explicit MaskComposite(quint32 color) : src(S::splat(color)) { }
+
+	V operator()(V d, V m) const {
+		const V zero = T::zero();
+		const V g = S::blend(Op::template apply<T>(d, src), d, m);
+
+		// Unchanged if the mask is transparent, or if the destination is
+		// transparent and the mask isn't fully opaque
+		const V keep = T::or_(
+			T::cmpeq(m, zero),
+			T::andnot(T::cmpeq(m, T::set1(255)), T::cmpeq(T::alpha(d), zero))
+		);
+		return S::withAlpha(S::select(keep, d, g), d);
+	}
+};
+
+template<class T, class Kernel>
+void maskLoop(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask, int w, int h, int maskskip, int baseskip)
+{
+	const Kernel kernel(color);
+	const int n = T::N;
+
+	for(int y=0;y<h;++y) {
+		int x=0;
+		for(;x<=w-n;x+=n,base+=n,mask+=n) {
+			// Soft brush masks have lots of transparent areas
+			if(Kernel::SkipTransparent && isZero<T::N>(mask))
+				continue;
+
+			typename T::V mlo, mhi;
+			T::loadMask(mask, mlo, mhi);
+
+			const typename T::V px = T::load(base);
+			T::store(base, T::pack(
+				kernel(T::unpackLo(px), mlo),
+				kernel(T::unpackHi(px), mhi)
+			));
+		}
+
+		if(x<w) {
+			compositeMaskScalar(mode, base, color, mask, w-x, 1, 0, 0);
+			base += w-x;
+			mask += w-x;
+		}
+
+		base += baseskip;
+		mask += maskskip;
+	}
+}
+
+//// Pixel compositing kernels ////
+
+// doPixelAlphaBlend
+template<class T> struct PixelNormal {
+	typedef typename T::V V;
+	typedef Simd<T> S;
+	V opacity;
+
+	explicit PixelNormal(uchar o) : opacity(T::set1(o)) { }
+
+	V operator()(V d, V s) const {
+		const V a = S::mult(T::alpha(s), opacity);
+		const V a2 = S::mult(T::alpha(d), T::sub(T::set1(255), a));
+		const V aout = T::add(a, a2);
+
+		V g = T::and_(S::divide(T::add(S::mult(a, s), S::mult(a2, d)), S::nonzero(aout)), S::byteMask());
+		g = S::withAlpha(g, aout);
+		return S::select(T::cmpeq(aout, T::zero()), d, g);
+	}
+};
+
+// doPixelAlphaUnder
+template<class T> struct PixelBehind {
+	typedef typename T::V V;
+	typedef Simd<T> S;
+	V opacity;
+
+	explicit PixelBehind(uchar o) : opacity(T::set1(o)) { }
+
+	V operator()(V d, V s) const {
+		const V a2 = T::alpha(d);
+		const V a = S::mult(T::sub(T::set1(255), a2), S::mult(T::alpha(s), opacity));
+		const V aout = T::add(a, a2);
+
+		V g = T::and_(S::divide(T::add(S::mult(a, s), S::mult(a2, d)), S::nonzero(aout)), S::byteMask());
+		g = S::withAlpha(g, aout);
+		return S::select(T::cmpeq(aout, T::zero()), d, g);
+	}
+};
+
+// doPixelErase
+template<class T> struct PixelErase {
+	typedef typename T::V V;
+	V opacity;
+
+	explicit PixelErase(uchar o) : opacity(T::set1(o)) { }
+
+	V operator()(V d, V s) const {
+		const V e = T::max(T::sub(d, Simd<T>::mult(s, opacity)), T::zero());
+		return Simd<T>::withAlpha(d, e);
+	}
+};
+
+// doPixelComposite
+template<class T, class Op> struct PixelComposite {
+	typedef typename T::V V;
+	typedef Simd<T> S;
+	V opacity;
+
+	explicit PixelComposite(uchar o) : opacity(T::set1(o)) { }
+
+	V operator()(V d, V s) const {
+		const V zero = T::zero();
+		const V sa = T::alpha(s);
+		const V da = T::alpha(d);
+		const V a2 = S::mult(S::mult(sa, opacity), da);
+		const V g = S::blend(Op::template apply<T>(d, s), d, a2);
+
+		const V keep = T::or_(T::cmpeq(sa, zero), T::cmpeq(da, zero));
+		return S::withAlpha(S::select(keep, d, g), d);
+	}
+};
+
+template<class T, class Kernel>
+void pixelLoop(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+{
+	const Kernel kernel(opacity);
+	const int n = T::N;
+
+	int i=0;
+	for(;i<=len-n;i+=n) {
+		const typename T::V d = T::load(base+i);
+		const typename T::V s = T::load(over+i);
+		T::store(base+i, T::pack(
+			kernel(T::unpackLo(d), T::unpackLo(s)),
+			kernel(T::unpackHi(d), T::unpackHi(s))
+		));
+	}
+
+	if(i<len)
+		compositePixelsScalar(mode, base+i, over+i, len-i, opacity);
+}
+
+template<class T>
+void compositeMaskSimd(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask,
+		int w, int h, int maskskip, int baseskip)
+{
+	switch(mode) {
+	case BlendMode::MODE_ERASE: maskLoop<T, MaskErase<T>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_NORMAL: maskLoop<T, MaskNormal<T>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_MULTIPLY: maskLoop<T, MaskComposite<T, OpMultiply>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_DIVIDE: maskLoop<T, MaskComposite<T, OpDivide>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_BURN: maskLoop<T, MaskComposite<T, OpBurn>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_DODGE: maskLoop<T, MaskComposite<T, OpDodge>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_DARKEN: maskLoop<T, MaskComposite<T, OpDarken>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_LIGHTEN: maskLoop<T, MaskComposite<T, OpLighten>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_SUBTRACT: maskLoop<T, MaskComposite<T, OpSubtract>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_ADD: maskLoop<T, MaskComposite<T, OpAdd>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_RECOLOR: maskLoop<T, MaskComposite<T, OpBlend>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_BEHIND: maskLoop<T, MaskBehind<T>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	case BlendMode::MODE_REPLACE: maskLoop<T, MaskCopy<T>>(mode, base, color, mask, w, h, maskskip, baseskip); break;
+	default:
+		// Color erase is done in double precision floating point: use the reference implementation
+		compositeMaskScalar(mode, base, color, mask, w, h, maskskip, baseskip);
+	}
+}
+
+template<class T>
+void compositePixelsSimd(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+{
+	switch(mode) {
+	case BlendMode::MODE_ERASE: pixelLoop<T, PixelErase<T>>(mode, base, over, len, opacity); break;
+	case BlendMode::MODE_NORMAL: pixelLoop<T, PixelNormal<T>>(mode, base, over, len, opacity); break;
+	case BlendMode::MODE_MULTIPLY: pixelLoop<T, PixelComposite<T, OpMultiply>>(mode, base, over, len, opacity); break;
+	case BlendMode::MODE_DIVIDE: pixelLoop<T, PixelComposite<T, OpDivide>>(mode, base, over, len, opacity); break;
+	case BlendMode::MODE_BURN: pixelLoop<T, PixelComposite<T, OpBurn>>(mode, base, over, len, opacity); break;
+	case BlendMode::MODE_DODGE: pixelLoop<T, PixelComposite<T, OpDodge>>(mode, base, over, len, opacity); break;
+	case BlendMode::MODE_DARKEN: pixelLoop<T, PixelComposite<T, OpDarken>>(mode, base, over, len, opacity); break;
+	case BlendMode::MODE_LIGHTEN: pixelLoop<T, PixelComposite<T, OpLighten>>(mode, base, over, len, opacity); break;
+	case BlendMode::MODE_SUBTRACT: pixelLoop<T, PixelComposite<T, OpSubtract>>(mode, base, over, len, opacity); break;
+	case BlendMode::MODE_ADD: pixelLoop<T, PixelComposite<T, OpAdd>>(mode, base, over, len, opacity); break;
+	case BlendMode::MODE_RECOLOR: pixelLoop<T, PixelComposite<T, OpBlend>>(mode, base, over, len, opacity); break;
+	case BlendMode::MODE_BEHIND: pixelLoop<T, PixelBehind<T>>(mode, base, over, len, opacity); break;
+	default:
+		// Color erase (and the unimplemented replace mode)
+		compositePixelsScalar(mode, base, over, len, opacity);
+	}
+}
+
+}
+}
@@ -0,0 +1,105 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// SSE2 compositing kernels (4 pixels per iteration)
+// This file is compiled with -msse2
+
+#ifdef HAVE_X86_SIMD
+
+#include <emmintrin.h>
+
+#include "rasterop_simd_kernels.h"
+
+namespace paintcore {
+namespace {
+
+struct SSE2 {
+	typedef __m128i V;
+	typedef __m128 F;
+	enum { N = 4 };
+
+	static V load(const quint32 *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+	static void store(quint32 *p, V v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+
+	static V zero() { return _mm_setzero_si128(); }
+	static V set1(short v) { return _mm_set1_epi16(v); }
+	static V set64(qint64 v) { return _mm_set_epi32(int(v>>32), int(v), int(v>>32), int(v)); }
+
+	// Unpack pixels into 16 bit channels and pack them back
+	static V unpackLo(V v) { return _mm_unpacklo_epi8(v, _mm_setzero_si128()); }
+	static V unpackHi(V v) { return _mm_unpackhi_epi8(v, _mm_setzero_si128()); }
+	static V pack(V lo, V hi) { return _mm_packus_epi16(lo, hi); }
+
+	//! Load N mask values and broadcast each to the four channels of its pixel
+	static void loadMask(const uchar *mask, V &lo, V &hi) {
+		int m;
+		memcpy(&m, mask, sizeof(m));
+		V v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(m), _mm_setzero_si128());
+		v = _mm_unpacklo_epi16(v, v);
+		lo = _mm_unpacklo_epi32(v, v);
+		hi = _mm_unpackhi_epi32(v, v);
+	}
+
+	//! Broadcast each pixel's alpha channel to all its channels
+	static V alpha(V v) {
+		return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+	}
+
+	static V add(V a, V b) { return _mm_add_epi16(a, b); }
+	static V sub(V a, V b) { return _mm_sub_epi16(a, b); }
+	static V mul(V a, V b) { return _mm_mullo_epi16(a, b); }
+	static V srl8(V v) { return _mm_srli_epi16(v, 8); }
+	static V sll8(V v) { return _mm_slli_epi16(v, 8); }
+	static V srl1(V v) { return _mm_srli_epi16(v, 1); }
+	static V and_(V a, V b) { return _mm_and_si128(a, b); }
+	static V or_(V a, V b) { return _mm_or_si128(a, b); }
+	static V andnot(V a, V b) { return _mm_andnot_si128(a, b); }
+	static V cmpeq(V a, V b) { return _mm_cmpeq_epi16(a, b); }
+
+	// Signed comparisons: the operands are always within -255..510
+	static V min(V a, V b) { return _mm_min_epi16(a, b); }
+	static V max(V a, V b) { return _mm_max_epi16(a, b); }
+
+	// Unsigned 16 bit lanes to float and back
+	static F floatLo(V v) { return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128())); }
+	static F floatHi(V v) { return _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, _mm_setzero_si128())); }
+	static V fromFloat(F lo, F hi) { return _mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi)); }
+	static F fset1(float v) { return _mm_set1_ps(v); }
+	static F fadd(F a, F b) { return _mm_add_ps(a, b); }
+	static F fmul(F a, F b) { return _mm_mul_ps(a, b); }
+	static F fdiv(F a, F b) { return _mm_div_ps(a, b); }
+	static F fmin(F a, F b) { return _mm_min_ps(a, b); }
+};
+
+}
+
+void compositeMaskSSE2(BlendMode::Mode mode, quint32 *base, quint32 color, const uchar *mask,
+		int w, int h, int maskskip, int baseskip)
+{
+	compositeMaskSimd<SSE2>(mode, base, color, mask, w, h, maskskip, baseskip);
+}
+
+void compositePixelsSSE2(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity)
+{
+	compositePixelsSimd<SSE2>(mode, base, over, len, opacity);
+}
+
+}
+
+#endif
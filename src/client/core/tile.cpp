@@ -20,6 +20,16 @@
 #include <QDebug>
 #include <QImage>
 #include <QPainter>
+#include <QMutex>
+#include <QThreadStorage>
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "tile.h"
 #include "rasterop.h"
@@ -27,12 +37,8 @@
 namespace paintcore {
 
 Tile::Tile(const QColor& color)
-	: _data(new TileData)
+	: _data(0), _color(color.rgba())
 {
-	quint32 *ptr = _data->data;
-	quint32 col = color.rgba();
-	for(int i=0;i<SIZE*SIZE;++i)
-		*(ptr++) = col;
 }
 
 /**
@@ -44,7 +50,7 @@ Tile::Tile(const QColor& color)
  * @param yoff source image offset
  */
 Tile::Tile(const QImage& image, int xoff, int yoff)
-	: _data(new TileData)
+	: _data(new TileData), _color(0)
 {
 	Q_ASSERT(xoff>=0 && xoff < image.width());
 	Q_ASSERT(yoff>=0 && yoff < image.height());
@@ -85,6 +91,8 @@ void Tile::copyTo(quint32 *data) const
 {
 	if(isNull())
 		memset(data, 0, BYTES);
+	else if(isUniform())
+		std::fill(data, data + LENGTH, _color);
 	else
 		memcpy(data, _data->data, BYTES);
 }
@@ -99,6 +107,12 @@ void Tile::copyToImage(QImage& image, int x, int y) const {
 			memset(targ, 0, w);
 			targ += image.bytesPerLine();
 		}
+	} else if(isUniform()) {
+		for(int y=0;y<h;++y) {
+			quint32 *row = reinterpret_cast<quint32*>(targ);
+			std::fill(row, row + w/4, _color);
+			targ += image.bytesPerLine();
+		}
 	} else {
 		const quint32 *ptr = _data->data;
 		for(int y=0;y<h;++y) {
@@ -122,8 +136,13 @@ void Tile::composite(BlendMode::Mode mode, const uchar *values, const QColor& co
 {
 	Q_ASSERT(x>=0 && x<SIZE && y>=0 && y<SIZE);
 	Q_ASSERT((x+w)<=SIZE && (y+h)<=SIZE);
+	const bool staysOpaque = isKnownOpaque() && !findBlendMode(mode).flags.testFlag(BlendMode::DecrOpacity);
+
 	compositeMask(mode, getOrCreateData() + y * SIZE + x,
 			color.rgba(), values, w, h, skip, SIZE-w);
+
+	if(staysOpaque)
+		setKnownOpaque();
 }
 
 /**
@@ -151,6 +170,13 @@ std::array<quint32, 5> Tile::weightedAverage(const uchar *weights, int x, int y,
 
 		return {{weightsum, 0, 0, 0, 0}};
 
+	} else if(isUniform()) {
+		// A negative pixel skip rewinds back to the start of the row
+		// after each line, so a single row of pixels is enough.
+		quint32 row[SIZE];
+		std::fill(row, row + w, _color);
+		return sampleMask(row, weights, w, h, skip, -w);
+
 	} else {
 		return sampleMask(_data->data + y * SIZE + x, weights,
 			w, h, skip, SIZE-w);
@@ -164,8 +190,36 @@ std::array<quint32, 5> Tile::weightedAverage(const uchar *weights, int x, int y,
  */
 void Tile::merge(const Tile &tile, uchar opacity, BlendMode::Mode blend)
 {
-	if(!tile.isNull())
-		compositePixels(blend, getOrCreateData(), tile.data(), SIZE*SIZE, opacity);
+	if(tile.isNull())
+		return;
+
+	if(isUniform() && tile.isUniform()) {
+		// Merging two uniform tiles results in another uniform tile
+		compositePixels(blend, &_color, &tile._color, 1, opacity);
+	} else {
+		const bool staysOpaque = isKnownOpaque() && !findBlendMode(blend).flags.testFlag(BlendMode::DecrOpacity);
+
+		tile.compositeTo(getOrCreateData(), opacity, blend);
+
+		if(staysOpaque)
+			setKnownOpaque();
+	}
+}
+
+/**
+ * @param base the pixel buffer (Tile::LENGTH pixels) onto which this tile is composited
+ * @param opacity opacity modifier of this tile
+ * @param blend blending mode
+ */
+void Tile::compositeTo(quint32 *base, uchar opacity, BlendMode::Mode blend) const
+{
+	if(isNull())
+		return;
+
+	if(isUniform())
+		compositeColor(blend, base, _color, LENGTH, opacity);
+	else
+		compositePixels(blend, base, _data->data, LENGTH, opacity);
 }
 
 /**
@@ -173,8 +227,8 @@ void Tile::merge(const Tile &tile, uchar opacity, BlendMode::Mode blend)
  */
 bool Tile::isBlank() const
 {
-	if(isNull())
-		return true;
+	if(isUniform())
+		return qAlpha(_color) == 0;
 
 	const quint32 *pixel = _data->data;
 	const quint32 *end = pixel + SIZE*SIZE;
@@ -186,19 +240,313 @@ bool Tile::isBlank() const
 	return true;
 }
 
+/**
+ * @return true if every pixel of this tile has an alpha value of 255
+ */
+bool Tile::isOpaque() const
+{
+	if(isUniform())
+		return qAlpha(_color) == 255;
+
+	const int cached = _data->opacity.load();
+	if(cached != TileData::UNKNOWN_OPACITY)
+		return cached == TileData::OPAQUE;
+
+	bool opaque = true;
+	const quint32 *pixel = _data->data;
+	const quint32 *end = pixel + LENGTH;
+	while(pixel<end) {
+		if((*pixel & 0xff000000) != 0xff000000) {
+			opaque = false;
+			break;
+		}
+		++pixel;
+	}
+
+	// Concurrent readers may both get here, but they will store the same value
+	_data->opacity.store(opaque ? TileData::OPAQUE : TileData::NOT_OPAQUE);
+	return opaque;
+}
+
+// Check the opacity without scanning the pixels
+bool Tile::isKnownOpaque() const
+{
+	if(isUniform())
+		return qAlpha(_color) == 255;
+	return _data->opacity.load() == TileData::OPAQUE;
+}
+
+void Tile::setKnownOpaque()
+{
+	Q_ASSERT(_data);
+	_data.constData()->opacity.store(TileData::OPAQUE);
+}
+
+void Tile::optimize()
+{
+	if(isUniform())
+		return;
+
+	// Note: constData() to avoid detaching shared data needlessly
+	const quint32 *pixel = _data.constData()->data;
+	const quint32 *end = pixel + LENGTH;
+	const quint32 first = *pixel;
+
+	bool blank = true;
+	bool uniform = true;
+	while(pixel<end && (blank || uniform)) {
+		blank = blank && !(*pixel & 0xff000000);
+		uniform = uniform && *pixel == first;
+		++pixel;
+	}
+
+	if(blank) {
+		_data = 0;
+		_color = 0;
+	} else if(uniform) {
+		_data = 0;
+		_color = first;
+	}
+}
+
 quint32 *Tile::getOrCreateData() {
 	if(!_data) {
 		_data = new TileData;
-		memset(_data->data, 0, BYTES);
+		if(_color)
+			std::fill(_data->data, _data->data + LENGTH, _color);
+		else
+			memset(_data->data, 0, BYTES);
+		_color = 0;
 	}
+
+	// The caller is about to modify the pixels
+	_data->opacity.store(TileData::UNKNOWN_OPACITY);
 	return _data->data;
 }
 
-#ifndef NDEBUG
-QAtomicInt TileData::_count;
-TileData::TileData() { _count.fetchAndAddOrdered(1); }
-TileData::TileData(const TileData &td) : QSharedData() { memcpy(data, td.data, sizeof data); _count.fetchAndAddOrdered(1); }
-TileData::~TileData() { _count.fetchAndAddOrdered(-1); }
+namespace {
+
+/**
+ * A free list of tile sized memory blocks.
+ *
+ * Tiles are constantly allocated and freed as layers are copied on write,
+ * savepoints are made and dropped and sublayers are merged.
+ * Keeping a reserve of free blocks avoids most of the heap traffic.
+ *
+ * Each thread keeps a small free list of its own in front of the shared pool,
+ * so most allocations don't need to take the mutex. Blocks are moved between
+ * the thread's list and the shared pool in batches.
+ */
+class TilePool {
+public:
+	//! Maximum number of free blocks kept by each thread
+	static const int LOCAL_MAX = 32;
+
+	TilePool() : m_free(nullptr), m_freeCount(0), m_highWaterMark(1024), m_used(false) { }
+
+	void *alloc()
+	{
+		LocalList *local = localList();
+		if(!local->free)
+			refill(local);
+
+		if(local->free) {
+			FreeBlock *b = local->free;
+			local->free = b->next;
+			--local->count;
+			m_localCount.fetchAndAddRelaxed(-1);
+			return b;
+		}
+
+		void *ptr = ::malloc(sizeof(TileData));
+		if(!ptr)
+			throw std::bad_alloc();
+		return ptr;
+	}
+
+	void release(void *ptr)
+	{
+		LocalList *local = localList();
+		if(local->count >= LOCAL_MAX)
+			flush(local, LOCAL_MAX / 2);
+
+		FreeBlock *b = static_cast<FreeBlock*>(ptr);
+		b->next = local->free;
+		local->free = b;
+		++local->count;
+		m_localCount.fetchAndAddRelaxed(1);
+	}
+
+	int freeCount()
+	{
+		QMutexLocker lock(&m_mutex);
+		return m_freeCount + m_localCount.load();
+	}
+
+	void setHighWaterMark(int blocks)
+	{
+		FreeBlock *excess;
+		{
+			QMutexLocker lock(&m_mutex);
+			m_highWaterMark = qMax(0, blocks);
+			excess = takeExcess(m_highWaterMark);
+		}
+		freeBlocks(excess);
+	}
+
+	/**
+	 * Return the shared pool's blocks to the system if no thread has
+	 * needed it since the previous call. The threads' own lists are small,
+	 * so they are left alone.
+	 */
+	void releaseIdle()
+	{
+		FreeBlock *excess = nullptr;
+		{
+			QMutexLocker lock(&m_mutex);
+			if(!m_used)
+				excess = takeExcess(0);
+			m_used = false;
+		}
+		freeBlocks(excess);
+	}
+
+private:
+	struct FreeBlock {
+		FreeBlock *next;
+	};
+
+	// A thread's own free list. Returned to the shared pool when the thread exits.
+	struct LocalList {
+		LocalList(TilePool *p) : pool(p), free(nullptr), count(0) { }
+		~LocalList() { pool->flush(this, count); }
+
+		TilePool *pool;
+		FreeBlock *free;
+		int count;
+	};
+
+	LocalList *localList()
+	{
+		if(!m_local.hasLocalData())
+			m_local.setLocalData(new LocalList(this));
+		return m_local.localData();
+	}
+
+	// Move a batch of blocks from the shared pool to the thread's list
+	void refill(LocalList *local)
+	{
+		QMutexLocker lock(&m_mutex);
+		m_used = true;
+		while(m_free && local->count < LOCAL_MAX / 2) {
+			FreeBlock *b = m_free;
+			m_free = b->next;
+			--m_freeCount;
+
+			b->next = local->free;
+			local->free = b;
+			++local->count;
+			m_localCount.fetchAndAddRelaxed(1);
+		}
+	}
+
+	// Move blocks from the thread's list to the shared pool
+	void flush(LocalList *local, int count)
+	{
+		FreeBlock *excess;
+		{
+			QMutexLocker lock(&m_mutex);
+			while(count-- > 0 && local->free) {
+				FreeBlock *b = local->free;
+				local->free = b->next;
+				--local->count;
+				m_localCount.fetchAndAddRelaxed(-1);
+
+				b->next = m_free;
+				m_free = b;
+				++m_freeCount;
+			}
+			excess = takeExcess(m_highWaterMark);
+		}
+		freeBlocks(excess, false);
+	}
+
+	// Unlink blocks until no more than the given number remain (mutex must be held)
+	FreeBlock *takeExcess(int keep)
+	{
+		FreeBlock *excess = nullptr;
+		while(m_freeCount > keep) {
+			FreeBlock *b = m_free;
+			m_free = b->next;
+			--m_freeCount;
+			b->next = excess;
+			excess = b;
+		}
+		return excess;
+	}
+
+	// Return blocks to the system
+	static void freeBlocks(FreeBlock *blocks, bool shrink=true)
+	{
+		if(!blocks)
+			return;
+
+		while(blocks) {
+			FreeBlock *b = blocks;
+			blocks = b->next;
+			::free(b);
+		}
+
+#ifdef __GLIBC__
+		// Tile sized blocks are allocated from the heap rather than mapped
+		// individually, so freeing them alone may not shrink the process.
+		// Trimming is relatively slow, so it is done only when the pool shrinks.
+		if(shrink)
+			malloc_trim(0);
+#else
+		Q_UNUSED(shrink);
 #endif
+	}
+
+	QMutex m_mutex;
+	FreeBlock *m_free;
+	int m_freeCount;
+	int m_highWaterMark;
+	bool m_used;
+
+	QThreadStorage<LocalList*> m_local;
+	QAtomicInt m_localCount;
+};
+
+TilePool &pool()
+{
+	// Intentionally leaked, as tiles may be freed by static destructors
+	static TilePool *p = new TilePool;
+	return *p;
+}
+
+}
+
+QAtomicInt TileData::_count;
+TileData::TileData() : opacity(UNKNOWN_OPACITY) { _count.fetchAndAddRelaxed(1); }
+TileData::TileData(const TileData &td) : QSharedData(), opacity(td.opacity.load()) { memcpy(data, td.data, sizeof data); _count.fetchAndAddRelaxed(1); }
+TileData::~TileData() { _count.fetchAndAddRelaxed(-1); }
+
+void *TileData::operator new(size_t size)
+{
+	Q_ASSERT(size == sizeof(TileData));
+	Q_UNUSED(size);
+	return pool().alloc();
+}
+
+void TileData::operator delete(void *ptr)
+{
+	if(ptr)
+		pool().release(ptr);
+}
+
+int TileData::pooledCount() { return pool().freeCount(); }
+void TileData::setPoolHighWaterMark(int blocks) { pool().setHighWaterMark(blocks); }
+void TileData::releaseIdleMemory() { pool().releaseIdle(); }
 
 }
@@ -22,10 +22,7 @@
 #include "blendmodes.h"
 
 #include <QSharedDataPointer>
-
-#ifndef NDEBUG
 #include <QAtomicInt>
-#endif
 
 #include <array>
 
@@ -38,22 +35,54 @@ namespace paintcore {
 struct TileData : public QSharedData {
 	quint32 data[64*64];
 
-#ifndef NDEBUG // Debug tool for measuring memory usage
+	//! Cached opacity state (see Tile::isOpaque)
+	enum Opacity { UNKNOWN_OPACITY, OPAQUE, NOT_OPAQUE };
+	mutable QAtomicInt opacity;
+
 	TileData();
 	TileData(const TileData &td);
 	~TileData();
 
+	// Tile data is allocated from a pool of recycled blocks
+	static void *operator new(size_t size);
+	static void operator delete(void *ptr);
+
+	//! Get the number of tiles currently in use
 	static int globalCount() { return _count.load() ; }
+
+	//! Get the amount of memory used by tiles currently in use
 	static float megabytesUsed() { return globalCount() * sizeof data / float(1024*1024); }
+
+	//! Get the number of free blocks kept in the pool for reuse
+	static int pooledCount();
+
+	/**
+	 * @brief Set the maximum number of free blocks to keep in the pool
+	 *
+	 * Blocks freed when the pool is full are returned to the system immediately.
+	 */
+	static void setPoolHighWaterMark(int blocks);
+
+	/**
+	 * @brief Return pooled blocks to the system if the pool has been idle
+	 *
+	 * The pool is idle if no tiles were allocated since the previous call.
+	 * Call this periodically.
+	 */
+	static void releaseIdleMemory();
+
 private:
 	static QAtomicInt _count;
-#endif
 };
 
 /**
  * @brief A piece of an image
  * Each tile is a square of size SIZE*SIZE. The pixel format is 32-bit ARGB.
  *
+ * A tile whose every pixel has the same color does not need a pixel buffer:
+ * only the color is stored. The pixel data is allocated when the tile
+ * is first modified through a non-const accessor. A null tile is simply
+ * a uniformly transparent tile.
  */
 class Tile {
 	public:
@@ -96,9 +125,9 @@ class Tile {
 		}
 
 		//! Construct a null tile
-		Tile() : _data(0) { }
+		Tile() : _data(0), _color(0) { }
 
-		//! Construct a tile filled with the given color
+		//! Construct a uniform tile of the given color (no pixel data is allocated)
 		explicit Tile(const QColor& color);
 
 		//! Construct a tile from an image
@@ -110,7 +139,7 @@ class Tile {
 			Q_ASSERT(y>=0 && y<SIZE);
 			if(_data)
 				return *(_data->data + y * SIZE + x);
-			return 0;
+			return _color;
 		}
 
 		//! Composite values multiplied by color onto this tile
@@ -122,14 +151,21 @@ class Tile {
 		//! Composite another tile with this tile
 		void merge(const Tile &tile, uchar opacity, BlendMode::Mode mode);
 
+		//! Composite this tile onto a tile sized pixel buffer
+		void compositeTo(quint32 *base, uchar opacity, BlendMode::Mode mode) const;
+
 		//! Copy the contents of this tile onto the given spot on an image
 		void copyToImage(QImage& image, int x, int y) const;
 
-		//! Get read access to the raw pixel data
+		/**
+		 * @brief Get read access to the raw pixel data
+		 *
+		 * Uniform tiles have no pixel data: check isUniform() first
+		 */
 		const quint32 *data() const { Q_ASSERT( _data); return _data->data; }
 
-		//! Get read/write access to the raw pixel data
-		quint32 *data() { Q_ASSERT(_data); return _data->data; }
+		//! Get read/write access to the raw pixel data. A uniform tile is expanded.
+		quint32 *data() { return getOrCreateData(); }
 
 		//! Copy the contents of this tile
 		void copyTo(quint32 *data) const;
@@ -141,11 +177,38 @@ class Tile {
 		 * to be completely transparent.
 		 * @return true if there is no pixel data
 		 */
-		bool isNull() const { return !_data; }
+		bool isNull() const { return !_data && !_color; }
+
+		/**
+		 * @brief Is this a tile with no pixel data?
+		 *
+		 * All pixels of a uniform tile have the color returned by uniformColor().
+		 * Null tiles are uniform too.
+		 */
+		bool isUniform() const { return !_data; }
+
+		//! Get the color of a uniform tile
+		quint32 uniformColor() const { Q_ASSERT(!_data); return _color; }
 
 		//! Check if this tile is completely transparent
 		bool isBlank() const;
 
+		/**
+		 * @brief Check if every pixel of this tile is fully opaque
+		 *
+		 * The result is cached until the tile is next modified. Compositing
+		 * with a mode that cannot decrease opacity keeps an opaque tile opaque
+		 * without rechecking.
+		 */
+		bool isOpaque() const;
+
+		/**
+		 * @brief Free the pixel buffer if the tile is uniformly colored
+		 *
+		 * Blank tiles are turned into null tiles.
+		 */
+		void optimize();
+
 		//! Fill a tile sized memory buffer with a checker pattern
 		static void fillChecker(quint32 *data, const QColor& dark, const QColor& light);
 
@@ -157,13 +220,19 @@ class Tile {
 		 * @param other
 		 * @return true if tiles share data pointers
 		 */
-		bool operator==(const Tile &other) const { return _data == other._data; }
+		bool operator==(const Tile &other) const { return _data == other._data && _color == other._color; }
 		bool operator!=(const Tile &other) const { return !(*this == other); }
 
+		//! Get the identity of the shared pixel buffer (null for uniform tiles)
+		const void *dataId() const { return _data.constData(); }
+
 	private:
 		quint32 *getOrCreateData();
+		bool isKnownOpaque() const;
+		void setKnownOpaque();
 
 		QSharedDataPointer<TileData> _data;
+		quint32 _color; // color of a tile without pixel data
 };
 
 }
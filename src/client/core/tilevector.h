@@ -0,0 +1,172 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TILEVECTOR_H
+#define TILEVECTOR_H
+
+#include "tile.h"
+
+#include <QVector>
+#include <QSharedDataPointer>
+
+namespace paintcore {
+
+/**
+ * @brief A copy-on-write array of tiles, split into chunks
+ *
+ * The tiles are stored in fixed size chunks that are shared between
+ * copies of the vector. Copying the vector is cheap, and modifying a tile
+ * only copies the chunk it is in, so copies that differ only by a few tiles
+ * share most of their memory.
+ *
+ * The vector also keeps track of the chunks that have been modified
+ * since the last call to optimize(), so only those need to be optimized again.
+ *
+ * Note. Non-const access to the tiles is not thread safe, unless the
+ * tiles have been detached in advance using detach(index).
+ */
+class TileVector {
+public:
+	//! Number of tiles in a chunk
+	static const int CHUNK = 64;
+
+	TileVector() : m_size(0) { }
+
+	//! Construct a vector of null tiles
+	explicit TileVector(int size)
+		: m_size(size)
+	{
+		const int chunks = (size + CHUNK - 1) / CHUNK;
+		if(chunks>0) {
+			// All the chunks share the same data until modified
+			m_chunks.fill(QSharedDataPointer<Chunk>(new Chunk), chunks);
+			m_modified.fill(false, chunks);
+		}
+	}
+
+	//! Get the number of tiles
+	int size() const { return m_size; }
+
+	//! Get the number of tiles
+	int count() const { return m_size; }
+
+	//! Get a tile
+	const Tile &at(int i) const {
+		Q_ASSERT(i>=0 && i<m_size);
+		return m_chunks.at(i / CHUNK).constData()->tiles[i % CHUNK];
+	}
+
+	//! Get a tile
+	const Tile &operator[](int i) const { return at(i); }
+
+	//! Get a modifiable reference to a tile (detaches its chunk)
+	Tile &operator[](int i) {
+		Q_ASSERT(i>=0 && i<m_size);
+		const int c = i / CHUNK;
+		if(!m_modified.at(c))
+			m_modified[c] = true;
+		return m_chunks[c]->tiles[i % CHUNK];
+	}
+
+	/**
+	 * @brief Make sure the tile at the given index can be modified concurrently
+	 *
+	 * After this, the tile can be modified through operator[] without
+	 * changing the vector's internal structure, so different tiles can be
+	 * modified from different threads.
+	 */
+	void detach(int i) { (*this)[i]; }
+
+	//! Fill the vector with the given tile
+	void fill(const Tile &tile) {
+		if(m_chunks.isEmpty())
+			return;
+
+		QSharedDataPointer<Chunk> c(new Chunk);
+		for(int i=0;i<CHUNK;++i)
+			c->tiles[i] = tile;
+
+		m_chunks.fill(c);
+		m_modified.fill(!tile.isUniform());
+	}
+
+	/**
+	 * @brief Optimize the tiles modified since the last call
+	 *
+	 * @see Tile::optimize
+	 */
+	void optimize() {
+		for(int c=0;c<m_chunks.size();++c) {
+			if(!m_modified.at(c))
+				continue;
+
+			const int end = qMin(m_size, (c+1) * CHUNK);
+			for(int i=c*CHUNK;i<end;++i) {
+				if(!at(i).isUniform())
+					(*this)[i].optimize();
+			}
+		}
+		m_modified.fill(false);
+	}
+
+	/**
+	 * @brief Forget which chunks have been modified
+	 *
+	 * This is used when the optimization is done in a copy of the vector instead.
+	 */
+	void clearModified() { m_modified.fill(false); }
+
+	/**
+	 * @brief Check if the given chunk is shared with another vector
+	 *
+	 * If the chunk is shared, the tiles in it are identical in both vectors.
+	 *
+	 * @param other another vector of the same size
+	 * @param chunk chunk index
+	 */
+	bool isSameChunk(const TileVector &other, int chunk) const {
+		Q_ASSERT(other.m_size == m_size);
+		return m_chunks.at(chunk).constData() == other.m_chunks.at(chunk).constData();
+	}
+
+	//! Get the number of chunks
+	int chunkCount() const { return m_chunks.size(); }
+
+	//! Get the number of tiles in the chunks modified since the last optimization
+	int modifiedTiles() const {
+		int count = 0;
+		for(int c=0;c<m_modified.size();++c) {
+			if(m_modified.at(c))
+				count += qMin(CHUNK, m_size - c*CHUNK);
+		}
+		return count;
+	}
+
+private:
+	struct Chunk : public QSharedData {
+		Tile tiles[CHUNK];
+	};
+
+	QVector<QSharedDataPointer<Chunk>> m_chunks;
+	QVector<bool> m_modified;
+	int m_size;
+};
+
+}
+
+#endif
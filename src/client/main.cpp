@@ -28,6 +28,7 @@
 #include "canvas/register.h"
 #include "quick/register.h"
 #include "core/register.h"
+#include "core/tile.h"
 #include "../shared/net/message.h"
 
 #ifdef Q_OS_MAC
@@ -241,6 +242,9 @@ int main(int argc, char *argv[]) {
 		initTranslations(locale);
 	}
 
+	// Number of free tile buffers (16 KiB each) to keep around for reuse
+	paintcore::TileData::setPoolHighWaterMark(QSettings().value("settings/tilepool", 1024).toInt());
+
 	const QStringList args = app.arguments();
 	if(args.count()>1) {
 		QUrl url(args.at(1));
@@ -50,9 +50,7 @@
 // to enable the two canvases to update simultaneously.
 //#define ENABLE_QML_CANVAS
 
-#ifndef NDEBUG
 #include "core/tile.h"
-#endif
 
 #ifdef Q_OS_OSX
 #define CTRL_KEY "Meta"
@@ -189,19 +187,20 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 	_statusChatButton->hide();
 	_viewStatusBar->addWidget(_statusChatButton);
 
-#ifndef NDEBUG
-	// Debugging tool: show amount of memory consumed by tiles
+	// Show amount of memory consumed by tiles
 	{
 		QLabel *tilemem = new QLabel(this);
 		QTimer *tilememtimer = new QTimer(this);
 		connect(tilememtimer, &QTimer::timeout, [tilemem]() {
-			tilemem->setText(QStringLiteral("Tiles: %1 Mb").arg(paintcore::TileData::megabytesUsed(), 0, 'f', 2));
+			tilemem->setText(tr("Tiles: %1 MB").arg(paintcore::TileData::megabytesUsed(), 0, 'f', 2));
+			tilemem->setToolTip(tr("%1 tiles in use, %2 in reserve")
+				.arg(paintcore::TileData::globalCount())
+				.arg(paintcore::TileData::pooledCount()));
 		});
 		tilememtimer->setInterval(1000);
 		tilememtimer->start(1000);
 		_viewStatusBar->addPermanentWidget(tilemem);
 	}
-#endif
 
 	_viewStatusBar->addPermanentWidget(_viewstatus);
 	_viewStatusBar->addPermanentWidget(_netstatus);
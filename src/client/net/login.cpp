@@ -74,7 +74,8 @@ LoginHandler::LoginHandler(Mode mode, const QUrl &url, QWidget *parent)
 	  m_layerctrllock(true),
 	  m_state(EXPECT_HELLO),
 	  m_multisession(false),
-	  m_tls(false)
+	  m_tls(false),
+	  m_compress(false)
 {
 	m_sessions = new LoginSessionModel(this);
 
@@ -141,6 +142,7 @@ void LoginHandler::receiveMessage(protocol::MessagePtr message)
 	switch(m_state) {
 	case EXPECT_HELLO: expectHello(msg); break;
 	case EXPECT_STARTTLS: expectStartTls(msg); break;
+	case EXPECT_STARTCOMPRESSION: expectStartCompression(msg); break;
 	case WAIT_FOR_LOGIN_PASSWORD: expectNothing(msg); break;
 	case EXPECT_IDENTIFIED: expectIdentified(msg); break;
 	case EXPECT_SESSIONLIST_TO_JOIN: expectSessionDescriptionJoin(msg); break;
@@ -182,6 +184,7 @@ void LoginHandler::expectHello(const protocol::ServerReply &msg)
 	m_canAuth = false;
 	m_mustAuth = false;
 	m_needUserPassword = false;
+	m_compress = false;
 
 	for(const QJsonValue &flag : flags) {
 		if(flag == "MULTI") {
@@ -198,6 +201,8 @@ void LoginHandler::expectHello(const protocol::ServerReply &msg)
 			m_canAuth = true;
 		} else if(flag == "NOGUEST") {
 			m_mustAuth = true;
+		} else if(flag == "DEFLATE") {
+			m_compress = true;
 		} else {
 			qWarning() << "Unknown server capability:" << flag;
 		}
@@ -224,7 +229,7 @@ void LoginHandler::expectHello(const protocol::ServerReply &msg)
 		}
 
 		m_tls = false;
-		prepareToSendIdentity();
+		requestCompression();
 	}
 }
 
@@ -240,6 +245,36 @@ void LoginHandler::expectStartTls(const protocol::ServerReply &msg)
 	}
 }
 
+void LoginHandler::requestCompression()
+{
+	if(m_compress) {
+		m_state = EXPECT_STARTCOMPRESSION;
+
+		protocol::ServerCommand cmd;
+		cmd.cmd = "startCompression";
+		send(cmd);
+
+		// The server's reply is the last uncompressed message
+		m_server->_msgqueue->expectCompression();
+
+	} else {
+		prepareToSendIdentity();
+	}
+}
+
+void LoginHandler::expectStartCompression(const protocol::ServerReply &msg)
+{
+	Q_ASSERT(m_compress);
+	if(msg.reply["compress"].toBool()) {
+		m_server->_msgqueue->startCompression();
+		prepareToSendIdentity();
+
+	} else {
+		qWarning() << "Login error. Expected compress, got:" << msg.reply;
+		failLogin(tr("Incompatible server"));
+	}
+}
+
 void LoginHandler::showPasswordDialog(const QString &title, const QString &text)
 {
 	Q_ASSERT(_passwordDialog.isNull());
@@ -713,8 +748,8 @@ void LoginHandler::tlsStarted()
 void LoginHandler::tlsAccepted()
 {
 	// STARTTLS is the very first command that must be sent, if sent at all
-	// Next up is user authentication.
-	prepareToSendIdentity();
+	// Next up is compression (if supported) and user authentication.
+	requestCompression();
 }
 
 void LoginHandler::cancelLogin()
@@ -199,6 +199,7 @@ private:
 	enum State {
 		EXPECT_HELLO,
 		EXPECT_STARTTLS,
+		EXPECT_STARTCOMPRESSION,
 		WAIT_FOR_LOGIN_PASSWORD,
 		EXPECT_IDENTIFIED,
 		EXPECT_SESSIONLIST_TO_JOIN,
@@ -212,6 +213,8 @@ private:
 	void expectNothing(const protocol::ServerReply &msg);
 	void expectHello(const protocol::ServerReply &msg);
 	void expectStartTls(const protocol::ServerReply &msg);
+	void requestCompression();
+	void expectStartCompression(const protocol::ServerReply &msg);
 	void prepareToSendIdentity();
 	void sendIdentity();
 	void expectIdentified(const protocol::ServerReply &msg);
@@ -262,6 +265,7 @@ private:
 	// Server flags
 	bool m_multisession;
 	bool m_tls;
+	bool m_compress;
 	bool m_canAuth;
 	bool m_mustAuth;
 	bool m_needUserPassword;
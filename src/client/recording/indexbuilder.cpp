@@ -36,10 +36,34 @@
 #include <QColor>
 #include <QBuffer>
 #include <QElapsedTimer>
+#include <QThread>
+#include <QtConcurrent>
 #include <KZip>
 
 namespace recording {
 
+namespace {
+
+//! A snapshot being serialized in a background thread
+struct PendingSnapshot {
+	int index;
+	canvas::StateSavepoint savepoint;
+	QFuture<QByteArray> data;
+};
+
+QByteArray serializeSnapshot(const canvas::StateSavepoint *sp)
+{
+	QBuffer buf;
+	buf.open(QBuffer::ReadWrite);
+	{
+		QDataStream ds(&buf);
+		sp->toDatastream(ds);
+	}
+	return buf.data();
+}
+
+}
+
 IndexBuilder::IndexBuilder(const QString &inputfile, const QString &targetfile, QObject *parent)
 	: QObject(parent), QRunnable(), _inputfile(inputfile), _targetfile(targetfile)
 {
@@ -70,27 +94,24 @@ void IndexBuilder::run()
 		return;
 	}
 
-	MessageRecord record;
+	protocol::MessageView msg;
 	_pos = 0;
-	do {
+	_offset = reader.filePosition();
+	while(reader.readNextView(msg)) {
 		if(_abortflag.load()) {
 			qWarning() << "Indexing aborted (index phase)";
 			emit done(false, "aborted");
 			return;
 		}
 
-		_offset = reader.filePosition();
-		record = reader.readNext();
-		if(record.status == MessageRecord::OK) {
-			protocol::MessagePtr msg(record.message);
+		if(msg.isNull())
+			qWarning() << "unreadable message at index" << _pos;
+		else
 			addToIndex(msg);
-		} else if(record.status == MessageRecord::INVALID) {
-			qWarning() << "invalid message type" << record.error.type << "at index" << _pos;
-		}
-		++_pos;
-	} while(record.status != MessageRecord::END_OF_RECORDING);
-
 
+		++_pos;
+		_offset = reader.filePosition();
+	}
 
 	// Write snapshots
 	reader.rewind();
@@ -136,9 +157,22 @@ void IndexBuilder::writeSnapshots(Reader &reader, KZip &zip)
 	int snapshotCounter = 0;
 	QElapsedTimer timer;
 	timer.start();
+
+	// Snapshots are serialized in background threads, so the rendering
+	// can continue meanwhile. They are written to the zip file in order.
+	QList<PendingSnapshot*> pending;
+	const int maxPending = qMax(1, QThread::idealThreadCount());
+	auto writePending = [&pending, &zip](int keep) {
+		while(pending.size() > keep) {
+			PendingSnapshot *s = pending.takeFirst();
+			zip.writeFile(QString("snapshot-%1").arg(s->index), s->data.result());
+			delete s;
+		}
+	};
+
 	while(true) {
 		if(_abortflag.load())
-			return;
+			break;
 
 		msg = reader.readNext();
 		if(msg.status == MessageRecord::END_OF_RECORDING)
@@ -158,32 +192,63 @@ void IndexBuilder::writeSnapshots(Reader &reader, KZip &zip)
 		if(m_index.snapshots().isEmpty() || ((timer.hasExpired(SNAPSHOT_INTERVAL_MS) || m->type() == protocol::MSG_MARKER) && snapshotCounter>=SNAPSHOT_MIN_ACTIONS)) {
 			qint64 streampos = reader.filePosition();
 			emit progress(streampos);
-			canvas::StateSavepoint sp = statetracker.createSavepoint(-1);
 
-			QBuffer buf;
-			buf.open(QBuffer::ReadWrite);
-			{
-				QDataStream ds(&buf);
-				sp.toDatastream(ds);
-			}
+			// Only the tile directory is copied here, the savepoint
+			// shares its tiles with the canvas
+			PendingSnapshot *s = new PendingSnapshot;
+			s->index = m_index.m_snapshots.size();
+			s->savepoint = statetracker.createSavepoint(-1);
+			s->data = QtConcurrent::run(serializeSnapshot, &s->savepoint);
+			pending.append(s);
 
-			int snapshotIdx = m_index.m_snapshots.size();
-			zip.writeFile(QString("snapshot-%1").arg(snapshotIdx), buf.data());
 			m_index.m_snapshots.append(SnapshotEntry(streampos, reader.currentIndex()));
 
+			// Limit the number of snapshots in memory
+			writePending(maxPending);
+
 			snapshotCounter = 0;
 			timer.restart();
 		}
 	}
+
+	if(_abortflag.load()) {
+		// Index will not be written: just wait for the serialization to finish
+		for(PendingSnapshot *s : pending) {
+			s->data.waitForFinished();
+			delete s;
+		}
+	} else {
+		writePending(0);
+	}
 }
 
-void IndexBuilder::addToIndex(const protocol::MessagePtr msg)
+void IndexBuilder::addToIndex(const protocol::MessageView &msg)
 {
+	// Most messages can be indexed by their type alone. Only the
+	// ones whose content is needed are decoded.
+	protocol::MessagePtr decoded;
+	switch(msg.type()) {
+	using namespace protocol;
+	case MSG_TOOLCHANGE:
+	case MSG_UNDO:
+	case MSG_FILLRECT:
+	case MSG_CHAT:
+	case MSG_MARKER:
+	case MSG_USER_JOIN:
+		decoded = protocol::MessagePtr(msg.toMessage(true));
+		if(decoded.isNull()) {
+			qWarning() << "invalid message type" << msg.type() << "at index" << _pos;
+			return;
+		}
+		break;
+	default: break;
+	}
+
 	IndexType type = IDX_NULL;
 	QString title;
-	quint32 color = _colors[msg->contextId()];
+	quint32 color = _colors[msg.contextId()];
 
-	switch(msg->type()) {
+	switch(msg.type()) {
 	using namespace protocol;
 	case MSG_CANVAS_RESIZE: type = IDX_RESIZE; break;
 
@@ -196,7 +261,7 @@ void IndexBuilder::addToIndex(const protocol::MessagePtr msg)
 	case MSG_PEN_UP: type = IDX_STROKE; break;
 
 	case MSG_TOOLCHANGE:
-		_colors[msg->contextId()] = msg.cast<const protocol::ToolChange>().color();
+		_colors[msg.contextId()] = decoded.cast<const protocol::ToolChange>().color();
 		break;
 
 	case MSG_ANNOTATION_CREATE:
@@ -205,7 +270,7 @@ void IndexBuilder::addToIndex(const protocol::MessagePtr msg)
 	case MSG_ANNOTATION_RESHAPE: type = IDX_ANNOTATE; break;
 
 	case MSG_UNDO:
-		if(msg.cast<const protocol::Undo>().points() > 0)
+		if(decoded.cast<const protocol::Undo>().points() > 0)
 			type = IDX_UNDO;
 		else
 			type = IDX_REDO;
@@ -213,12 +278,12 @@ void IndexBuilder::addToIndex(const protocol::MessagePtr msg)
 
 	case MSG_FILLRECT:
 		type = IDX_FILL;
-		color = msg.cast<const protocol::FillRect>().color();
+		color = decoded.cast<const protocol::FillRect>().color();
 		break;
 
 	case MSG_CHAT:
 		type = IDX_CHAT;
-		title = msg.cast<const protocol::Chat>().message().left(32);
+		title = decoded.cast<const protocol::Chat>().message().left(32);
 		break;
 
 	case MSG_INTERVAL: type = IDX_PAUSE; break;
@@ -227,11 +292,11 @@ void IndexBuilder::addToIndex(const protocol::MessagePtr msg)
 
 	case MSG_MARKER:
 		type = IDX_MARKER;
-		title = msg.cast<const protocol::Marker>().text();
+		title = decoded.cast<const protocol::Marker>().text();
 		break;
 
 	case MSG_USER_JOIN:
-		m_index.m_ctxnames[msg->contextId()] = msg.cast<const protocol::UserJoin>().name();
+		m_index.m_ctxnames[msg.contextId()] = decoded.cast<const protocol::UserJoin>().name();
 		return;
 
 	default: break;
@@ -244,7 +309,7 @@ void IndexBuilder::addToIndex(const protocol::MessagePtr msg)
 		// Combine consecutive messages from the same user
 		for(int i=m_index.m_index.size()-1;i>=0;--i) {
 			IndexEntry &e = m_index.m_index[i];
-			if(e.context_id == msg->contextId()) {
+			if(e.context_id == msg.contextId()) {
 				if(e.type == type) {
 					e.end = _pos;
 					return;
@@ -257,10 +322,10 @@ void IndexBuilder::addToIndex(const protocol::MessagePtr msg)
 		// Combine laser pointer strokes
 		for(int i=m_index.m_index.size()-1;i>=0;--i) {
 			IndexEntry &e = m_index.m_index[i];
-			if(e.context_id == msg->contextId()) {
+			if(e.context_id == msg.contextId()) {
 				if(!(e.flags & IndexEntry::FLAG_FINISHED)) {
 					e.end = _pos;
-					if(msg->type() == protocol::MSG_LASERTRAIL)
+					if(msg.type() == protocol::MSG_LASERTRAIL)
 						e.flags |= IndexEntry::FLAG_FINISHED;
 					return;
 				}
@@ -272,10 +337,10 @@ void IndexBuilder::addToIndex(const protocol::MessagePtr msg)
 		// Combine all strokes up to last pen-up from the same user
 		for(int i=m_index.m_index.size()-1;i>=0;--i) {
 			IndexEntry &e = m_index.m_index[i];
-			if(e.context_id == msg->contextId() && e.type == IDX_STROKE) {
+			if(e.context_id == msg.contextId() && e.type == IDX_STROKE) {
 				if(!(e.flags & IndexEntry::FLAG_FINISHED)) {
 					e.end = _pos;
-					if(msg->type() == protocol::MSG_PEN_UP)
+					if(msg.type() == protocol::MSG_PEN_UP)
 						e.flags |= IndexEntry::FLAG_FINISHED;
 					return;
 				}
@@ -285,7 +350,7 @@ void IndexBuilder::addToIndex(const protocol::MessagePtr msg)
 	}
 
 	// New index entry
-	m_index.m_index.append(IndexEntry(type, msg->contextId(), _offset, _pos, _pos, color, title));
+	m_index.m_index.append(IndexEntry(type, msg.contextId(), _offset, _pos, _pos, color, title));
 }
 
 }
@@ -48,7 +48,7 @@ signals:
 	void done(bool ok, const QString &msg);
 
 private:
-	void addToIndex(const protocol::MessagePtr msg);
+	void addToIndex(const protocol::MessageView &msg);
 	void writeSnapshots(Reader &reader, KZip &zip);
 
 	QString _inputfile, _targetfile;
@@ -43,6 +43,23 @@ CanvasItem::CanvasItem(paintcore::LayerStack *layerstack, QGraphicsItem *parent)
 
 void CanvasItem::refreshImage(const QRect &area)
 {
+	// Paint from a snapshot if available: no need to wait for the layer stack lock
+	const QSharedPointer<const paintcore::LayerStack> snapshot = m_image->snapshot();
+	if(snapshot) {
+		if((m_cache.isNull() || m_cache.size() != snapshot->size()) && snapshot->size().isValid()) {
+			m_cache = QPixmap(snapshot->size());
+			m_cache.fill();
+			m_painted.clear();
+		}
+
+		const QRect changed = snapshot->paintDifference(m_painted.data(), &m_cache);
+		m_painted = snapshot;
+
+		if(!changed.isEmpty())
+			update(changed.adjusted(-2, -2, 2, 2));
+		return;
+	}
+
 	m_refresh |= area;
 	if(m_image->lock(5)) {
 		if((m_cache.isNull() || m_cache.size() != m_image->size()) && m_image->size().isValid()) {
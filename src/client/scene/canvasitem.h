@@ -20,6 +20,7 @@
 #define DP_CANVASITEM_H
 
 #include <QGraphicsObject>
+#include <QSharedPointer>
 
 class QTimer;
 
@@ -54,6 +55,7 @@ protected:
 
 private:
 	paintcore::LayerStack *m_image;
+	QSharedPointer<const paintcore::LayerStack> m_painted;
 	QPixmap m_cache;
 	QRect m_refresh;
 	QTimer *m_refreshTimer;
@@ -184,8 +184,7 @@ void BrushPreview::updatePreview()
 	layer->fillRect(QRect(0, 0, layer->width(), layer->height()), isTransparentBackground() ? QColor(Qt::transparent) : bgcolor, paintcore::BlendMode::MODE_REPLACE);
 
 	paintcore::StrokeState ss(brush);
-	for(int i=1;i<pointvector.size();++i)
-		layer->drawLine(0, brush, pointvector[i-1], pointvector[i], ss);
+	layer->drawLines(0, brush, pointvector[0], pointvector.mid(1), ss);
 
 	layer->mergeSublayer(0);
 
@@ -90,6 +90,10 @@ int main(int argc, char *argv[]) {
 	QCommandLineOption limitOption("history-limit", "Limit history size", "size (Mb)", "0");
 	parser.addOption(limitOption);
 
+	// --history-memory <size>
+	QCommandLineOption memoryLimitOption("history-memory", "Limit in-memory history size", "size (Mb)", "0");
+	parser.addOption(memoryLimitOption);
+
 	// --record, -r <filename>
 	QCommandLineOption recordOption(QStringList() << "record" << "r", "Record session", "filename");
 	parser.addOption(recordOption);
@@ -151,6 +155,10 @@ int main(int argc, char *argv[]) {
 	QCommandLineOption timeoutOption("timeout", "Connection timeout", "seconds", "60");
 	parser.addOption(timeoutOption);
 
+	// --max-lag <size>
+	QCommandLineOption lagOption("max-lag", "Disconnect clients that fall this far behind", "size (Mb)", "0");
+	parser.addOption(lagOption);
+
 	// --announce-whitelist
 	QCommandLineOption announceWhitelist("announce-whitelist", "Session announcement server whitelist", "filename");
 	parser.addOption(announceWhitelist);
@@ -230,6 +238,17 @@ int main(int argc, char *argv[]) {
 		server->setHistoryLimit(limitbytes);
 	}
 
+	{
+		QVariant lv = cfgfile.override(parser, memoryLimitOption);
+		bool ok;
+		float limit = lv.toFloat(&ok);
+		if(!ok || limit<0) {
+			logger::error() << "Invalid history memory limit: " << lv.toString();
+			return 1;
+		}
+		server->setHistoryMemoryLimit(limit * 1024 * 1024);
+	}
+
 	{
 		QVariant rv = cfgfile.override(parser, recordOption);
 		if(!rv.isNull()) {
@@ -332,6 +351,16 @@ int main(int argc, char *argv[]) {
 		server->setConnectionTimeout(timeout * 1000);
 	}
 
+	{
+		bool ok;
+		float lag = cfgfile.override(parser, lagOption).toFloat(&ok);
+		if(!ok || lag<0) {
+			logger::error() << "invalid lag limit";
+			return 1;
+		}
+		server->setClientLagLimit(lag * 1024 * 1024);
+	}
+
 	// Catch signals
 #ifdef Q_OS_UNIX
 	server->connect(UnixSignals::instance(), SIGNAL(sigInt()), server, SLOT(stop()));
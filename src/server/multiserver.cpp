@@ -74,6 +74,11 @@ void MultiServer::setHistoryLimit(uint limit)
 	_sessions->setHistoryLimit(limit);
 }
 
+void MultiServer::setHistoryMemoryLimit(uint limit)
+{
+	_sessions->setHistoryMemoryLimit(limit);
+}
+
 void MultiServer::setMustSecure(bool secure)
 {
 	_sessions->setMustSecure(secure);
@@ -122,6 +127,11 @@ void MultiServer::setConnectionTimeout(int timeout)
 	_sessions->setConnectionTimeout(timeout);
 }
 
+void MultiServer::setClientLagLimit(uint limit)
+{
+	_sessions->setClientLagLimit(limit);
+}
+
 #ifndef NDEBUG
 void MultiServer::setRandomLag(uint lag)
 {
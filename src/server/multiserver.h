@@ -46,6 +46,7 @@ public:
 	void setServerTitle(const QString &title);
 	void setWelcomeMessage(const QString &message);
 	void setHistoryLimit(uint limit);
+	void setHistoryMemoryLimit(uint limit);
 	void setRecordingFile(const QString &filename) { _recordingFile = filename; }
 	void setSplitRecording(bool split) { m_splitRecording = split; }
 	void setSslCertFile(const QString &certfile, const QString &keyfile) { _sslCertFile = certfile; _sslKeyFile = keyfile; }
@@ -58,6 +59,7 @@ public:
 	bool setUserFile(const QString &path);
 	void setAllowGuests(bool allow);
 	void setConnectionTimeout(int timeout);
+	void setClientLagLimit(uint limit);
 	void setAnnounceWhitelist(const QString &path);
 	void setAnnounceLocalAddr(const QString &addr);
 	void setBanlist(const QString &path);
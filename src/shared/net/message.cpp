@@ -55,6 +55,18 @@ int Message::serialize(char *data) const
 	return HEADER_LEN + written;
 }
 
+QSharedPointer<const QByteArray> Message::serializedBuffer() const
+{
+	QSharedPointer<const QByteArray> buffer = m_serialized.toStrongRef();
+	if(!buffer) {
+		QByteArray *data = new QByteArray(length(), Qt::Uninitialized);
+		serialize(data->data());
+		buffer = QSharedPointer<const QByteArray>(data);
+		m_serialized = buffer;
+	}
+	return buffer;
+}
+
 bool Message::equals(const Message &m) const
 {
 	if(type() != m.type() || contextId() != m.contextId())
@@ -21,6 +21,9 @@
 
 #include <QAtomicInt>
 #include <QMetaType>
+#include <QtEndian>
+#include <QByteArray>
+#include <QSharedPointer>
 
 namespace protocol {
 
@@ -199,6 +202,21 @@ public:
 	 */
 	int serialize(char *data) const;
 
+	/**
+	 * @brief Get the serialized form of this message
+	 *
+	 * The buffer is created on first use and shared with everyone who
+	 * requests it while it exists, so a message sent to many recipients
+	 * is serialized only once. The buffer is freed when the last reference
+	 * to it is dropped.
+	 *
+	 * Note. The message should not be modified while the buffer exists.
+	 * This function is not thread safe.
+	 *
+	 * @return buffer containing length() bytes
+	 */
+	QSharedPointer<const QByteArray> serializedBuffer() const;
+
 	/**
 	 * @brief get the length of the message from the given data
 	 *
@@ -263,6 +281,55 @@ private:
 	MessageUndoState _undone;
 	QAtomicInt m_refcount;
 	uint8_t m_contextid;
+	mutable QWeakPointer<const QByteArray> m_serialized;
+};
+
+/**
+ * @brief A read-only view of a serialized message
+ *
+ * This gives access to the message header fields without decoding the message.
+ * The view does not own the data, which must remain valid while the view is used.
+ */
+class MessageView {
+public:
+	MessageView() : m_data(nullptr) { }
+	explicit MessageView(const uchar *data) : m_data(data) { }
+
+	bool isNull() const { return m_data == nullptr; }
+
+	//! Get the message type
+	MessageType type() const { return MessageType(m_data[2]); }
+
+	//! Get the user context ID of the message
+	uint8_t contextId() const { return m_data[3]; }
+
+	//! Get the length of the message payload
+	int payloadLength() const { return qFromBigEndian<quint16>(m_data); }
+
+	//! Get the message length, header included
+	int length() const { return Message::HEADER_LEN + payloadLength(); }
+
+	//! Get the serialized message (length() bytes)
+	const uchar *data() const { return m_data; }
+
+	//! Get the message payload (payloadLength() bytes)
+	const uchar *payload() const { return m_data + Message::HEADER_LEN; }
+
+	bool isCommand() const { return type() >= 128; }
+
+	//! Is this message type undoable? (This must match the message classes' isUndoable())
+	bool isUndoable() const { return isCommand() && type() != MSG_TOOLCHANGE; }
+
+	/**
+	 * @brief Decode the message
+	 *
+	 * @param decodeOpaque decode opaque messages rather than returning OpaqueMessage
+	 * @return new message or 0 if the message is invalid
+	 */
+	Message *toMessage(bool decodeOpaque) const { return Message::deserialize(m_data, length(), decodeOpaque); }
+
+private:
+	const uchar *m_data;
 };
 
 /**
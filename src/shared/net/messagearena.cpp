@@ -0,0 +1,173 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "messagearena.h"
+
+#include <QTemporaryFile>
+#include <QDebug>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#endif
+
+namespace protocol {
+
+MessageArena::MessageArena(Backing backing)
+	: m_backing(backing),
+	  // The largest possible message is a little over 64kb
+	  m_segmentSize(backing == HEAP ? 1024 * 1024 : 16 * 1024 * 1024),
+	  m_file(nullptr), m_firstSegment(0), m_end(0), m_bytes(0)
+{
+}
+
+MessageArena::~MessageArena()
+{
+	clear();
+}
+
+bool MessageArena::append(const Message &msg)
+{
+	const int len = msg.length();
+	qint64 pos;
+	uchar *ptr = allocate(len, pos);
+	if(!ptr)
+		return false;
+
+	msg.serialize(reinterpret_cast<char*>(ptr));
+	m_positions.append(pos);
+	m_undostates.append(char(msg.undoState()));
+	m_bytes += len;
+	return true;
+}
+
+uchar *MessageArena::allocate(int len, qint64 &pos)
+{
+	qint64 segment = m_end / m_segmentSize;
+	if(m_end % m_segmentSize + len > m_segmentSize) {
+		++segment;
+		m_end = segment * m_segmentSize;
+	}
+
+	if(segment - m_firstSegment == m_segments.size()) {
+		uchar *ptr;
+		if(m_backing == HEAP) {
+			ptr = new uchar[m_segmentSize];
+
+		} else {
+			if(!m_file) {
+				m_file = new QTemporaryFile;
+				if(!m_file->open()) {
+					qWarning() << "Couldn't create message arena file:" << m_file->errorString();
+					delete m_file;
+					m_file = nullptr;
+					return nullptr;
+				}
+			}
+
+			if(!m_file->resize((segment+1) * m_segmentSize)) {
+				qWarning() << "Couldn't grow message arena file:" << m_file->errorString();
+				return nullptr;
+			}
+			ptr = m_file->map(segment * m_segmentSize, m_segmentSize);
+			if(!ptr) {
+				qWarning() << "Couldn't map message arena file:" << m_file->errorString();
+				return nullptr;
+			}
+		}
+		m_segments.append(ptr);
+	}
+
+	pos = m_end;
+	m_end += len;
+	return m_segments.at(segment - m_firstSegment) + pos % m_segmentSize;
+}
+
+MessagePtr MessageArena::toMessage(int i, bool decodeOpaque) const
+{
+	Message *msg = at(i).toMessage(decodeOpaque);
+	Q_ASSERT(msg);
+	if(msg)
+		msg->setUndoState(undoState(i));
+	return MessagePtr(msg);
+}
+
+void MessageArena::removeFirst(int count)
+{
+	Q_ASSERT(count>=0 && count<=m_positions.size());
+	if(count == m_positions.size()) {
+		clear();
+		return;
+	}
+
+	for(int i=0;i<count;++i)
+		m_bytes -= at(i).length();
+
+	m_positions.remove(0, count);
+	m_undostates.remove(0, count);
+
+	// Release the segments before the first remaining message
+	const int consumed = m_positions.first() / m_segmentSize - m_firstSegment;
+	for(int i=0;i<consumed;++i)
+		releaseSegment(m_segments.at(i), m_firstSegment + i);
+
+	m_segments.remove(0, consumed);
+	m_firstSegment += consumed;
+}
+
+void MessageArena::clear()
+{
+	// The file is deleted anyway, so there is no need to free its space here
+	for(int i=0;i<m_segments.size();++i) {
+		if(m_backing == HEAP)
+			delete [] m_segments.at(i);
+		else
+			m_file->unmap(m_segments.at(i));
+	}
+
+	// The file is deleted along with the mappings
+	delete m_file;
+	m_file = nullptr;
+
+	m_segments.clear();
+	m_positions.clear();
+	m_undostates.clear();
+	m_firstSegment = 0;
+	m_end = 0;
+	m_bytes = 0;
+}
+
+void MessageArena::releaseSegment(uchar *ptr, qint64 segment)
+{
+	if(m_backing == HEAP) {
+		delete [] ptr;
+		return;
+	}
+
+	m_file->unmap(ptr);
+
+#ifdef Q_OS_LINUX
+	// The file only grows, so free the disk space of the consumed segment.
+	// (If hole punching is not supported, the space is freed when the arena is cleared.)
+	fallocate(m_file->handle(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, segment * m_segmentSize, m_segmentSize);
+#else
+	Q_UNUSED(segment);
+#endif
+}
+
+}
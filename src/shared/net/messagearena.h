@@ -0,0 +1,118 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_SHARED_NET_MSGARENA_H
+#define DP_SHARED_NET_MSGARENA_H
+
+#include <QVector>
+#include <QByteArray>
+
+#include "message.h"
+
+class QTemporaryFile;
+
+namespace protocol {
+
+/**
+ * @brief Compact storage for a sequence of messages
+ *
+ * The messages are stored in serialized form in large contiguous segments,
+ * rather than as individual message objects. The header fields can be read
+ * through MessageView without decoding the messages.
+ *
+ * The segments are either allocated from the heap or memory mapped from
+ * an append-only temporary file. A message never crosses a segment boundary.
+ */
+class MessageArena {
+public:
+	enum Backing {
+		HEAP,       // segments are allocated from the heap
+		MAPPED_FILE // segments are mapped from a temporary file
+	};
+
+	explicit MessageArena(Backing backing);
+	MessageArena(const MessageArena&) = delete;
+	MessageArena &operator=(const MessageArena&) = delete;
+	~MessageArena();
+
+	/**
+	 * @brief Append a message to the arena
+	 *
+	 * The message's undo state is stored along with it.
+	 * @return false if storage couldn't be allocated
+	 */
+	bool append(const Message &msg);
+
+	//! Get the number of messages in the arena
+	int count() const { return m_positions.size(); }
+
+	bool isEmpty() const { return m_positions.isEmpty(); }
+
+	//! Get the total length of the stored messages in bytes
+	quint64 lengthInBytes() const { return m_bytes; }
+
+	//! Get a view of the message at the given index
+	MessageView at(int i) const {
+		const qint64 pos = m_positions.at(i);
+		return MessageView(m_segments.at(pos / m_segmentSize - m_firstSegment) + pos % m_segmentSize);
+	}
+
+	//! Get the undo state of the message at the given index
+	MessageUndoState undoState(int i) const { return MessageUndoState(m_undostates.at(i)); }
+
+	//! Set the undo state of the message at the given index
+	void setUndoState(int i, MessageUndoState state) { m_undostates[i] = state; }
+
+	/**
+	 * @brief Decode the message at the given index
+	 *
+	 * A new message object is returned, with its undo state set.
+	 */
+	MessagePtr toMessage(int i, bool decodeOpaque) const;
+
+	/**
+	 * @brief Remove messages from the beginning of the arena
+	 *
+	 * Segments that no longer contain any messages are released. The disk space
+	 * of released file backed segments is freed where supported.
+	 * @param count number of messages to remove
+	 */
+	void removeFirst(int count);
+
+	//! Remove all messages and release all storage
+	void clear();
+
+private:
+	uchar *allocate(int len, qint64 &pos);
+	void releaseSegment(uchar *ptr, qint64 segment);
+
+	const Backing m_backing;
+	const qint64 m_segmentSize;
+
+	QVector<uchar*> m_segments; // segments from m_firstSegment onwards
+	QVector<qint64> m_positions;
+	QByteArray m_undostates;
+	QTemporaryFile *m_file;
+	qint64 m_firstSegment;
+	qint64 m_end;
+	quint64 m_bytes;
+};
+
+}
+
+#endif
@@ -25,22 +25,67 @@
 #include <QTimer>
 #include <cstring>
 
+#include <zlib.h>
+
 #ifndef NDEBUG
 #include <QThread>
 #endif
 
 namespace protocol {
 
-// Reserve enough buffer space for one complete message
+// Enough buffer space for one complete message
 static const int MAX_BUF_LEN = 1024*64 + protocol::Message::HEADER_LEN;
 
+// Buffers start at this size and grow as needed
+static const int MIN_BUF_LEN = 1024*4;
+
+/**
+ * @brief Make sure the buffer has at least the requested capacity
+ *
+ * The capacity is doubled until it is large enough, but never grown beyond MAX_BUF_LEN.
+ *
+ * @param buffer the buffer to grow (may be null)
+ * @param capacity current capacity of the buffer
+ * @param needed requested capacity
+ * @param used number of bytes to preserve
+ */
+static void reserveBuffer(char *&buffer, int &capacity, int needed, int used)
+{
+	Q_ASSERT(needed <= MAX_BUF_LEN);
+	Q_ASSERT(used <= capacity);
+	if(capacity >= needed)
+		return;
+
+	int newcap = qMax(MIN_BUF_LEN, capacity);
+	while(newcap < needed)
+		newcap *= 2;
+	newcap = qMin(newcap, MAX_BUF_LEN);
+
+	char *newbuf = new char[newcap];
+	if(used>0)
+		memcpy(newbuf, buffer, used);
+	delete [] buffer;
+
+	buffer = newbuf;
+	capacity = newcap;
+}
+
+static void releaseBuffer(char *&buffer, int &capacity)
+{
+	delete [] buffer;
+	buffer = nullptr;
+	capacity = 0;
+}
+
 MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 	: QObject(parent), m_socket(socket),
 	  m_pingTimer(nullptr),
 	  m_lastRecvTime(0),
 	  m_idleTimeout(0), m_pingSent(0), m_closeWhenReady(false),
-	  m_ignoreIncoming(false),
-	  m_decodeOpaque(false)
+	  m_ignoreIncoming(false), m_writeScheduled(false),
+	  m_decodeOpaque(false),
+	  m_deflater(nullptr), m_inflater(nullptr),
+	  m_expectCompression(false)
 {
 	connect(socket, SIGNAL(readyRead()), this, SLOT(readData()));
 	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(dataWritten(qint64)));
@@ -49,11 +94,15 @@ MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 		connect(socket, SIGNAL(encrypted()), this, SLOT(sslEncrypted()));
 	}
 
-	m_recvbuffer = new char[MAX_BUF_LEN];
-	m_sendbuffer = new char[MAX_BUF_LEN];
+	m_recvbuffer = nullptr;
+	m_sendbuffer = nullptr;
+	m_recvcapacity = 0;
+	m_sendcapacity = 0;
+	m_recvstart = 0;
 	m_recvcount = 0;
 	m_sentcount = 0;
 	m_sendbuflen = 0;
+	m_sendqueuebytes = 0;
 
 	m_idleTimer = new QTimer(this);
 	connect(m_idleTimer, &QTimer::timeout, this, &MessageQueue::checkIdleTimeout);
@@ -104,6 +153,15 @@ MessageQueue::~MessageQueue()
 {
 	delete [] m_recvbuffer;
 	delete [] m_sendbuffer;
+
+	if(m_deflater) {
+		deflateEnd(m_deflater);
+		delete m_deflater;
+	}
+	if(m_inflater) {
+		inflateEnd(m_inflater);
+		delete m_inflater;
+	}
 }
 
 bool MessageQueue::isPending() const
@@ -119,18 +177,37 @@ MessagePtr MessageQueue::getPending()
 void MessageQueue::send(MessagePtr packet)
 {
 	if(!m_closeWhenReady) {
-		m_sendqueue.enqueue(packet);
-		if(m_sendbuflen==0)
-			writeData();
+		m_sendqueue.enqueue(packet->serializedBuffer());
+		m_sendqueuebytes += packet->length();
+		scheduleWrite();
+	}
+}
+
+void MessageQueue::sendSerialized(const uchar *data, int len)
+{
+	if(!m_closeWhenReady) {
+		m_sendqueue.enqueue(QSharedPointer<const QByteArray>(new QByteArray(reinterpret_cast<const char*>(data), len)));
+		m_sendqueuebytes += len;
+		scheduleWrite();
 	}
 }
 
 void MessageQueue::sendNow(MessagePtr msg)
 {
 	if(!m_closeWhenReady) {
-		m_sendqueue.prepend(msg);
-		if(m_sendbuflen==0)
-			writeData();
+		m_sendqueue.prepend(msg->serializedBuffer());
+		m_sendqueuebytes += msg->length();
+		scheduleWrite();
+	}
+}
+
+void MessageQueue::scheduleWrite()
+{
+	// The actual writing is done when control returns to the event loop,
+	// so that all the messages sent in the meantime can be written together.
+	if(m_sendbuflen==0 && !m_writeScheduled) {
+		m_writeScheduled = true;
+		QMetaObject::invokeMethod(this, "writeData", Qt::QueuedConnection);
 	}
 }
 
@@ -138,11 +215,47 @@ void MessageQueue::sendDisconnect(int reason, const QString &message)
 {
 	send(MessagePtr(new protocol::Disconnect(0, protocol::Disconnect::Reason(reason), message)));
 	m_ignoreIncoming = true;
+	m_recvstart = 0;
 	m_recvcount = 0;
 }
 
+void MessageQueue::startCompression()
+{
+	m_expectCompression = false;
+
+	if(!m_inflater)
+		startInflating(nullptr, 0);
+
+	// Everything queued before this point is sent uncompressed
+	m_sendqueue.enqueue(QSharedPointer<const QByteArray>());
+	scheduleWrite();
+}
+
+void MessageQueue::expectCompression()
+{
+	m_expectCompression = true;
+}
+
+void MessageQueue::startInflating(const char *data, int len)
+{
+	Q_ASSERT(!m_inflater);
+	m_inflater = new z_stream;
+	memset(m_inflater, 0, sizeof(z_stream));
+	inflateInit(m_inflater);
+
+	// Data already received after the switch point
+	m_inflateInput = QByteArray(data, len);
+	m_inflater->next_in = reinterpret_cast<Bytef*>(m_inflateInput.data());
+	m_inflater->avail_in = len;
+}
+
 void MessageQueue::sendPing()
 {
+	if(m_expectCompression) {
+		// Peer is waiting for compressed data: pinging now would break the stream
+		return;
+	}
+
 	if(m_pingSent==0) {
 		m_pingSent = QDateTime::currentMSecsSinceEpoch();
 	} else {
@@ -155,10 +268,7 @@ void MessageQueue::sendPing()
 
 int MessageQueue::uploadQueueBytes() const
 {
-	int total = m_socket->bytesToWrite() + m_sendbuflen - m_sentcount;
-	for(const MessagePtr msg : m_sendqueue)
-		total += msg->length();
-	return total;
+	return m_socket->bytesToWrite() + m_sendbuflen - m_sentcount + m_sendqueuebytes;
 }
 
 qint64 MessageQueue::idleTime() const
@@ -166,35 +276,98 @@ qint64 MessageQueue::idleTime() const
 	return QDateTime::currentMSecsSinceEpoch() - m_lastRecvTime;
 }
 
+/**
+ * @brief Read (and decompress) data from the socket
+ * @return number of bytes read or -1 on error
+ */
+int MessageQueue::readSocket(char *buffer, int maxlen)
+{
+	if(!m_inflater) {
+		const int read = m_socket->read(buffer, maxlen);
+		if(read<0)
+			emit socketError(m_socket->errorString());
+		return read;
+	}
+
+	int out = 0;
+	while(out==0) {
+		if(m_inflater->avail_in == 0) {
+			m_inflateInput.resize(MAX_BUF_LEN);
+			const int read = m_socket->read(m_inflateInput.data(), m_inflateInput.length());
+			if(read<=0) {
+				m_inflateInput.clear();
+				if(read<0)
+					emit socketError(m_socket->errorString());
+				return read;
+			}
+			m_inflater->next_in = reinterpret_cast<Bytef*>(m_inflateInput.data());
+			m_inflater->avail_in = read;
+		}
+
+		m_inflater->next_out = reinterpret_cast<Bytef*>(buffer);
+		m_inflater->avail_out = maxlen;
+
+		const int ret = inflate(m_inflater, Z_SYNC_FLUSH);
+		if(ret != Z_OK && ret != Z_BUF_ERROR) {
+			qWarning("Couldn't decompress received data (error %d)", ret);
+			emit socketError(tr("Received corrupted data"));
+			return -1;
+		}
+
+		out = maxlen - m_inflater->avail_out;
+	}
+	return out;
+}
+
 void MessageQueue::readData() {
+	if(m_ignoreIncoming) {
+		// Ignore incoming data mode is used when we're shutting down the connection
+		// but want to clear the upload queue
+		m_socket->readAll();
+		return;
+	}
+
 	bool gotmessage = false;
+	bool filled = false;
 	int read, totalread=0;
 	do {
-		// Read as much as fits in to the deserialization buffer
-		read = m_socket->read(m_recvbuffer+m_recvcount, MAX_BUF_LEN-m_recvcount);
-		if(read<0) {
-			emit socketError(m_socket->errorString());
-			return;
+		// Length of the incomplete message at the end of the buffer (if known)
+		const int partial = m_recvcount - m_recvstart;
+		const int msglen = partial >= Message::HEADER_LEN ? Message::sniffLength(m_recvbuffer+m_recvstart) : 0;
+
+		// Make room for more data. Only the incomplete message needs to be
+		// moved, and only when the free space at the end is running low.
+		if(partial == 0) {
+			m_recvstart = 0;
+			m_recvcount = 0;
+		} else if(m_recvstart > 0 && (m_recvcapacity - m_recvcount < m_recvcapacity / 2 || m_recvstart + msglen > m_recvcapacity)) {
+			memmove(m_recvbuffer, m_recvbuffer+m_recvstart, partial);
+			m_recvcount = partial;
+			m_recvstart = 0;
 		}
 
-		if(m_ignoreIncoming) {
-			// Ignore incoming data mode is used when we're shutting down the connection
-			// but want to clear the upload queue
-			if(read>0)
-				continue;
-			else
-				return;
-		}
+		// Grow the buffer if the incomplete message does not fit in it,
+		// or if the previous read filled it (there is likely more data coming)
+		const int needed = qMax(filled ? m_recvcapacity * 2 : MIN_BUF_LEN, m_recvstart + msglen);
+		reserveBuffer(m_recvbuffer, m_recvcapacity, qMin(needed, MAX_BUF_LEN), m_recvcount);
+
+		// Read as much as fits in to the deserialization buffer
+		const int space = m_recvcapacity - m_recvcount;
+		read = readSocket(m_recvbuffer+m_recvcount, space);
+		if(read<0)
+			return;
+		filled = read == space;
 
 		m_recvcount += read;
 
 		// Extract all complete messages
 		int len;
-		while(m_recvcount >= Message::HEADER_LEN && m_recvcount >= (len=Message::sniffLength(m_recvbuffer))) {
+		while(m_recvcount - m_recvstart >= Message::HEADER_LEN && m_recvcount - m_recvstart >= (len=Message::sniffLength(m_recvbuffer+m_recvstart))) {
 			// Whole message received!
-			Message *message = Message::deserialize((const uchar*)m_recvbuffer, m_recvcount, m_decodeOpaque);
+			const char *data = m_recvbuffer + m_recvstart;
+			Message *message = Message::deserialize((const uchar*)data, m_recvcount - m_recvstart, m_decodeOpaque);
 			if(!message) {
-				emit badData(len, m_recvbuffer[2]);
+				emit badData(len, data[2]);
 
 			} else {
 				MessagePtr msg(message);
@@ -223,19 +396,34 @@ void MessageQueue::readData() {
 				} else {
 					m_recvqueue.enqueue(msg);
 					gotmessage = true;
+
+					if(m_expectCompression && !m_inflater && msg->type() == MSG_COMMAND) {
+						// This was the reply to our compression request:
+						// the rest of the stream is compressed
+						m_recvstart += len;
+						startInflating(m_recvbuffer+m_recvstart, m_recvcount-m_recvstart);
+						m_recvcount = m_recvstart;
+						break;
+					}
 				}
 			}
 
-			if(len < m_recvcount) {
-				memmove(m_recvbuffer, m_recvbuffer+len, m_recvcount-len);
-			}
-			m_recvcount -= len;
+			m_recvstart += len;
 		}
 
 		// All messages extracted from buffer (if there were any):
 		// see if there are more bytes in the socket buffer
 		totalread += read;
-	} while(read>0);
+	} while(read>0 && !m_ignoreIncoming);
+
+	// Idle connections don't need a receive buffer
+	if(m_recvstart == m_recvcount) {
+		m_recvstart = 0;
+		m_recvcount = 0;
+		releaseBuffer(m_recvbuffer, m_recvcapacity);
+		if(m_inflater && m_inflater->avail_in == 0)
+			m_inflateInput.clear();
+	}
 
 	if(totalread) {
 		m_lastRecvTime = QDateTime::currentMSecsSinceEpoch();
@@ -260,18 +448,55 @@ void MessageQueue::dataWritten(qint64 bytes)
 }
 
 void MessageQueue::writeData() {
-	if(m_sendbuflen==0 && !m_sendqueue.isEmpty()) {
-		MessagePtr msg = m_sendqueue.dequeue();
-		m_sendbuflen = msg->serialize(m_sendbuffer);
-
-		if(msg->type() == protocol::MSG_DISCONNECT) {
-			// Automatically disconnect after Disconnect notification is sent
-			m_closeWhenReady = true;
-			m_sendqueue.clear();
+	m_writeScheduled = false;
+
+	while(true) {
+		if(m_sendbuflen==0) {
+			if(m_sendqueue.isEmpty()) {
+				releaseBuffer(m_sendbuffer, m_sendcapacity);
+				m_deflated.clear();
+				return;
+			}
+
+			// Pack as many queued messages as fit in the send buffer
+			// so they can be written with a single call
+			reserveBuffer(m_sendbuffer, m_sendcapacity, qMin(m_sendqueuebytes, MAX_BUF_LEN), 0);
+			while(!m_sendqueue.isEmpty()) {
+				if(m_sendqueue.head().isNull()) {
+					// Compression starts here. Send what was packed so far uncompressed.
+					if(m_sendbuflen>0)
+						break;
+
+					m_sendqueue.dequeue();
+					m_deflater = new z_stream;
+					memset(m_deflater, 0, sizeof(z_stream));
+					deflateInit(m_deflater, Z_DEFAULT_COMPRESSION);
+					continue;
+				}
+
+				if(m_sendbuflen + m_sendqueue.head()->length() > m_sendcapacity)
+					break;
+
+				const QSharedPointer<const QByteArray> buffer = m_sendqueue.dequeue();
+				memcpy(m_sendbuffer + m_sendbuflen, buffer->constData(), buffer->length());
+				m_sendbuflen += buffer->length();
+				m_sendqueuebytes -= buffer->length();
+
+				if(MessageView(reinterpret_cast<const uchar*>(buffer->constData())).type() == protocol::MSG_DISCONNECT) {
+					// Automatically disconnect after Disconnect notification is sent
+					m_closeWhenReady = true;
+					m_sendqueue.clear();
+					m_sendqueuebytes = 0;
+				}
+			}
+
+			if(m_sendbuflen==0)
+				continue;
+
+			if(m_deflater)
+				deflateSendBuffer();
 		}
-	}
 
-	if(m_sentcount < m_sendbuflen) {
 #ifndef NDEBUG
 		// Debugging tool: simulate bad network connections by sleeping at odd times
 		if(m_randomlag>0) {
@@ -279,25 +504,47 @@ void MessageQueue::writeData() {
 		}
 #endif
 
-		int sent = m_socket->write(m_sendbuffer+m_sentcount, m_sendbuflen-m_sentcount);
+		const char *data = m_deflater ? m_deflated.constData() : m_sendbuffer;
+		int sent = m_socket->write(data+m_sentcount, m_sendbuflen-m_sentcount);
 		if(sent<0) {
 			// Error
 			emit socketError(m_socket->errorString());
 			return;
 		}
 		m_sentcount += sent;
-		if(m_sentcount == m_sendbuflen) {
-			m_sendbuflen=0;
-			m_sentcount=0;
-			if(m_closeWhenReady) {
-				m_socket->disconnectFromHost();
 
-			} else {
-				writeData();
-			}
+		// Continue when the socket has accepted the rest
+		if(m_sentcount < m_sendbuflen)
+			return;
+
+		m_sendbuflen=0;
+		m_sentcount=0;
+		if(m_closeWhenReady) {
+			releaseBuffer(m_sendbuffer, m_sendcapacity);
+			m_socket->disconnectFromHost();
+			return;
 		}
 	}
 }
 
+void MessageQueue::deflateSendBuffer()
+{
+	Q_ASSERT(m_deflater);
+	m_deflater->next_in = reinterpret_cast<Bytef*>(m_sendbuffer);
+	m_deflater->avail_in = m_sendbuflen;
+
+	// Each batch ends with a sync flush, so the receiver
+	// can decompress all the messages in it right away
+	int out = 0;
+	do {
+		m_deflated.resize(out + deflateBound(m_deflater, m_deflater->avail_in) + 16);
+		m_deflater->next_out = reinterpret_cast<Bytef*>(m_deflated.data() + out);
+		m_deflater->avail_out = m_deflated.length() - out;
+		deflate(m_deflater, Z_SYNC_FLUSH);
+		out = m_deflated.length() - m_deflater->avail_out;
+	} while(m_deflater->avail_out == 0);
+
+	m_sendbuflen = out;
 }
 
+}
@@ -27,6 +27,7 @@
 
 class QTcpSocket;
 class QTimer;
+struct z_stream_s;
 
 namespace protocol {
 
@@ -70,6 +71,15 @@ public:
 	 */
 	void send(MessagePtr message);
 
+	/**
+	 * @brief Enqueue an already serialized message for sending
+	 *
+	 * The data is copied, so it needs to remain valid only for the duration of the call.
+	 * @param data serialized message
+	 * @param len length of the message in bytes
+	 */
+	void sendSerialized(const uchar *data, int len);
+
 	/**
 	 * @brief Gracefully disconnect
 	 *
@@ -82,12 +92,42 @@ public:
 	 */
 	void sendDisconnect(int reason, const QString &message);
 
+	/**
+	 * @brief Start compressing the stream
+	 *
+	 * Messages queued after this call are sent compressed (deflate, flushed
+	 * after each batch of messages.) Received data is decompressed
+	 * immediately, unless decompression was already started by expectCompression().
+	 *
+	 * Compression is negotiated during login. The peer must switch to
+	 * decompression at the same point in the stream.
+	 */
+	void startCompression();
+
+	/**
+	 * @brief Prepare for a compressed incoming stream
+	 *
+	 * Received data is decompressed starting right after the next Command message.
+	 * This is used on the client side, where the server's reply to the
+	 * compression request marks the start of the compressed stream.
+	 * No pings are sent until startCompression() is called, because the
+	 * peer will expect all further data to be compressed.
+	 */
+	void expectCompression();
+
 	/**
 	 * @brief Get the number of bytes in the upload queue
 	 * @return
 	 */
 	int uploadQueueBytes() const;
 
+	/**
+	 * @brief Check if a disconnect message has been queued
+	 *
+	 * No more messages should be sent after this.
+	 */
+	bool isDisconnecting() const { return m_ignoreIncoming; }
+
 	/**
 	 * @brief Get the number of milliseconds since the last message sent by the remote end
 	 */
@@ -178,21 +218,33 @@ private slots:
 	void dataWritten(qint64);
 	void sslEncrypted();
 	void checkIdleTimeout();
+	void writeData();
 
 private:
 	void sendNow(MessagePtr msg);
-
-	void writeData();
+	void scheduleWrite();
+	int readSocket(char *buffer, int maxlen);
+	void startInflating(const char *data, int len);
+	void deflateSendBuffer();
 
 	QTcpSocket *m_socket;
 
+	// The buffers are allocated on demand and released when empty.
+	// Received messages are parsed in place: m_recvstart is the start of
+	// the first unparsed message and m_recvcount the end of received data.
 	char *m_recvbuffer;
 	char *m_sendbuffer;
-	int m_recvcount;
+	int m_recvcapacity, m_sendcapacity;
+	int m_recvstart, m_recvcount;
 	int m_sentcount, m_sendbuflen;
 
 	QQueue<MessagePtr> m_recvqueue;
-	QQueue<MessagePtr> m_sendqueue;
+
+	// Messages are queued in serialized form. The buffers are shared
+	// with other queues sending the same messages. A null buffer
+	// marks the point where compression starts.
+	QQueue<QSharedPointer<const QByteArray>> m_sendqueue;
+	int m_sendqueuebytes;
 
 	QTimer *m_idleTimer;
 	QTimer *m_pingTimer;
@@ -202,9 +254,17 @@ private:
 
 	bool m_closeWhenReady;
 	bool m_ignoreIncoming;
+	bool m_writeScheduled;
 
 	bool m_decodeOpaque;
 
+	// Stream compression
+	z_stream_s *m_deflater;
+	z_stream_s *m_inflater;
+	QByteArray m_deflated;
+	QByteArray m_inflateInput;
+	bool m_expectCompression;
+
 #ifndef NDEBUG
 	uint m_randomlag;
 #endif
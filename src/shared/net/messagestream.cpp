@@ -23,17 +23,77 @@
 namespace protocol {
 
 MessageStream::MessageStream()
-	: m_offset(0), m_bytes(0)
+	: m_compact(nullptr), m_offset(0), m_bytes(0), m_appendedBytes(0), m_memoryLimit(0), m_compactThreshold(0), m_decodeOpaque(false)
 {
 }
 
+MessageStream::~MessageStream()
+{
+	delete m_compact;
+}
+
+void MessageStream::setMemoryLimit(quint64 limit, bool decodeOpaque, MessageArena::Backing backing)
+{
+	Q_ASSERT(compactCount() == 0);
+	delete m_compact;
+	m_compact = limit>0 ? new MessageArena(backing) : nullptr;
+
+	m_memoryLimit = limit;
+	m_compactThreshold = limit;
+	m_decodeOpaque = decodeOpaque;
+}
+
 void MessageStream::append(MessagePtr msg)
 {
 	m_messages.append(msg);
 	m_bytes += msg->length();
+	m_appendedBytes += msg->length();
+
+	if(m_memoryLimit>0 && objectLengthInBytes() > m_compactThreshold)
+		compact();
+}
+
+void MessageStream::setUndoStateAt(int pos, MessageUndoState state)
+{
+	const int i = pos - m_offset;
+	if(i < compactCount()) {
+		// Compacted messages keep their undo state in the arena
+		if(m_compact->at(i).isUndoable())
+			m_compact->setUndoState(i, state);
+	} else {
+		m_messages.at(i - compactCount())->setUndoState(state);
+	}
+}
+
+void MessageStream::compact()
+{
+	// Messages after the oldest protected undo point are likely to be
+	// undone, redone or replayed soon, so they are kept as objects.
+	int keep = m_messages.size();
+	int undo_points = 0;
+	for(int i=m_messages.size()-1;i>=0 && undo_points<UNDO_HISTORY_LIMIT;--i) {
+		if(m_messages.at(i)->type() == MSG_UNDOPOINT) {
+			keep = i;
+			++undo_points;
+		}
+	}
+
+	// Compact messages until the rest take half the limit, so this
+	// is not done again for every new message
+	int count = 0;
+	while(count < keep && objectLengthInBytes() > m_memoryLimit / 2) {
+		if(!m_compact->append(*m_messages.at(count)))
+			break;
+		++count;
+	}
+	m_messages.erase(m_messages.begin(), m_messages.begin() + count);
+
+	// If the protected messages alone exceed the limit, wait until there is
+	// a reasonable amount of new messages before trying again
+	m_compactThreshold = qMax(m_memoryLimit, objectLengthInBytes() + m_memoryLimit / 2);
 }
 
-void MessageStream::hardCleanup(uint sizelimit, int indexlimit)
+void MessageStream::hardCleanup(quint64 sizelimit, int indexlimit)
 {
 	Q_ASSERT(indexlimit <= end());
 
@@ -41,7 +101,7 @@ void MessageStream::hardCleanup(uint sizelimit, int indexlimit)
 	int undo_point = m_offset;
 	int undo_points = 0;
 	for(int i=end()-1;i>=offset() && undo_points<UNDO_HISTORY_LIMIT;--i) {
-		if(at(i)->type() == MSG_UNDOPOINT) {
+		if(typeAt(i) == MSG_UNDOPOINT) {
 			undo_point = i;
 			++undo_points;
 		}
@@ -50,26 +110,49 @@ void MessageStream::hardCleanup(uint sizelimit, int indexlimit)
 	if(undo_point < indexlimit)
 		indexlimit = undo_point;
 
-	// Remove messages until size limit or protected undo point is reached
+	// Remove messages until size limit or protected undo point is reached.
+	// Compacted messages are the oldest, so they are removed first.
+	int compacted = 0;
 	while(m_bytes > sizelimit && m_offset < indexlimit) {
-		m_bytes -= m_messages.takeFirst()->length();
+		if(compacted < compactCount()) {
+			m_bytes -= m_compact->at(compacted).length();
+			++compacted;
+		} else {
+			m_bytes -= m_messages.takeFirst()->length();
+		}
 		++m_offset;
 	}
+
+	if(compacted>0)
+		m_compact->removeFirst(compacted);
 }
 
 void MessageStream::resetTo(int newoffset)
 {
 	m_offset = newoffset;
 	m_messages.clear();
+	if(m_compact)
+		m_compact->clear();
 	m_bytes = 0;
+	m_compactThreshold = m_memoryLimit;
+}
+
+QList<MessagePtr> MessageStream::toList() const
+{
+	QList<MessagePtr> lst;
+	lst.reserve(end() - offset());
+	for(int i=offset();i<end();++i)
+		lst.append(at(i));
+	return lst;
 }
 
 QList<MessagePtr> MessageStream::toCommandList() const
 {
 	QList<MessagePtr> lst;
-	for(MessagePtr m : m_messages)
-		if(m->isCommand())
-			lst.append(m);
+	for(int i=offset();i<end();++i) {
+		if(typeAt(i) >= 128)
+			lst.append(at(i));
+	}
 	return lst;
 }
 
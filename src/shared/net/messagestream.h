@@ -23,16 +23,37 @@
 #include <QList>
 
 #include "message.h"
+#include "messagearena.h"
 
 namespace protocol {
 
 /**
  * @brief The ordered stream of command messages
  *
+ * If a memory limit is set, the oldest messages are moved to a compact
+ * MessageArena when the part of the stream stored as message objects grows too large.
+ * The arena may be backed by an append-only memory mapped temporary file, in which
+ * case the old messages are effectively spilled to disk.
+ * Compacted messages remain accessible by index.
  */
 class MessageStream {
 public:
 	MessageStream();
+	MessageStream(const MessageStream&) = delete;
+	MessageStream &operator=(const MessageStream&) = delete;
+	~MessageStream();
+
+	/**
+	 * @brief Set the maximum size of the part of the stream stored as message objects
+	 *
+	 * Messages that are needed for undo (those after the oldest undo point
+	 * within the undo history limit) are never compacted.
+	 *
+	 * @param limit memory limit in bytes (0 means unlimited)
+	 * @param decodeOpaque decode opaque messages when loading them back from the arena
+	 * @param backing where to store the compacted messages
+	 */
+	void setMemoryLimit(quint64 limit, bool decodeOpaque, MessageArena::Backing backing=MessageArena::MAPPED_FILE);
 
 	/**
 	 * @brief Get the current stream offset
@@ -48,7 +69,7 @@ public:
 	 * @brief Get the end index of the stream
 	 * @return
 	 */
-	int end() const { return m_offset + m_messages.size(); }
+	int end() const { return m_offset + compactCount() + m_messages.size(); }
 
 	/**
 	 * @brief Check if a message at the given index exists in this stream
@@ -57,9 +78,58 @@ public:
 	 */
 	bool isValidIndex(int i) const { return i >= offset() && i < end(); }
 
-	MessagePtr at(int pos) { return m_messages.at(pos-m_offset); }
+	/**
+	 * @brief Get the message at the given index
+	 *
+	 * Compacted messages are decoded as new message objects, so changes
+	 * made to them are not preserved. Use setUndoStateAt to change the undo state.
+	 */
+	MessagePtr at(int pos) const {
+		const int i = pos - m_offset;
+		if(i < compactCount())
+			return m_compact->toMessage(i, m_decodeOpaque);
+		return m_messages.at(i - compactCount());
+	}
 
-	const MessagePtr at(int pos) const { return m_messages.at(pos-m_offset); }
+	/**
+	 * @brief Get the serialized form of the message at the given index
+	 *
+	 * Only compacted messages are stored in serialized form. For others,
+	 * a null view is returned.
+	 */
+	MessageView viewAt(int pos) const {
+		const int i = pos - m_offset;
+		if(i < compactCount())
+			return m_compact->at(i);
+		return MessageView();
+	}
+
+	//! Get the type of the message at the given index without decoding it
+	MessageType typeAt(int pos) const {
+		const int i = pos - m_offset;
+		if(i < compactCount())
+			return m_compact->at(i).type();
+		return m_messages.at(i - compactCount())->type();
+	}
+
+	//! Get the context ID of the message at the given index without decoding it
+	uint8_t contextIdAt(int pos) const {
+		const int i = pos - m_offset;
+		if(i < compactCount())
+			return m_compact->at(i).contextId();
+		return m_messages.at(i - compactCount())->contextId();
+	}
+
+	//! Get the undo state of the message at the given index without decoding it
+	MessageUndoState undoStateAt(int pos) const {
+		const int i = pos - m_offset;
+		if(i < compactCount())
+			return m_compact->undoState(i);
+		return m_messages.at(i - compactCount())->undoState();
+	}
+
+	//! Set the undo state of the message at the given index
+	void setUndoStateAt(int pos, MessageUndoState state);
 
 	/**
 	 * @brief Add a new command to the stream
@@ -76,7 +146,7 @@ public:
 	 * @param indexlimit last index that can be cleaned up
 	 * @pre indexlimit <= end()
 	 */
-	void hardCleanup(uint sizelimit, int indexlimit);
+	void hardCleanup(quint64 sizelimit, int indexlimit);
 
 	/**
 	 * @brief Remove all messages and change the offset
@@ -92,13 +162,28 @@ public:
 	 * representation.
 	 * @return (serialized) length in bytes
 	 */
-	uint lengthInBytes() const { return m_bytes; }
+	quint64 lengthInBytes() const { return m_bytes; }
+
+	/**
+	 * @brief Get the total length of all messages ever appended to the stream
+	 *
+	 * Unlike lengthInBytes(), this does not decrease when messages are removed,
+	 * so it can be used as a byte position in the stream.
+	 */
+	quint64 appendedBytes() const { return m_appendedBytes; }
+
+	/**
+	 * @brief Get the length of the messages stored as message objects in bytes
+	 *
+	 * This is the length of the stream, minus the compacted messages.
+	 */
+	quint64 objectLengthInBytes() const { return m_bytes - (m_compact ? m_compact->lengthInBytes() : 0); }
 
 	/**
 	 * @brief return the whole stream as a list
 	 * @return list of messages
 	 */
-	QList<MessagePtr> toList() const { return m_messages; }
+	QList<MessagePtr> toList() const;
 
 	/**
 	 * @brief return a filtered copy of the stream as a list, containing only the command stream messages.
@@ -107,12 +192,19 @@ public:
 	QList<MessagePtr> toCommandList() const;
 
 private:
+	int compactCount() const { return m_compact ? m_compact->count() : 0; }
+	void compact();
+
 	QList<MessagePtr> m_messages;
+	MessageArena *m_compact;
 	int m_offset;
-	uint m_bytes;
+	quint64 m_bytes;
+	quint64 m_appendedBytes;
+	quint64 m_memoryLimit;
+	quint64 m_compactThreshold;
+	bool m_decodeOpaque;
 };
 
 }
 
 #endif
-
@@ -235,6 +235,19 @@ bool Reader::readNextToBuffer(QByteArray &buffer)
 	return true;
 }
 
+bool Reader::readNextView(protocol::MessageView &view)
+{
+	if(!readNextToBuffer(m_msgbuf))
+		return false;
+
+	if(m_formatversion != version32(DRAWPILE_PROTO_MAJOR_VERSION, DRAWPILE_PROTO_MINOR_VERSION))
+		view = protocol::MessageView();
+	else
+		view = protocol::MessageView(reinterpret_cast<const uchar*>(m_msgbuf.constData()));
+
+	return true;
+}
+
 MessageRecord Reader::readNext()
 {
 	MessageRecord msg;
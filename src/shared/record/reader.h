@@ -163,6 +163,18 @@ public:
 	 */
 	MessageRecord readNext();
 
+	/**
+	 * @brief Read the next message without decoding it
+	 *
+	 * The view points to the reader's internal buffer and is valid until
+	 * the next read. Only recordings in the current format can be viewed:
+	 * for other formats, a null view is returned.
+	 *
+	 * @param view the message view
+	 * @return false at the end of the recording
+	 */
+	bool readNextView(protocol::MessageView &view);
+
 	/**
 	 * @brief Seek to given position in the recording
 	 *
@@ -43,6 +43,9 @@ Client::Client(QTcpSocket *socket, QObject *parent)
 	  m_session(nullptr),
 	  m_socket(socket),
 	  m_streampointer(0),
+	  m_streambytes(0),
+	  m_joinbytes(0),
+	  m_lagLimit(0),
 	  m_id(0),
 	  m_isOperator(false),
 	  m_isModerator(false),
@@ -56,6 +59,11 @@ Client::Client(QTcpSocket *socket, QObject *parent)
 	connect(m_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketError(QAbstractSocket::SocketError)));
 	connect(m_msgqueue, &protocol::MessageQueue::messageAvailable, this, &Client::receiveMessages);
 	connect(m_msgqueue, &protocol::MessageQueue::badData, this, &Client::gotBadData);
+	connect(m_msgqueue, &protocol::MessageQueue::allSent, this, [this]() {
+		// Upload queue has room again: continue sending the session history
+		if(m_state == IN_SESSION)
+			sendAvailableCommands();
+	});
 }
 
 Client::~Client()
@@ -85,6 +93,9 @@ void Client::setSession(Session *session)
 
 	m_state = IN_SESSION;
 	m_streampointer = m_session->mainstream().offset();
+	m_streambytes = m_session->mainstream().appendedBytes() - m_session->mainstream().lengthInBytes();
+	m_joinbytes = m_session->mainstream().appendedBytes();
+	m_directqueue.clear();
 }
 
 void Client::setConnectionTimeout(int timeout)
@@ -104,24 +115,86 @@ QHostAddress Client::peerAddress() const
 	return m_socket->peerAddress();
 }
 
+// Stop taking messages from the stream when this much data is waiting to be sent
+static const int UPLOAD_QUEUE_WATERMARK = 64 * 1024;
+
+quint64 Client::lag() const
+{
+	if(!m_session)
+		return 0;
+	// The initial catch-up doesn't count towards the lag
+	const quint64 sent = qMax(m_streambytes, m_joinbytes);
+	return m_session->mainstream().appendedBytes() - sent + m_msgqueue->uploadQueueBytes();
+}
+
 void Client::sendAvailableCommands()
 {
 	Q_ASSERT(m_state == IN_SESSION);
 
+	if(m_msgqueue->isDisconnecting())
+		return;
+
+	if(m_lagLimit>0 && lag() > m_lagLimit) {
+		logger::warning() << this << "Fell behind by" << lag() << "bytes";
+		disconnectError("Connection too slow");
+		return;
+	}
+
+	enqueueFromStream(false);
+}
+
+void Client::flushAvailableCommands()
+{
+	if(m_state == IN_SESSION)
+		enqueueFromStream(true);
+}
+
+void Client::enqueueFromStream(bool all)
+{
 	// If we're at the moment initializing the session, skip any drawing
 	// commands, because we just sent them.
 	bool skipCommands = m_session->initUserId() == m_id;
 
-	while(m_streampointer < m_session->mainstream().end()) {
-		MessagePtr m = m_session->mainstream().at(m_streampointer++);
-		if(!skipCommands || !m->isCommand())
-			m_msgqueue->send(m);
+	const protocol::MessageStream &stream = m_session->mainstream();
+	Q_ASSERT(m_streampointer >= stream.offset());
+
+	while(m_streampointer < stream.end() && (all || m_msgqueue->uploadQueueBytes() < UPLOAD_QUEUE_WATERMARK)) {
+		sendDirectMessagesUpTo(m_streampointer);
+
+		// Compacted messages are already serialized, so they can be sent as they are
+		const protocol::MessageView view = stream.viewAt(m_streampointer);
+		if(!view.isNull()) {
+			m_streambytes += view.length();
+			if(!skipCommands || !view.isCommand())
+				m_msgqueue->sendSerialized(view.data(), view.length());
+
+		} else {
+			MessagePtr m = stream.at(m_streampointer);
+			m_streambytes += m->length();
+			if(!skipCommands || !m->isCommand())
+				m_msgqueue->send(m);
+		}
+		++m_streampointer;
 	}
+
+	if(m_streampointer == stream.end())
+		sendDirectMessagesUpTo(m_streampointer);
+}
+
+void Client::sendDirectMessagesUpTo(int streampos)
+{
+	while(!m_directqueue.isEmpty() && m_directqueue.first().first <= streampos)
+		m_msgqueue->send(m_directqueue.takeFirst().second);
 }
 
 void Client::sendDirectMessage(protocol::MessagePtr msg)
 {
-	m_msgqueue->send(msg);
+	// Direct messages are sent after the stream messages that were
+	// already there when this was called
+	if(m_state == IN_SESSION && (m_streampointer < m_session->mainstream().end() || !m_directqueue.isEmpty()))
+		m_directqueue.append(qMakePair(m_session->mainstream().end(), msg));
+	else
+		m_msgqueue->send(msg);
 }
 
 void Client::sendSystemChat(const QString &message)
@@ -276,4 +349,9 @@ void Client::startTls()
 	socket->startServerEncryption();
 }
 
+void Client::startCompression()
+{
+	m_msgqueue->startCompression();
+}
+
 }
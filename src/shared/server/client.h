@@ -23,6 +23,7 @@
 #include "../util/logger.h"
 
 #include <QObject>
+#include <QPair>
 #include <QHostAddress>
 #include <QTcpSocket>
 
@@ -109,6 +110,16 @@ public:
 	 */
 	void setConnectionTimeout(int timeout);
 
+	/**
+	 * @brief Set the maximum amount of data this client may fall behind
+	 *
+	 * The lag is the amount of session history not yet sent to the client.
+	 * If it grows beyond the limit, the client is disconnected.
+	 *
+	 * @param limit maximum lag in bytes (0 means unlimited)
+	 */
+	void setLagLimit(uint limit) { m_lagLimit = limit; }
+
 #ifndef NDEBUG
 	void setRandomLag(uint lag);
 #endif
@@ -151,6 +162,25 @@ public:
 	 */
 	int streampointer() const { return m_streampointer; }
 
+	/**
+	 * @brief Get the amount of session history not yet sent to this client
+	 *
+	 * The history that existed when the client joined is not counted,
+	 * since it is expected to take a while to download.
+	 *
+	 * @return lag in bytes (including the upload queue)
+	 */
+	quint64 lag() const;
+
+	/**
+	 * @brief Enqueue all the remaining messages from the message stream
+	 *
+	 * Normally, messages are taken from the stream only when the upload
+	 * queue has room for them. This is used when the old stream is
+	 * about to be discarded.
+	 */
+	void flushAvailableCommands();
+
 	QString toLogString() const;
 
 	/**
@@ -173,6 +203,13 @@ public:
 	 */
 	void startTls();
 
+	/**
+	 * @brief Start compressing the connection
+	 *
+	 * Messages sent before this call are sent uncompressed.
+	 */
+	void startCompression();
+
 	/**
 	 * @brief Send all the messages that were held in queue
 	 */
@@ -189,7 +226,10 @@ signals:
 
 public slots:
 	/**
-	 * @brief Enqueue all available commands for sending
+	 * @brief Enqueue available commands for sending
+	 *
+	 * Messages are taken from the session's message stream only as fast
+	 * as the connection can accept them.
 	 */
 	void sendAvailableCommands();
 
@@ -209,6 +249,8 @@ private:
 	void updateState(protocol::MessagePtr msg);
 
 	bool isHoldLocked() const;
+	void enqueueFromStream(bool all);
+	void sendDirectMessagesUpTo(int streampos);
 
 	State m_state;
 
@@ -218,6 +260,12 @@ private:
 	protocol::MessageQueue *m_msgqueue;
 	QList<protocol::MessagePtr> m_holdqueue;
 	int m_streampointer;
+	quint64 m_streambytes;
+	quint64 m_joinbytes;
+	uint m_lagLimit;
+
+	// Direct messages waiting for the stream pointer to reach the given position
+	QList<QPair<int, protocol::MessagePtr>> m_directqueue;
 
 	int m_id;
 	QString m_username;
@@ -36,7 +36,7 @@
 namespace server {
 
 LoginHandler::LoginHandler(Client *client, SessionServer *server) :
-	QObject(client), m_client(client), m_server(server), m_hostPrivilege(false), m_complete(false)
+	QObject(client), m_client(client), m_server(server), m_hostPrivilege(false), m_complete(false), m_compressed(false)
 {
 	connect(client, &Client::loginMessage, this, &LoginHandler::handleLoginMessage);
 	connect(server, &SessionServer::sessionChanged, this, &LoginHandler::announceSession);
@@ -70,6 +70,8 @@ void LoginHandler::startLoginProcess()
 			flags << "NOGUEST";
 	}
 
+	flags << "DEFLATE";
+
 	greeting.reply["flags"] = flags;
 
 	// Start by telling who we are
@@ -172,6 +174,8 @@ void LoginHandler::handleLoginMessage(protocol::MessagePtr msg)
 		// Wait for user identification before moving on to session listing
 		if(cmd.cmd == "startTls") {
 			handleStarttls();
+		} else if(cmd.cmd == "startCompression") {
+			handleStartCompression();
 		} else if(cmd.cmd == "ident") {
 			handleIdentMessage(cmd);
 		} else {
@@ -465,6 +469,26 @@ void LoginHandler::handleStarttls()
 	m_state = WAIT_FOR_IDENT;
 }
 
+void LoginHandler::handleStartCompression()
+{
+	if(m_compressed) {
+		// Can't send an error reply: the client already expects compressed data
+		logger::notice() << m_client << "Tried to start compression twice";
+		m_client->disconnectError("invalid message");
+		return;
+	}
+
+	protocol::ServerReply reply;
+	reply.type = protocol::ServerReply::LOGIN;
+	reply.message = "Start compression now!";
+	reply.reply["compress"] = true;
+	send(reply);
+
+	// The reply is the last uncompressed message
+	m_client->startCompression();
+	m_compressed = true;
+}
+
 void LoginHandler::send(const protocol::ServerReply &cmd)
 {
 	if(!m_complete)
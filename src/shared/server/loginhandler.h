@@ -49,6 +49,9 @@ struct SessionDescription;
  * C: STARTTLS (if "TLS" is in FEATURES)
  * S: STARTTLS (starts SSL handshake)
  *
+ * C: STARTCOMPRESSION (if "DEFLATE" is in FEATURES)
+ * S: STARTCOMPRESSION (everything after this is compressed, in both directions)
+ *
  * C: IDENT username and password
  * S: IDENTIFIED OK or NEED PASSWORD or ERROR
  *
@@ -74,6 +77,7 @@ struct SessionDescription;
  *    PERSIST - persistent sessions are supported
  *    IDENT   - non-guest access is supported
  *    NOGUEST - guest access is disabled (users must identify with password)
+ *    DEFLATE - stream compression is supported
  *
  * Session ID is a string in the format [a-zA-Z0-9:-]{1,64}
  * If the ID was specified by the user (vanity ID), it is prefixed with '!'
@@ -106,6 +110,7 @@ private:
 	void handleHostMessage(const protocol::ServerCommand &cmd);
 	void handleJoinMessage(const protocol::ServerCommand &cmd);
 	void handleStarttls();
+	void handleStartCompression();
 	void guestLogin(const QString &username);
 	void send(const protocol::ServerReply &cmd);
 	void sendError(const QString &code, const QString &message);
@@ -118,6 +123,7 @@ private:
 	State m_state;
 	bool m_hostPrivilege;
 	bool m_complete;
+	bool m_compressed;
 };
 
 }
@@ -317,6 +317,9 @@ void Session::handleInitComplete(int ctxId)
 	}
 
 	if(m_state == Reset) {
+		// Make sure everyone has the old history before it is discarded
+		for(Client *c : m_clients)
+			c->flushAvailableCommands();
 		m_mainstream.resetTo(m_mainstream.end());
 	}
 
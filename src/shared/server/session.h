@@ -97,6 +97,14 @@ public:
 	uint historyLimit() const { return m_historylimit; }
 	void setHistoryLimit(uint limit) { m_historylimit = limit; }
 
+	/**
+	 * @brief Set the maximum size of the session history kept in memory
+	 *
+	 * Older history is moved to a temporary file.
+	 * @param limit memory limit in bytes (0 means unlimited)
+	 */
+	void setHistoryMemoryLimit(uint limit) { m_mainstream.setMemoryLimit(limit, false); }
+
 	/**
 	 * @brief Set the name of the recording file to create
 	 *
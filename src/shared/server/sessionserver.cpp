@@ -36,7 +36,9 @@ SessionServer::SessionServer(QObject *parent)
 	_identman(nullptr),
 	_sessionLimit(1),
 	_connectionTimeout(0),
+	_clientLagLimit(0),
 	_historyLimit(0),
+	_historyMemoryLimit(0),
 	_expirationTime(0),
 	_allowPersistentSessions(false),
 	_mustSecure(false)
@@ -90,6 +92,7 @@ Session *SessionServer::createSession(const SessionId &id, const QString &protoc
 void SessionServer::initSession(Session *session)
 {
 	session->setHistoryLimit(_historyLimit);
+	session->setHistoryMemoryLimit(_historyMemoryLimit);
 	session->setPersistenceAllowed(allowPersistentSessions());
 	session->setWelcomeMessage(welcomeMessage());
 
@@ -222,6 +225,7 @@ void SessionServer::addClient(Client *client)
 {
 	client->setParent(this);
 	client->setConnectionTimeout(_connectionTimeout);
+	client->setLagLimit(_clientLagLimit);
 
 #ifndef NDEBUG
 	client->setRandomLag(_randomlag);
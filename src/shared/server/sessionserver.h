@@ -72,6 +72,17 @@ public:
 	void setHistoryLimit(uint limit) { _historyLimit = limit; }
 	uint historyLimit() const { return _historyLimit; }
 
+	/**
+	 * @brief Set the amount of session history kept in memory
+	 *
+	 * Older history is moved to a temporary file.
+	 * A limit of 0 means all history is kept in memory.
+	 *
+	 * @param limit max in-memory history size in bytes
+	 */
+	void setHistoryMemoryLimit(uint limit) { _historyMemoryLimit = limit; }
+	uint historyMemoryLimit() const { return _historyMemoryLimit; }
+
 	/**
 	 * @brief Set the password needed to host a sessionCount()
 	 *
@@ -135,6 +146,15 @@ public:
 	void setConnectionTimeout(int timeout) { _connectionTimeout = timeout; }
 	int connectionTimeout() const { return _connectionTimeout; }
 
+	/**
+	 * @brief Set the maximum amount of session history a client may fall behind
+	 *
+	 * Clients lagging further behind are disconnected.
+	 * @param limit limit in bytes (0 means unlimited)
+	 */
+	void setClientLagLimit(uint limit) { _clientLagLimit = limit; }
+	uint clientLagLimit() const { return _clientLagLimit; }
+
 	/**
 	 * @brief Get the session announcement server client
 	 */
@@ -290,7 +310,9 @@ private:
 	QString _welcomeMessage;
 	int _sessionLimit;
 	int _connectionTimeout;
+	uint _clientLagLimit;
 	uint _historyLimit;
+	uint _historyMemoryLimit;
 	qint64 _expirationTime;
 	QString _hostPassword;
 	bool _allowPersistentSessions;
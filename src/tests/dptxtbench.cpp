@@ -0,0 +1,138 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "canvas/statetracker.h"
+#include "canvas/textloader.h"
+#include "core/layerstack.h"
+
+#include <QtTest>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+/**
+ * Measure the render times of the text command scripts in the tests/ directory
+ * and compare them against a stored baseline.
+ *
+ * This is not part of the regular test suite, since timings depend on the
+ * machine and its load. Run it with the dptxt-benchmark target.
+ *
+ * The following environment variables are used:
+ *
+ * - DP_TIMING_UPDATE: if set, the measured times are written to the baseline file
+ */
+class DptxtBenchmark : public QObject
+{
+	Q_OBJECT
+private:
+	// Each script is rendered this many times and the fastest time is used
+	static const int REPEATS = 3;
+
+	// Times shorter than this are too noisy to compare
+	static const int MIN_COMPARABLE_MSECS = 20;
+
+	QJsonObject m_baseline;
+	QJsonObject m_timings;
+	bool m_updateBaseline;
+
+	qint64 render(const QString &filename)
+	{
+		canvas::TextCommandLoader loader(filename);
+		if(!loader.load()) {
+			qWarning("%s", qPrintable(loader.errorMessage()));
+			return -1;
+		}
+		const QList<protocol::MessagePtr> commands = loader.loadInitCommands();
+
+		paintcore::LayerStack image;
+		canvas::StateTracker statetracker(&image, 1);
+
+		QElapsedTimer timer;
+		timer.start();
+		for(const protocol::MessagePtr &msg : commands) {
+			if(msg->isCommand())
+				statetracker.receiveCommand(msg);
+		}
+		image.toFlatImage();
+		return timer.nsecsElapsed();
+	}
+
+private slots:
+	void initTestCase()
+	{
+		m_updateBaseline = !qgetenv("DP_TIMING_UPDATE").isEmpty();
+
+		QFile f(DPTXT_BASELINE);
+		if(f.open(QFile::ReadOnly))
+			m_baseline = QJsonDocument::fromJson(f.readAll()).object();
+	}
+
+	void cleanupTestCase()
+	{
+		if(m_updateBaseline) {
+			QFile f(DPTXT_BASELINE);
+			if(!f.open(QFile::WriteOnly)) {
+				qWarning("Couldn't write %s", DPTXT_BASELINE);
+				return;
+			}
+			f.write(QJsonDocument(m_timings).toJson());
+		}
+	}
+
+	void testRenderTime_data()
+	{
+		QTest::addColumn<QString>("script");
+
+		const QDir dir(TEST_DATA_DIR);
+		for(const QString &name : dir.entryList(QStringList() << "*.dptxt", QDir::Files, QDir::Name))
+			QTest::newRow(qPrintable(name)) << dir.filePath(name);
+	}
+
+	void testRenderTime()
+	{
+		QFETCH(QString, script);
+
+		qint64 best = -1;
+		for(int i=0;i<REPEATS;++i) {
+			const qint64 nsecs = render(script);
+			QVERIFY2(nsecs >= 0, "script could not be loaded");
+			if(best<0 || nsecs < best)
+				best = nsecs;
+		}
+
+		const QString name = QFileInfo(script).completeBaseName();
+		const double msecs = best / 1.0e6;
+		m_timings[name] = msecs;
+		qDebug("%s: %.2f ms", qPrintable(name), msecs);
+
+		if(!m_updateBaseline && m_baseline.contains(name)) {
+			const double baseline = m_baseline[name].toDouble();
+			if(baseline >= MIN_COMPARABLE_MSECS && msecs > baseline * DPTXT_MAX_SLOWDOWN) {
+				qWarning("%s: %.2f ms, baseline %.2f ms", qPrintable(name), msecs, baseline);
+				QFAIL("script rendering is slower than the baseline");
+			}
+		}
+	}
+};
+
+QTEST_GUILESS_MAIN(DptxtBenchmark)
+#include "dptxtbench.moc"
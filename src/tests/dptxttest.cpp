@@ -0,0 +1,167 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "canvas/statetracker.h"
+#include "canvas/textloader.h"
+#include "core/layerstack.h"
+
+#include <QtTest>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+
+/**
+ * Run the text command scripts in the tests/ directory.
+ *
+ * When a script has a matching .expected.png image, the flattened canvas
+ * is compared with it. (Render times are measured by dptxtbench.)
+ *
+ * The following environment variables are used:
+ *
+ * - DP_IMAGE_TOLERANCE: maximum allowed difference per color channel (default 0)
+ * - DP_UPDATE_EXPECTED: if set, the expected images are replaced with the rendered ones
+ */
+class DptxtTest : public QObject
+{
+	Q_OBJECT
+private:
+	int m_tolerance;
+	bool m_updateExpected;
+
+	QImage render(const QString &filename)
+	{
+		canvas::TextCommandLoader loader(filename);
+		if(!loader.load()) {
+			qWarning("%s", qPrintable(loader.errorMessage()));
+			return QImage();
+		}
+		const QList<protocol::MessagePtr> commands = loader.loadInitCommands();
+
+		paintcore::LayerStack image;
+		canvas::StateTracker statetracker(&image, 1);
+
+		for(const protocol::MessagePtr &msg : commands) {
+			if(msg->isCommand())
+				statetracker.receiveCommand(msg);
+		}
+		return image.toFlatImage();
+	}
+
+	// Render a script with a savepoint at every undo point
+	QImage renderWithSavepoints(const QString &filename, bool partialReplay)
+	{
+		canvas::TextCommandLoader loader(filename);
+		if(!loader.load()) {
+			qWarning("%s", qPrintable(loader.errorMessage()));
+			return QImage();
+		}
+
+		paintcore::LayerStack image;
+		canvas::StateTracker statetracker(&image, 1);
+		statetracker.setSavepointTargetLatency(0);
+		statetracker.setPartialReplay(partialReplay);
+
+		for(const protocol::MessagePtr &msg : loader.loadInitCommands()) {
+			if(msg->isCommand())
+				statetracker.receiveCommand(msg);
+		}
+		return image.toFlatImage();
+	}
+
+private slots:
+	void initTestCase()
+	{
+		m_tolerance = 0;
+		m_updateExpected = !qgetenv("DP_UPDATE_EXPECTED").isEmpty();
+
+		bool ok;
+		const int tolerance = qgetenv("DP_IMAGE_TOLERANCE").toInt(&ok);
+		if(ok && tolerance >= 0)
+			m_tolerance = tolerance;
+	}
+
+	void testScript_data()
+	{
+		QTest::addColumn<QString>("script");
+
+		const QDir dir(TEST_DATA_DIR);
+		for(const QString &name : dir.entryList(QStringList() << "*.dptxt", QDir::Files, QDir::Name))
+			QTest::newRow(qPrintable(name)) << dir.filePath(name);
+	}
+
+	void testPartialReplay_data()
+	{
+		testScript_data();
+	}
+
+	// Undo with a partial replay must give the same result as a full replay
+	void testPartialReplay()
+	{
+		QFETCH(QString, script);
+
+		const QImage full = renderWithSavepoints(script, false);
+		const QImage partial = renderWithSavepoints(script, true);
+		QVERIFY2(!full.isNull(), "script could not be loaded");
+
+		QCOMPARE(partial, full);
+	}
+
+	void testScript()
+	{
+		QFETCH(QString, script);
+
+		const QImage result = render(script);
+		QVERIFY2(!result.isNull(), "script could not be loaded");
+
+		// Compare with the expected result, if there is one
+		const QString name = QFileInfo(script).completeBaseName();
+		const QString expectedFile = QFileInfo(script).dir().filePath(name + ".expected.png");
+		if(QFile::exists(expectedFile)) {
+			if(m_updateExpected) {
+				QVERIFY2(result.save(expectedFile), "couldn't write the expected image");
+				return;
+			}
+
+			const QImage expected = QImage(expectedFile).convertToFormat(QImage::Format_ARGB32_Premultiplied);
+			const QImage actual = result.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+			QCOMPARE(actual.size(), expected.size());
+
+			for(int y=0;y<actual.height();++y) {
+				const QRgb *a = reinterpret_cast<const QRgb*>(actual.constScanLine(y));
+				const QRgb *e = reinterpret_cast<const QRgb*>(expected.constScanLine(y));
+				for(int x=0;x<actual.width();++x) {
+					if(
+						qAbs(qRed(a[x]) - qRed(e[x])) > m_tolerance ||
+						qAbs(qGreen(a[x]) - qGreen(e[x])) > m_tolerance ||
+						qAbs(qBlue(a[x]) - qBlue(e[x])) > m_tolerance ||
+						qAbs(qAlpha(a[x]) - qAlpha(e[x])) > m_tolerance
+					) {
+						qWarning("pixel (%d, %d): expected %08x, got %08x", x, y, e[x], a[x]);
+						QFAIL("rendered image differs from the expected result");
+					}
+				}
+			}
+		}
+	}
+};
+
+QTEST_GUILESS_MAIN(DptxtTest)
+#include "dptxttest.moc"
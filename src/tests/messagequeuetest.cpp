@@ -0,0 +1,147 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../shared/net/messagequeue.h"
+#include "../shared/net/image.h"
+#include "../shared/net/meta2.h"
+#include "../shared/net/control.h"
+
+#include <QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+
+using namespace protocol;
+
+/**
+ * Check that messages of all sizes survive the trip through a socket,
+ * no matter how the stream is split into reads, with and without
+ * stream compression.
+ */
+class MessageQueueTest : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testTransfer()
+	{
+		QTcpServer server;
+		QVERIFY(server.listen(QHostAddress::LocalHost));
+
+		QTcpSocket sender;
+		sender.connectToHost(QHostAddress::LocalHost, server.serverPort());
+		QVERIFY(server.waitForNewConnection(5000));
+		QTcpSocket *receiver = server.nextPendingConnection();
+		QVERIFY(receiver);
+
+		MessageQueue out(&sender);
+		MessageQueue in(receiver);
+		in.setDecodeOpaque(true);
+
+		// Mix small messages with ones large enough to fill the whole buffer
+		QList<MessagePtr> expected;
+		for(int i=0;i<200;++i) {
+			MessagePtr msg;
+			if(i % 10 == 0) {
+				const int len = i % 20 == 0 ? PutImage::MAX_LEN : 5000 + i * 100;
+				QByteArray image(len, char(i));
+				msg = MessagePtr(new PutImage(1, 1, 0, i, i, 64, 64, image));
+			} else {
+				msg = MessagePtr(new Chat(1, 0, QByteArray(i, 'x')));
+			}
+			expected << msg;
+
+			// Some of the messages are sent in serialized form
+			if(i % 3 == 0) {
+				const QSharedPointer<const QByteArray> buffer = msg->serializedBuffer();
+				out.sendSerialized(reinterpret_cast<const uchar*>(buffer->constData()), buffer->length());
+			} else {
+				out.send(msg);
+			}
+		}
+
+		QList<MessagePtr> received;
+		connect(&in, &MessageQueue::messageAvailable, [&in, &received]() {
+			while(in.isPending())
+				received << in.getPending();
+		});
+
+		QTRY_COMPARE_WITH_TIMEOUT(received.size(), expected.size(), 10000);
+		for(int i=0;i<expected.size();++i)
+			QVERIFY(received.at(i).equals(expected.at(i)));
+
+		QCOMPARE(out.uploadQueueBytes(), 0);
+	}
+
+	void testCompression()
+	{
+		QTcpServer server;
+		QVERIFY(server.listen(QHostAddress::LocalHost));
+
+		QTcpSocket clientSocket;
+		clientSocket.connectToHost(QHostAddress::LocalHost, server.serverPort());
+		QVERIFY(server.waitForNewConnection(5000));
+		QTcpSocket *serverSocket = server.nextPendingConnection();
+		QVERIFY(serverSocket);
+
+		MessageQueue client(&clientSocket);
+		MessageQueue srv(serverSocket);
+
+		QList<MessagePtr> toClient, toServer;
+		connect(&client, &MessageQueue::messageAvailable, [&client, &toClient]() {
+			while(client.isPending())
+				toClient << client.getPending();
+		});
+		connect(&srv, &MessageQueue::messageAvailable, [&srv, &toServer]() {
+			while(srv.isPending())
+				toServer << srv.getPending();
+		});
+
+		// Client requests compression
+		client.send(MessagePtr(new Command(0, QByteArray("{\"cmd\":\"startCompression\"}"))));
+		client.expectCompression();
+		QTRY_COMPARE(toServer.size(), 1);
+
+		// Server replies and immediately continues with compressed data,
+		// so the reply and the compressed data are likely received together
+		srv.send(MessagePtr(new Command(0, QByteArray("{\"compress\":true}"))));
+		srv.startCompression();
+
+		QList<MessagePtr> expected;
+		for(int i=0;i<100;++i) {
+			MessagePtr msg(new Chat(1, 0, QByteArray(i * 10, 'a' + i % 26)));
+			expected << msg;
+			srv.send(msg);
+		}
+
+		QTRY_COMPARE(toClient.size(), expected.size() + 1);
+		for(int i=0;i<expected.size();++i)
+			QVERIFY(toClient.at(i+1).equals(expected.at(i)));
+
+		// Compressed client to server stream
+		client.startCompression();
+		for(const MessagePtr &msg : expected)
+			client.send(msg);
+
+		QTRY_COMPARE(toServer.size(), expected.size() + 1);
+		for(int i=0;i<expected.size();++i)
+			QVERIFY(toServer.at(i+1).equals(expected.at(i)));
+	}
+};
+
+QTEST_GUILESS_MAIN(MessageQueueTest)
+#include "messagequeuetest.moc"
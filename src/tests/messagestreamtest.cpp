@@ -0,0 +1,123 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../shared/net/messagestream.h"
+#include "../shared/net/image.h"
+#include "../shared/net/undo.h"
+
+#include <QtTest>
+
+using namespace protocol;
+
+/**
+ * Check that messages spilled to disk can still be accessed by index
+ */
+class MessageStreamTest : public QObject
+{
+	Q_OBJECT
+private:
+	static MessagePtr makeMessage(int i)
+	{
+		return MessagePtr(new FillRect(1 + i % 10, 1, 1, i, i*2, 64, 64, 0xff000000 | i));
+	}
+
+private slots:
+	void testSpill()
+	{
+		const int COUNT = 2000;
+
+		MessageStream stream;
+		stream.setMemoryLimit(4096, true);
+
+		QList<MessagePtr> expected;
+		for(int i=0;i<COUNT;++i) {
+			MessagePtr msg = i % 20 == 0 ? MessagePtr(new UndoPoint(1)) : makeMessage(i);
+			if(i % 7 == 0)
+				msg->setUndoState(UNDONE);
+
+			expected << msg;
+			stream.append(msg);
+		}
+
+		QCOMPARE(stream.offset(), 0);
+		QCOMPARE(stream.end(), COUNT);
+		QVERIFY(stream.objectLengthInBytes() < stream.lengthInBytes() / 2);
+
+		quint64 totalLength = 0;
+		for(int i=0;i<COUNT;++i) {
+			MessagePtr msg = stream.at(i);
+			QVERIFY(msg.equals(expected.at(i)));
+			QCOMPARE(msg->undoState(), expected.at(i)->undoState());
+			totalLength += msg->length();
+		}
+		QCOMPARE(stream.lengthInBytes(), totalLength);
+
+		// Cleanup removes the spilled messages first
+		stream.hardCleanup(totalLength / 2, stream.end());
+		QVERIFY(stream.offset() > 0);
+		QVERIFY(stream.lengthInBytes() <= totalLength / 2);
+		for(int i=stream.offset();i<stream.end();++i)
+			QVERIFY(stream.at(i).equals(expected.at(i)));
+	}
+
+	void testCompactAccessors()
+	{
+		const int COUNT = 1000;
+
+		MessageStream stream;
+		stream.setMemoryLimit(2048, true, MessageArena::HEAP);
+
+		for(int i=0;i<COUNT;++i)
+			stream.append(makeMessage(i));
+
+		QVERIFY(stream.objectLengthInBytes() < stream.lengthInBytes());
+
+		for(int i=0;i<COUNT;++i) {
+			QCOMPARE(stream.typeAt(i), MSG_FILLRECT);
+			QCOMPARE(int(stream.contextIdAt(i)), 1 + i % 10);
+			QCOMPARE(stream.undoStateAt(i), DONE);
+		}
+
+		// Undo state changes are preserved for compacted messages too
+		stream.setUndoStateAt(0, UNDONE);
+		QCOMPARE(stream.undoStateAt(0), UNDONE);
+		QCOMPARE(stream.at(0)->undoState(), UNDONE);
+
+		stream.setUndoStateAt(COUNT-1, GONE);
+		QCOMPARE(stream.undoStateAt(COUNT-1), GONE);
+	}
+
+	void testUndoProtection()
+	{
+		MessageStream stream;
+		stream.setMemoryLimit(1024, true);
+
+		// Messages that can still be undone are never spilled
+		for(int i=0;i<UNDO_HISTORY_LIMIT * 10;++i) {
+			if(i % 10 == 0)
+				stream.append(MessagePtr(new UndoPoint(1)));
+			stream.append(makeMessage(i));
+		}
+
+		QCOMPARE(stream.objectLengthInBytes(), stream.lengthInBytes());
+	}
+};
+
+QTEST_GUILESS_MAIN(MessageStreamTest)
+#include "messagestreamtest.moc"
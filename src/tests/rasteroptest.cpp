@@ -0,0 +1,167 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "core/rasterop.h"
+#include "core/rasterop_simd.h"
+
+#include <QtTest>
+#include <QVector>
+
+using namespace paintcore;
+
+Q_DECLARE_METATYPE(paintcore::SimdLevel)
+
+/**
+ * Check that every SIMD compositing kernel produces results that
+ * are bit-identical with the scalar reference implementation.
+ *
+ * Clients with different CPUs must end up with the same canvas content.
+ */
+class RasteropTest : public QObject
+{
+	Q_OBJECT
+private:
+	static const int W = 67; // not a multiple of any vector width, to exercise the tail loops
+	static const int H = 13;
+
+	QVector<BlendMode::Mode> m_modes;
+	QVector<quint32> m_base;
+	QVector<quint32> m_over;
+	QVector<uchar> m_mask;
+
+	//! Generate a random non-premultiplied (tile format) pixel, biased towards fully opaque/transparent values
+	static quint32 randomPixel()
+	{
+		int a = qrand() % 256;
+		switch(qrand() % 4) {
+		case 0: a = 0; break;
+		case 1: a = 255; break;
+		default: break;
+		}
+		const int r = qrand() % 256;
+		const int g = qrand() % 256;
+		const int b = qrand() % 256;
+		return (a << 24) | (r << 16) | (g << 8) | b;
+	}
+
+	static uchar randomMask()
+	{
+		switch(qrand() % 4) {
+		case 0: return 0;
+		case 1: return 255;
+		default: return qrand() % 256;
+		}
+	}
+
+private slots:
+	void initTestCase()
+	{
+		qsrand(1);
+
+		for(int m=BlendMode::MODE_ERASE;m<=BlendMode::MODE_COLORERASE;++m)
+			m_modes << BlendMode::Mode(m);
+		m_modes << BlendMode::MODE_REPLACE;
+
+		m_base.resize(W*H);
+		m_over.resize(W*H);
+		m_mask.resize(W*H);
+		for(int i=0;i<W*H;++i) {
+			m_base[i] = randomPixel();
+			m_over[i] = randomPixel();
+			m_mask[i] = randomMask();
+		}
+
+		// Make sure all-transparent mask runs are present too
+		for(int i=0;i<W;++i)
+			m_mask[i] = 0;
+	}
+
+	void cleanupTestCase()
+	{
+		setSimdLevel(detectSimdLevel());
+	}
+
+	void testCompositeMask_data()
+	{
+		QTest::addColumn<SimdLevel>("level");
+
+		// SIMD_NONE compares the reference with itself: so the test is never empty on non-x86 builds
+		for(int l=SIMD_NONE;l<=detectSimdLevel();++l)
+			QTest::newRow(simdLevelName(SimdLevel(l))) << SimdLevel(l);
+	}
+
+	void testCompositeMask()
+	{
+		QFETCH(SimdLevel, level);
+		QVERIFY(setSimdLevel(level));
+
+		const quint32 colors[] = { 0xff000000, 0xffffffff, 0x80402010, 0x00000000, 0xff7f80fe };
+
+		for(BlendMode::Mode mode : m_modes) {
+			for(quint32 color : colors) {
+				QVector<quint32> expected = m_base;
+				QVector<quint32> actual = m_base;
+
+				// Composite onto a sub-rectangle to test the skip parameters
+				compositeMaskScalar(mode, expected.data()+1, color, m_mask.constData()+1, W-3, H-1, 3, 3);
+				compositeMask(mode, actual.data()+1, color, m_mask.constData()+1, W-3, H-1, 3, 3);
+
+				for(int i=0;i<W*H;++i) {
+					if(expected[i] != actual[i]) {
+						qWarning("mode %d, color %08x, pixel %d: expected %08x, got %08x", mode, color, i, expected[i], actual[i]);
+						QFAIL("compositeMask result differs from reference");
+					}
+				}
+			}
+		}
+	}
+
+	void testCompositePixels_data()
+	{
+		testCompositeMask_data();
+	}
+
+	void testCompositePixels()
+	{
+		QFETCH(SimdLevel, level);
+		QVERIFY(setSimdLevel(level));
+
+		const uchar opacities[] = { 0, 1, 128, 254, 255 };
+
+		for(BlendMode::Mode mode : m_modes) {
+			for(uchar opacity : opacities) {
+				QVector<quint32> expected = m_base;
+				QVector<quint32> actual = m_base;
+
+				compositePixelsScalar(mode, expected.data(), m_over.constData(), W*H-1, opacity);
+				compositePixels(mode, actual.data(), m_over.constData(), W*H-1, opacity);
+
+				for(int i=0;i<W*H;++i) {
+					if(expected[i] != actual[i]) {
+						qWarning("mode %d, opacity %d, pixel %d: expected %08x, got %08x", mode, opacity, i, expected[i], actual[i]);
+						QFAIL("compositePixels result differs from reference");
+					}
+				}
+			}
+		}
+	}
+};
+
+QTEST_MAIN(RasteropTest)
+#include "rasteroptest.moc"
@@ -0,0 +1,102 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "core/tilevector.h"
+
+#include <QtTest>
+#include <QColor>
+
+using namespace paintcore;
+
+/**
+ * Check that copies of a tile vector share unmodified chunks
+ * and that modifications do not leak between copies.
+ */
+class TileVectorTest : public QObject
+{
+	Q_OBJECT
+private:
+	// Not a multiple of the chunk size, so the last chunk is partial
+	static const int SIZE = TileVector::CHUNK * 3 + 5;
+
+private slots:
+	void testCopyOnWrite()
+	{
+		TileVector v1(SIZE);
+		v1.fill(Tile(Qt::red));
+
+		TileVector v2 = v1;
+		for(int c=0;c<v1.chunkCount();++c)
+			QVERIFY(v1.isSameChunk(v2, c));
+
+		// Modifying a tile detaches only the chunk it is in
+		const int idx = TileVector::CHUNK + 1;
+		v2[idx] = Tile(Qt::blue);
+
+		for(int c=0;c<v1.chunkCount();++c)
+			QCOMPARE(v1.isSameChunk(v2, c), c != idx / TileVector::CHUNK);
+
+		QCOMPARE(v1.at(idx).uniformColor(), QColor(Qt::red).rgba());
+		QCOMPARE(v2.at(idx).uniformColor(), QColor(Qt::blue).rgba());
+
+		for(int i=0;i<SIZE;++i) {
+			if(i != idx)
+				QVERIFY(v1.at(i) == v2.at(i));
+		}
+	}
+
+	void testOptimize()
+	{
+		TileVector v(SIZE);
+
+		// A blank tile with pixel data
+		memset(v[SIZE-1].data(), 0, Tile::BYTES);
+		QVERIFY(!v.at(SIZE-1).isUniform());
+
+		// A copy taken before optimization keeps its own tiles
+		const TileVector copy = v;
+
+		v.optimize();
+		QVERIFY(v.at(SIZE-1).isNull());
+		QVERIFY(!copy.at(SIZE-1).isUniform());
+
+		// Unmodified chunks stay shared
+		for(int c=0;c<v.chunkCount()-1;++c)
+			QVERIFY(v.isSameChunk(copy, c));
+	}
+
+	void testDeferredOptimize()
+	{
+		TileVector v(SIZE);
+		memset(v[0].data(), 0, Tile::BYTES);
+
+		// The copy is responsible for optimizing the modified tiles
+		TileVector copy = v;
+		v.clearModified();
+
+		v.optimize();
+		QVERIFY(!v.at(0).isUniform());
+
+		copy.optimize();
+		QVERIFY(copy.at(0).isNull());
+	}
+};
+
+QTEST_GUILESS_MAIN(TileVectorTest)
+#include "tilevectortest.moc"
@@ -0,0 +1,379 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * A headless paint engine benchmark.
+ *
+ * Replays a recording (.dprec) or a text command script (.dptxt) through
+ * the state tracker and the layer stack, without a user interface, and
+ * reports how long it took.
+ */
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QFileInfo>
+#include <QImage>
+#include <QHash>
+#include <QMap>
+
+#include <algorithm>
+
+#include "config.h"
+
+#include "canvas/statetracker.h"
+#include "canvas/textloader.h"
+#include "core/layerstack.h"
+#include "core/brushmask.h"
+#include "core/rasterop.h"
+#include "core/tile.h"
+
+#include "../shared/record/reader.h"
+
+using namespace recording;
+
+namespace {
+
+struct MessageTiming {
+	qint64 count;
+	qint64 nsecs;
+
+	MessageTiming() : count(0), nsecs(0) { }
+};
+
+struct IterationResult {
+	qint64 totalNsecs;
+	qint64 renderNsecs;
+	qint64 messages;
+	qint64 dabs;
+	qint64 tiles;
+	int peakTiles;
+};
+
+const char *messageTypeName(int type)
+{
+	switch(type) {
+	using namespace protocol;
+	case MSG_UNDOPOINT: return "UndoPoint";
+	case MSG_CANVAS_RESIZE: return "CanvasResize";
+	case MSG_LAYER_CREATE: return "LayerCreate";
+	case MSG_LAYER_ATTR: return "LayerAttributes";
+	case MSG_LAYER_RETITLE: return "LayerRetitle";
+	case MSG_LAYER_ORDER: return "LayerOrder";
+	case MSG_LAYER_DELETE: return "LayerDelete";
+	case MSG_LAYER_VISIBILITY: return "LayerVisibility";
+	case MSG_PUTIMAGE: return "PutImage";
+	case MSG_FILLRECT: return "FillRect";
+	case MSG_TOOLCHANGE: return "ToolChange";
+	case MSG_PEN_MOVE: return "PenMove";
+	case MSG_PEN_UP: return "PenUp";
+	case MSG_ANNOTATION_CREATE: return "AnnotationCreate";
+	case MSG_ANNOTATION_RESHAPE: return "AnnotationReshape";
+	case MSG_ANNOTATION_EDIT: return "AnnotationEdit";
+	case MSG_ANNOTATION_DELETE: return "AnnotationDelete";
+	case MSG_UNDO: return "Undo";
+	default: return "Other";
+	}
+}
+
+/**
+ * @brief Load all drawing commands from the input file
+ *
+ * The file is reloaded for every iteration, since the state tracker
+ * modifies the messages (undo flags) as it processes them.
+ */
+bool loadCommands(const QString &filename, QList<protocol::MessagePtr> &commands)
+{
+	commands.clear();
+
+	if(QFileInfo(filename).suffix().compare("dptxt", Qt::CaseInsensitive) == 0) {
+		canvas::TextCommandLoader loader(filename);
+		if(!loader.load()) {
+			fprintf(stderr, "%s\n", loader.errorMessage().toLocal8Bit().constData());
+			return false;
+		}
+		for(const protocol::MessagePtr &msg : loader.loadInitCommands()) {
+			if(msg->isCommand())
+				commands.append(msg);
+		}
+		return true;
+	}
+
+	Reader reader(filename);
+	switch(reader.open()) {
+	case INCOMPATIBLE:
+		fprintf(stderr, "This recording is incompatible.\n");
+		return false;
+	case NOT_DPREC:
+		fprintf(stderr, "Input file is not a Drawpile recording!\n");
+		return false;
+	case CANNOT_READ:
+		fprintf(stderr, "Unable to read input file: %s\n", reader.errorString().toLocal8Bit().constData());
+		return false;
+	case COMPATIBLE:
+	case MINOR_INCOMPATIBILITY:
+	case UNKNOWN_COMPATIBILITY:
+		break;
+	}
+
+	while(true) {
+		MessageRecord mr = reader.readNext();
+		if(mr.status == MessageRecord::END_OF_RECORDING)
+			break;
+		else if(mr.status == MessageRecord::INVALID)
+			continue;
+
+		protocol::MessagePtr msg(mr.message);
+		if(msg->isCommand())
+			commands.append(msg);
+	}
+
+	return true;
+}
+
+/**
+ * @brief Replay the commands once
+ *
+ * @param commands the commands to replay
+ * @param renderInterval flatten dirty tiles after this many commands (0 to disable rendering)
+ * @param timings per message type timings are added here
+ */
+IterationResult replay(const QList<protocol::MessagePtr> &commands, int renderInterval, QHash<int, MessageTiming> &timings)
+{
+	IterationResult result = IterationResult();
+
+	paintcore::LayerStack image;
+	canvas::StateTracker statetracker(&image, 1);
+	QImage view;
+
+	const quint64 stamps0 = paintcore::brushStampStats().stamps;
+
+	QElapsedTimer total;
+	QElapsedTimer timer;
+	total.start();
+
+	int sinceRender = 0;
+	for(const protocol::MessagePtr &msg : commands) {
+		timer.start();
+		statetracker.receiveCommand(msg);
+		MessageTiming &t = timings[msg->type()];
+		++t.count;
+		t.nsecs += timer.nsecsElapsed();
+
+		++result.messages;
+		result.peakTiles = qMax(result.peakTiles, paintcore::TileData::globalCount());
+
+		if(renderInterval>0 && ++sinceRender >= renderInterval) {
+			timer.start();
+			if(view.size() != image.size())
+				view = QImage(image.size(), QImage::Format_ARGB32_Premultiplied);
+			result.tiles += image.paintChangedTiles(QRect(QPoint(), image.size()), &view);
+			result.renderNsecs += timer.nsecsElapsed();
+			sinceRender = 0;
+		}
+	}
+
+	if(renderInterval>0 && !image.size().isEmpty()) {
+		timer.start();
+		if(view.size() != image.size())
+			view = QImage(image.size(), QImage::Format_ARGB32_Premultiplied);
+		result.tiles += image.paintChangedTiles(QRect(QPoint(), image.size()), &view);
+		result.renderNsecs += timer.nsecsElapsed();
+	}
+
+	result.totalNsecs = total.nsecsElapsed();
+	result.dabs = paintcore::brushStampStats().stamps - stamps0;
+
+	return result;
+}
+
+double perSecond(qint64 count, qint64 nsecs)
+{
+	return nsecs > 0 ? count / (nsecs / 1.0e9) : 0;
+}
+
+}
+
+void printVersion()
+{
+	printf("drawpile-bench " DRAWPILE_VERSION "\n");
+	printf("Protocol version: %d.%d\n", DRAWPILE_PROTO_MAJOR_VERSION, DRAWPILE_PROTO_MINOR_VERSION);
+	printf("Qt version: %s (compiled against %s)\n", qVersion(), QT_VERSION_STR);
+}
+
+int main(int argc, char *argv[]) {
+	QCoreApplication app(argc, argv);
+
+	QCoreApplication::setOrganizationName("drawpile");
+	QCoreApplication::setOrganizationDomain("drawpile.net");
+	QCoreApplication::setApplicationName("drawpile-bench");
+	QCoreApplication::setApplicationVersion(DRAWPILE_VERSION);
+
+	// Set up command line arguments
+	QCommandLineParser parser;
+
+	parser.setApplicationDescription("Measure paint engine performance by replaying a recording");
+	parser.addHelpOption();
+
+	// --version, -v
+	QCommandLineOption versionOption(QStringList() << "v" << "version", "Displays version information.");
+	parser.addOption(versionOption);
+
+	// --iterations, -n <count>
+	QCommandLineOption iterationsOption(QStringList() << "iterations" << "n", "Number of times to replay the input", "count", "1");
+	parser.addOption(iterationsOption);
+
+	// --threads, -t <count>
+	QCommandLineOption threadsOption(QStringList() << "threads" << "t", "Maximum number of worker threads (default: one per CPU core)", "count");
+	parser.addOption(threadsOption);
+
+	// --render-interval, -r <count>
+	QCommandLineOption renderOption(QStringList() << "render-interval" << "r", "Flatten changed tiles after every <count> commands (0 disables rendering)", "count", "100");
+	parser.addOption(renderOption);
+
+	// --simd <level>
+	QCommandLineOption simdOption(QStringList() << "simd", "Compositing kernels to use (none, sse2, ssse3 or avx2)", "level");
+	parser.addOption(simdOption);
+
+	// input file name
+	parser.addPositionalArgument("input", "recording or command script", "<input.dprec|input.dptxt>");
+
+	// Parse
+	parser.process(app);
+
+	if(parser.isSet(versionOption)) {
+		printVersion();
+		return 0;
+	}
+
+	const QStringList inputfiles = parser.positionalArguments();
+	if(inputfiles.isEmpty()) {
+		parser.showHelp(1);
+		return 1;
+	}
+
+	const int iterations = qMax(1, parser.value(iterationsOption).toInt());
+	const int renderInterval = qMax(0, parser.value(renderOption).toInt());
+
+	if(parser.isSet(threadsOption)) {
+		const int threads = parser.value(threadsOption).toInt();
+		if(threads<1) {
+			fprintf(stderr, "Invalid thread count\n");
+			return 1;
+		}
+		QThreadPool::globalInstance()->setMaxThreadCount(threads);
+	}
+
+	if(parser.isSet(simdOption)) {
+		const QString name = parser.value(simdOption);
+		bool found = false;
+		for(int l=paintcore::SIMD_NONE;l<=paintcore::SIMD_AVX2;++l) {
+			const paintcore::SimdLevel level = paintcore::SimdLevel(l);
+			if(name.compare(paintcore::simdLevelName(level), Qt::CaseInsensitive) == 0) {
+				if(!paintcore::setSimdLevel(level)) {
+					fprintf(stderr, "SIMD level %s is not supported on this machine\n", paintcore::simdLevelName(level));
+					return 1;
+				}
+				found = true;
+				break;
+			}
+		}
+		if(!found) {
+			fprintf(stderr, "Unknown SIMD level: %s\n", name.toLocal8Bit().constData());
+			return 1;
+		}
+	}
+
+	printf("Input: %s\n", inputfiles.at(0).toLocal8Bit().constData());
+	printf("Threads: %d\n", QThreadPool::globalInstance()->maxThreadCount());
+	printf("Compositing kernels: %s\n", paintcore::simdLevelName(paintcore::simdLevel()));
+	printf("Iterations: %d\n\n", iterations);
+
+	QHash<int, MessageTiming> timings;
+	QList<IterationResult> results;
+
+	for(int i=0;i<iterations;++i) {
+		QList<protocol::MessagePtr> commands;
+		if(!loadCommands(inputfiles.at(0), commands))
+			return 1;
+
+		const IterationResult r = replay(commands, renderInterval, timings);
+		results.append(r);
+
+		printf("#%d: %.1f ms, %lld commands, %.0f dabs/s, %.0f tiles/s, peak %.1f MB of tiles\n",
+			i+1,
+			r.totalNsecs / 1.0e6,
+			r.messages,
+			perSecond(r.dabs, r.totalNsecs),
+			perSecond(r.tiles, r.renderNsecs),
+			r.peakTiles * paintcore::Tile::BYTES / (1024.0 * 1024.0)
+		);
+	}
+
+	// Summary
+	QList<qint64> times;
+	qint64 totalTime=0, totalDabs=0, totalTiles=0, totalRender=0;
+	int peakTiles = 0;
+	for(const IterationResult &r : results) {
+		times.append(r.totalNsecs);
+		totalTime += r.totalNsecs;
+		totalDabs += r.dabs;
+		totalTiles += r.tiles;
+		totalRender += r.renderNsecs;
+		peakTiles = qMax(peakTiles, r.peakTiles);
+	}
+	std::sort(times.begin(), times.end());
+
+	printf("\nWall time: min %.1f ms, median %.1f ms, max %.1f ms\n",
+		times.first() / 1.0e6,
+		times.at(times.size() / 2) / 1.0e6,
+		times.last() / 1.0e6
+	);
+	printf("Dabs: %lld per iteration, %.0f dabs/s\n", totalDabs / iterations, perSecond(totalDabs, totalTime));
+	if(renderInterval>0)
+		printf("Tiles flattened: %lld per iteration, %.0f tiles/s\n", totalTiles / iterations, perSecond(totalTiles, totalRender));
+	printf("Peak tile memory: %.1f MB\n", peakTiles * paintcore::Tile::BYTES / (1024.0 * 1024.0));
+
+	const paintcore::BrushStampStats stampStats = paintcore::brushStampStats();
+	if(stampStats.stamps>0)
+		printf("Brush stamp cache hit rate: %.1f%%\n", 100.0 * stampStats.cacheHits / stampStats.stamps);
+
+	// Per message type timings, slowest first
+	QMap<qint64, int> bytime;
+	for(auto i=timings.constBegin();i!=timings.constEnd();++i)
+		bytime.insertMulti(i.value().nsecs, i.key());
+
+	printf("\n%-20s %10s %12s %12s\n", "Message", "Count", "Total ms", "Avg us");
+	QMapIterator<qint64, int> i(bytime);
+	i.toBack();
+	while(i.hasPrevious()) {
+		i.previous();
+		const MessageTiming &t = timings[i.value()];
+		printf("%-20s %10lld %12.1f %12.2f\n",
+			messageTypeName(i.value()),
+			t.count / iterations,
+			t.nsecs / 1.0e6 / iterations,
+			t.nsecs / 1.0e3 / t.count
+		);
+	}
+
+	return 0;
+}
@@ -0,0 +1,389 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2015 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Micro-benchmarks for the raster operations and brush stamp generation.
+ *
+ * Each case is run repeatedly for a fixed minimum time and the
+ * results are printed as a table, CSV or JSON.
+ */
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QVector>
+
+#include <functional>
+#include <cstring>
+
+#include "config.h"
+
+#include "core/rasterop.h"
+#include "core/blendmodes.h"
+#include "core/brush.h"
+#include "core/brushmask.h"
+#include "core/tile.h"
+
+using namespace paintcore;
+
+namespace {
+
+struct Result {
+	QString op;       // benchmarked function
+	QString mode;     // blend mode or other variant
+	int size;         // mask/brush diameter or number of pixels
+	int opacity;      // 0-255 (-1 if not applicable)
+	bool subpixel;
+	QString simd;     // compositing kernel level
+	qint64 calls;
+	double nsPerCall;
+	double mpixPerSec;
+};
+
+// Maximum number of calls per timed batch
+static const int MAX_BATCH = 16;
+
+/**
+ * @brief Run a function repeatedly for at least the given time
+ *
+ * The function is called in batches of up to MAX_BATCH calls. The reset
+ * function is called before each batch and is not included in the time.
+ *
+ * @param fn the function to benchmark (called with the index of the call in the batch)
+ * @param reset function for restoring the initial state (may be empty)
+ * @param minMsecs minimum time to run
+ * @param calls number of calls made is stored here
+ * @return average time per call in nanoseconds
+ */
+double measure(const std::function<void(int)> &fn, const std::function<void()> &reset, int minMsecs, qint64 &calls)
+{
+	// Warm up caches
+	if(reset)
+		reset();
+	fn(0);
+
+	QElapsedTimer timer;
+	qint64 elapsed = 0;
+	calls = 0;
+	int batch = 1;
+	while(elapsed < minMsecs * qint64(1000000)) {
+		if(reset)
+			reset();
+
+		timer.start();
+		for(int i=0;i<batch;++i)
+			fn(i);
+		elapsed += timer.nsecsElapsed();
+
+		calls += batch;
+		if(batch < MAX_BATCH)
+			batch *= 2;
+	}
+	return elapsed / double(calls);
+}
+
+QVector<BlendMode::Mode> allModes()
+{
+	QVector<BlendMode::Mode> modes;
+	for(int m=BlendMode::MODE_ERASE;m<=BlendMode::MODE_COLORERASE;++m)
+		modes << BlendMode::Mode(m);
+	modes << BlendMode::MODE_REPLACE;
+	return modes;
+}
+
+// Deterministic pseudo random content, so runs are comparable
+QVector<uchar> makeMask(int w, int h, int opacity)
+{
+	QVector<uchar> mask(w * h);
+	quint32 seed = 1;
+	for(int i=0;i<mask.size();++i) {
+		seed = seed * 1103515245 + 12345;
+		// Mostly fully covered, with some soft and empty pixels
+		const int r = (seed >> 16) & 0xff;
+		mask[i] = r < 16 ? 0 : r < 64 ? uchar(r * opacity / 255) : uchar(opacity);
+	}
+	return mask;
+}
+
+QVector<quint32> makePixels(int len, uchar alpha)
+{
+	QVector<quint32> pixels(len);
+	quint32 seed = 2;
+	for(int i=0;i<len;++i) {
+		seed = seed * 1103515245 + 12345;
+		// Premultiplied: color channels must not exceed alpha
+		const quint32 a = alpha ? alpha : (seed >> 24);
+		const quint32 r = ((seed >> 8) & 0xff) * a / 255;
+		const quint32 g = ((seed >> 12) & 0xff) * a / 255;
+		const quint32 b = ((seed >> 16) & 0xff) * a / 255;
+		pixels[i] = (a << 24) | (r << 16) | (g << 8) | b;
+	}
+	return pixels;
+}
+
+class Benchmark {
+public:
+	Benchmark(int minMsecs, const QString &filter) : m_minMsecs(minMsecs), m_filter(filter) { }
+
+	void runRasterOps(SimdLevel simd);
+	void runBrushStamps();
+
+	const QList<Result> &results() const { return m_results; }
+
+private:
+	void run(const QString &op, const QString &mode, int size, int opacity, bool subpixel, const QString &simd, qint64 pixels, const std::function<void(int)> &fn, const std::function<void()> &reset=std::function<void()>());
+
+	int m_minMsecs;
+	QString m_filter;
+	QList<Result> m_results;
+};
+
+void Benchmark::run(const QString &op, const QString &mode, int size, int opacity, bool subpixel, const QString &simd, qint64 pixels, const std::function<void(int)> &fn, const std::function<void()> &reset)
+{
+	if(!m_filter.isEmpty() && !op.contains(m_filter, Qt::CaseInsensitive))
+		return;
+
+	Result r;
+	r.op = op;
+	r.mode = mode;
+	r.size = size;
+	r.opacity = opacity;
+	r.subpixel = subpixel;
+	r.simd = simd;
+	r.nsPerCall = measure(fn, reset, m_minMsecs, r.calls);
+	r.mpixPerSec = pixels / r.nsPerCall * 1000.0;
+	m_results << r;
+
+	fprintf(stderr, ".");
+}
+
+void Benchmark::runRasterOps(SimdLevel simd)
+{
+	const QString simdName = simdLevelName(simd);
+	static const int MASK_SIZES[] = { 3, 9, 32, 64 };
+	static const int OPACITIES[] = { 255, 128 };
+
+	const QVector<quint32> original = makePixels(Tile::LENGTH, 0);
+	const QVector<quint32> over = makePixels(Tile::LENGTH, 0);
+	const quint32 color = 0xff2080c0;
+
+	// Each call in a batch gets a fresh copy of the destination tile.
+	// The copies are restored between batches, outside the timed region.
+	QVector<QVector<quint32>> dest(MAX_BATCH, original);
+	const auto resetDest = [&]() {
+		for(QVector<quint32> &d : dest)
+			memcpy(d.data(), original.constData(), Tile::BYTES);
+	};
+
+	for(const BlendMode::Mode mode : allModes()) {
+		const QString modeName = findBlendMode(mode).svgname;
+
+		for(const int opacity : OPACITIES) {
+			for(const int size : MASK_SIZES) {
+				// Masks are composited onto a tile, like brush dabs
+				const QVector<uchar> mask = makeMask(size, size, opacity);
+				run("compositeMask", modeName, size, opacity, false, simdName, size*size, [&](int i) {
+					compositeMask(mode, dest[i].data(), color, mask.constData(), size, size, 0, Tile::SIZE-size);
+				}, resetDest);
+			}
+
+			run("compositePixels", modeName, Tile::LENGTH, opacity, false, simdName, Tile::LENGTH, [&](int i) {
+				compositePixels(mode, dest[i].data(), over.constData(), Tile::LENGTH, opacity);
+			}, resetDest);
+
+			run("compositeColor", modeName, Tile::LENGTH, opacity, false, simdName, Tile::LENGTH, [&](int i) {
+				compositeColor(mode, dest[i].data(), color, Tile::LENGTH, opacity);
+			}, resetDest);
+		}
+	}
+
+	for(const int size : MASK_SIZES) {
+		const QVector<uchar> mask = makeMask(size, size, 255);
+		run("sampleMask", "", size, -1, false, simdName, size*size, [&](int) {
+			const auto sample = sampleMask(original.constData(), mask.constData(), size, size, 0, Tile::SIZE-size);
+			Q_UNUSED(sample);
+		});
+	}
+
+	run("tintPixels", "", Tile::LENGTH, -1, false, simdName, Tile::LENGTH, [&](int i) {
+		tintPixels(dest[i].data(), Tile::LENGTH, 0x80ff0000);
+	}, resetDest);
+}
+
+void Benchmark::runBrushStamps()
+{
+	static const int SIZES[] = { 1, 4, 16, 64, 256 };
+	static const int OPACITIES[] = { 255, 128 };
+	static const qreal HARDNESS[] = { 1.0, 0.5 };
+
+	for(const int size : SIZES) {
+		for(const int opacity : OPACITIES) {
+			for(const qreal hardness : HARDNESS) {
+				for(int subpixel=0;subpixel<2;++subpixel) {
+					Brush brush(size, hardness, opacity / 255.0);
+					brush.setSubpixel(subpixel);
+
+					// Simulate a stroke: the dab position moves a fraction of a pixel
+					// each time and pressure varies slightly. The stamp cache is used
+					// as it would be in a real stroke.
+					qreal x = 0;
+					qreal pressure = 0.5;
+					qreal dp = 0.001;
+					run(QString("brushStamp/h%1").arg(hardness), "", size, opacity, subpixel, "", size*size, [&](int) {
+						const BrushStamp s = makeGimpStyleBrushStamp(brush, Point(x, 0, qBound(0.0, pressure, 1.0)));
+						Q_UNUSED(s);
+						x += 0.37;
+						pressure += dp;
+						if(pressure >= 1.0 || pressure <= 0.0)
+							dp = -dp;
+					});
+				}
+			}
+		}
+	}
+}
+
+void printTable(const QList<Result> &results)
+{
+	printf("%-20s %-12s %6s %8s %4s %-6s %12s %10s\n", "Operation", "Mode", "Size", "Opacity", "Sub", "SIMD", "ns/call", "Mpix/s");
+	for(const Result &r : results) {
+		printf("%-20s %-12s %6d %8d %4s %-6s %12.1f %10.1f\n",
+			r.op.toLocal8Bit().constData(),
+			r.mode.toLocal8Bit().constData(),
+			r.size,
+			r.opacity,
+			r.subpixel ? "yes" : "no",
+			r.simd.toLocal8Bit().constData(),
+			r.nsPerCall,
+			r.mpixPerSec
+		);
+	}
+}
+
+void printCsv(const QList<Result> &results)
+{
+	printf("op,mode,size,opacity,subpixel,simd,calls,ns_per_call,mpix_per_sec\n");
+	for(const Result &r : results) {
+		printf("%s,%s,%d,%d,%d,%s,%lld,%.2f,%.2f\n",
+			r.op.toLocal8Bit().constData(),
+			r.mode.toLocal8Bit().constData(),
+			r.size,
+			r.opacity,
+			r.subpixel ? 1 : 0,
+			r.simd.toLocal8Bit().constData(),
+			r.calls,
+			r.nsPerCall,
+			r.mpixPerSec
+		);
+	}
+}
+
+void printJson(const QList<Result> &results)
+{
+	QJsonArray list;
+	for(const Result &r : results) {
+		QJsonObject o;
+		o["op"] = r.op;
+		o["mode"] = r.mode;
+		o["size"] = r.size;
+		o["opacity"] = r.opacity;
+		o["subpixel"] = r.subpixel;
+		o["simd"] = r.simd;
+		o["calls"] = double(r.calls);
+		o["ns_per_call"] = r.nsPerCall;
+		o["mpix_per_sec"] = r.mpixPerSec;
+		list << o;
+	}
+
+	QJsonObject doc;
+	doc["version"] = DRAWPILE_VERSION;
+	doc["results"] = list;
+	printf("%s\n", QJsonDocument(doc).toJson().constData());
+}
+
+}
+
+int main(int argc, char *argv[]) {
+	QCoreApplication app(argc, argv);
+
+	QCoreApplication::setOrganizationName("drawpile");
+	QCoreApplication::setOrganizationDomain("drawpile.net");
+	QCoreApplication::setApplicationName("rasterop-bench");
+	QCoreApplication::setApplicationVersion(DRAWPILE_VERSION);
+
+	// Set up command line arguments
+	QCommandLineParser parser;
+
+	parser.setApplicationDescription("Benchmark the paint engine's raster operations");
+	parser.addHelpOption();
+
+	// --format, -f <format>
+	QCommandLineOption formatOption(QStringList() << "format" << "f", "Output format (text, csv or json)", "format", "text");
+	parser.addOption(formatOption);
+
+	// --time, -t <msecs>
+	QCommandLineOption timeOption(QStringList() << "time" << "t", "Minimum run time of each case in milliseconds", "msecs", "100");
+	parser.addOption(timeOption);
+
+	// --filter <name>
+	QCommandLineOption filterOption(QStringList() << "filter", "Run only operations whose name contains this string", "name");
+	parser.addOption(filterOption);
+
+	// --all-simd
+	QCommandLineOption allSimdOption(QStringList() << "all-simd", "Run the raster operations with every supported SIMD level");
+	parser.addOption(allSimdOption);
+
+	// Parse
+	parser.process(app);
+
+	const QString format = parser.value(formatOption);
+	if(format != "text" && format != "csv" && format != "json") {
+		fprintf(stderr, "Unknown output format: %s\n", format.toLocal8Bit().constData());
+		return 1;
+	}
+
+	Benchmark bench(qMax(1, parser.value(timeOption).toInt()), parser.value(filterOption));
+
+	const SimdLevel best = detectSimdLevel();
+	if(parser.isSet(allSimdOption)) {
+		for(int l=SIMD_NONE;l<=best;++l) {
+			setSimdLevel(SimdLevel(l));
+			bench.runRasterOps(SimdLevel(l));
+		}
+		setSimdLevel(best);
+	} else {
+		bench.runRasterOps(simdLevel());
+	}
+
+	bench.runBrushStamps();
+	fprintf(stderr, "\n");
+
+	if(format == "csv")
+		printCsv(bench.results());
+	else if(format == "json")
+		printJson(bench.results());
+	else
+		printTable(bench.results());
+
+	return 0;
+}